@@ -13,6 +13,42 @@ outsl(uint16_t port, const void *addr, uint32_t cnt)
                  : "cc");
 }
 
+static inline uint16_t
+inw(uint16_t port)
+{
+    uint16_t res;
+    asm volatile("inw %1, %0"
+                 : "=a" (res)
+                 : "d" (port));
+    return res;
+}
+
+static inline void
+outw(uint16_t port, uint16_t data)
+{
+    asm volatile("outw %0, %1"
+                 :
+                 : "a" (data), "d" (port));
+}
+
+static inline uint32_t
+inl(uint16_t port)
+{
+    uint32_t res;
+    asm volatile("inl %1, %0"
+                 : "=a" (res)
+                 : "d" (port));
+    return res;
+}
+
+static inline void
+outl(uint16_t port, uint32_t data)
+{
+    asm volatile("outl %0, %1"
+                 :
+                 : "a" (data), "d" (port));
+}
+
 static inline void
 ltr(uint16_t sel)
 {
@@ -36,6 +72,60 @@ lcr3(uint64_t addr)
                  : "r" (addr));
 }
 
+static inline uint64_t
+rcr4(void)
+{
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0"
+                 : "=r" (cr4));
+    return cr4;
+}
+
+static inline void
+lcr4(uint64_t val)
+{
+    asm volatile("mov %0, %%cr4"
+                 :
+                 : "r" (val));
+}
+
+static inline void
+cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    uint32_t a, b, c, d;
+    asm volatile("cpuid"
+                 : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+                 : "0" (leaf), "2" (0));
+    if (eax) *eax = a;
+    if (ebx) *ebx = b;
+    if (ecx) *ecx = c;
+    if (edx) *edx = d;
+}
+
+static inline void
+pause(void)
+{
+    asm volatile("pause");
+}
+
+static inline uint64_t
+rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc"
+                 : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void
+invlpg(uint64_t addr)
+{
+    asm volatile("invlpg (%0)"
+                 :
+                 : "r" (addr)
+                 : "memory");
+}
+
 static inline void
 lgdt(struct segdesc *gdt, size_t size)
 {
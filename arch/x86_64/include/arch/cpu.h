@@ -32,6 +32,10 @@
 
 #define CR4_PSE         0x00000010      // Page size extension
 #define CR4_PAE         0x00000020      // Page size extension
+#define CR4_PCIDE       0x00020000      // Process-context identifiers
+
+// CPUID leaf 1 ECX feature flags
+#define CPUID_1_ECX_PCID 0x00020000
 
 
 #ifndef __ASSEMBLER__
@@ -39,6 +43,8 @@
 #include <stdint.h>
 #include <arch/mmu.h>
 
+struct vpmap;
+
 // X86-64 specific CPU data structure
 struct x86_64_cpu {
     uint8_t lapic_id;
@@ -50,6 +56,8 @@ struct x86_64_cpu {
     int num_disabled;            // Depth of cli nesting.
     int intr_enabled;            // Were interrupts enabled before it's first diabled?
     struct x86_64_cpu *cpu;          // stores current cpu struct address
+    struct vpmap *vpmap;         // vpmap loaded on this cpu
+    int pcide;                   // are PCIDs enabled on this cpu?
 };
 #define MAX_NCPU 32
 extern struct x86_64_cpu x86_64_cpus[MAX_NCPU];
@@ -174,6 +174,7 @@ struct gatedesc {
 #define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size (4MB)
 #define PTE_MBZ         0x180   // Bits must be zero
+#define PTE_CACHED      0x200   // Software: maps a page cache page
 
 #ifndef __ASSEMBLER__
 
@@ -217,6 +218,10 @@ extern char _data[];
 #define USTACK_UPPERBOUND 0xFFFFFF7FFFFFF000
 #define USTACK_LOWERBOUND USTACK_UPPERBOUND - (USTACK_PAGES*PG_SIZE)
 
+// Lowest address of user memregions placed by the kernel (e.g. mmap), well
+// above where the heap can grow
+#define UMMAP_BASE 0x0000100000000000
+
 /*
  * Initial kernel stack lives in the kernel image data section, with size
  * INIT_KSTACK_SIZE. Kernel may later allocates memory and maps the stack to a
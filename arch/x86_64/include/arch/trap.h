@@ -33,6 +33,7 @@
 
 // Syscall
 #define T_SYSCALL       64
+#define T_IPI_TLB       65  // TLB shootdown request from another processor
 
 // Error codes
 #define ERR_X86_TRAP_REG_FAIL 1
@@ -3,8 +3,26 @@
 
 #include <kernel/types.h>
 
+struct rss_stat;
+
 struct vpmap {
     pml4e_t *pml4;
+    struct rss_stat *rss;       // resident page counters, NULL if not tracked
+    uint16_t pcid;              // process-context identifier tagging TLB entries, 0 if none
+    volatile uint32_t active;   // bitmap of cpus running on this vpmap
+    volatile uint32_t stale;    // bitmap of cpus that may cache stale entries of this vpmap
 };
 
+/*
+ * Set up TLB management on the current processor, once its LAPIC is up. Enables
+ * PCIDs if the processor supports them.
+ */
+void tlb_init(void);
+
+/*
+ * Tag a new vpmap with a PCID, and release its PCID once it is destroyed.
+ */
+void tlb_init_vpmap(struct vpmap *vpmap);
+void tlb_release_vpmap(struct vpmap *vpmap);
+
 #endif /* _ARCH_X86_64_VPMAP_H_ */
@@ -6,12 +6,14 @@
 #include <arch/vm.h>
 #include <arch/trap.h>
 #include <arch/cpu.h>
+#include <kernel/vpmap.h>
 
 void
 arch_init(void)
 {
     mp_init();
     lapic_init();
+    tlb_init();
     pic_init();
     ioapic_init();
     seg_init();
@@ -25,6 +27,7 @@ arch_init_ap(void)
 {
     seg_init();
     lapic_init();
+    tlb_init();
     idt_load();
     xchg(&(mycpu()->started), 1); // inform other processors we are up
 }
\ No newline at end of file
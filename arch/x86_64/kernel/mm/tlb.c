@@ -0,0 +1,294 @@
+#include <kernel/vpmap.h>
+#include <kernel/console.h>
+#include <kernel/trap.h>
+#include <kernel/synch.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+#include <arch/cpu.h>
+#include <arch/asm.h>
+#include <arch/lapic.h>
+#include <arch/trap.h>
+#include <arch/mmu.h>
+
+/*
+ * TLB management.
+ *
+ * When processors support PCIDs, each user vpmap is tagged with its own PCID,
+ * so loading a vpmap keeps the TLB entries of the others. A vpmap tracks the
+ * processors running on it (``active``) and the processors that may cache
+ * stale entries of it (``stale``). When the mappings of a vpmap change, the
+ * active processors flush the changed range right away on a shootdown IPI,
+ * and every other processor is marked stale, and flushes the vpmap when it
+ * loads it next.
+ */
+
+#define NUM_PCIDS 4096
+#define CR3_NOFLUSH ((uint64_t)1 << 63)
+// Flushing more pages than this drops all entries of the vpmap instead
+#define TLB_FLUSH_MAX_PAGES 32
+// Number of pages that means the whole vpmap
+#define TLB_FLUSH_ALL ((size_t)-1)
+
+// Set once the current processor can be identified
+static bool tlb_ready = False;
+static bool pcid_supported = False;
+
+// PCIDs in use. PCID 0 is the kernel's, and the fallback once all are taken.
+static uint32_t pcid_bitmap[NUM_PCIDS / 32];
+static struct spinlock pcid_lock;
+
+/*
+ * The shootdown request being processed. Requests are sent one at a time,
+ * by the processor that sets shootdown_lock.
+ */
+static volatile uint32_t shootdown_lock = 0;
+static struct {
+    struct vpmap *vpmap;
+    vaddr_t vaddr;
+    size_t n;
+    volatile uint32_t pending;  // bitmap of cpus that have not flushed yet
+} shootdown;
+
+/* Bit of the current processor in vpmap cpu bitmaps */
+static uint32_t cpu_bit(struct x86_64_cpu *c);
+
+/*
+ * Invalidate n pages starting at vaddr of the vpmap loaded on the current
+ * processor, or all of its entries if n is large.
+ */
+static void flush_local(struct vpmap *vpmap, vaddr_t vaddr, size_t n);
+
+/*
+ * Process the shootdown request if it is pending on the current processor.
+ *
+ * Precondition:
+ * Interrupts are disabled.
+ */
+static void shootdown_serve(void);
+
+/*
+ * Have processors ``cpus`` running on vpmap invalidate n pages starting at
+ * vaddr, and wait until they all did.
+ *
+ * Precondition:
+ * Interrupts are disabled.
+ */
+static void shootdown_send(struct vpmap *vpmap, vaddr_t vaddr, size_t n, uint32_t cpus);
+
+static void tlb_trap_handler(irq_t irq, void *dev, void *regs);
+
+static uint32_t
+cpu_bit(struct x86_64_cpu *c)
+{
+    return (uint32_t)1 << (c - x86_64_cpus);
+}
+
+static void
+flush_local(struct vpmap *vpmap, vaddr_t vaddr, size_t n)
+{
+    struct x86_64_cpu *c = mycpu();
+
+    if (n > TLB_FLUSH_MAX_PAGES) {
+        // Reloading CR3 without CR3_NOFLUSH drops the vpmap's entries
+        lcr3(KMAP_V2P(vpmap->pml4) | (c->pcide ? vpmap->pcid : 0));
+        return;
+    }
+    for (vaddr = pg_round_down(vaddr); n > 0; n--, vaddr += pg_size) {
+        invlpg(vaddr);
+    }
+}
+
+static void
+shootdown_serve(void)
+{
+    struct x86_64_cpu *c = mycpu();
+    uint32_t bit = cpu_bit(c);
+
+    if (!(shootdown.pending & bit)) {
+        return;
+    }
+    // A processor that switched away from the vpmap is already marked stale
+    if (c->vpmap == shootdown.vpmap) {
+        flush_local(shootdown.vpmap, shootdown.vaddr, shootdown.n);
+    }
+    __sync_fetch_and_and(&shootdown.pending, ~bit);
+}
+
+static void
+shootdown_send(struct vpmap *vpmap, vaddr_t vaddr, size_t n, uint32_t cpus)
+{
+    // Keep serving requests of other processors while waiting for ours
+    while (xchg(&shootdown_lock, 1) != 0) {
+        shootdown_serve();
+        pause();
+    }
+    shootdown.vpmap = vpmap;
+    shootdown.vaddr = vaddr;
+    shootdown.n = n;
+    shootdown.pending = cpus;
+    for (int i = 0; i < ncpu; i++) {
+        if (cpus & ((uint32_t)1 << i)) {
+            lapic_send_ipi(x86_64_cpus[i].lapic_id, T_IPI_TLB);
+        }
+    }
+    while (shootdown.pending) {
+        pause();
+    }
+    xchg(&shootdown_lock, 0);
+}
+
+static void
+tlb_trap_handler(irq_t irq, void *dev, void *regs)
+{
+    shootdown_serve();
+    trap_notify_irq_completion();
+}
+
+err_t
+tlb_register_trap_handler(void)
+{
+    return trap_register_handler(T_IPI_TLB, NULL, tlb_trap_handler);
+}
+
+void
+tlb_init(void)
+{
+    struct x86_64_cpu *c = mycpu();
+    uint32_t ecx;
+
+    if (!tlb_ready) {
+        // First processor up sets up the PCID allocator
+        cpuid(1, NULL, NULL, &ecx, NULL);
+        pcid_supported = (ecx & CPUID_1_ECX_PCID) != 0;
+        spinlock_init(&pcid_lock);
+        pcid_bitmap[0] = 1;
+    }
+    // Enabling PCIDs requires PCID 0 in CR3, which the kernel vpmap uses
+    if (pcid_supported) {
+        lcr4(rcr4() | CR4_PCIDE);
+        c->pcide = 1;
+    }
+    c->vpmap = kvpmap;
+    __sync_fetch_and_or(&kvpmap->active, cpu_bit(c));
+    tlb_ready = True;
+}
+
+void
+tlb_init_vpmap(struct vpmap *vpmap)
+{
+    kassert(vpmap);
+    vpmap->pcid = 0;
+    vpmap->active = 0;
+    // The PCID may have tagged another vpmap before
+    vpmap->stale = ~(uint32_t)0;
+    if (!pcid_supported) {
+        return;
+    }
+    spinlock_acquire(&pcid_lock);
+    for (int i = 0; i < NUM_PCIDS / 32; i++) {
+        if (pcid_bitmap[i] != ~(uint32_t)0) {
+            int bit = __builtin_ctz(~pcid_bitmap[i]);
+            pcid_bitmap[i] |= (uint32_t)1 << bit;
+            vpmap->pcid = i * 32 + bit;
+            break;
+        }
+    }
+    spinlock_release(&pcid_lock);
+}
+
+void
+tlb_release_vpmap(struct vpmap *vpmap)
+{
+    kassert(vpmap);
+    kassert(vpmap->active == 0);
+    if (vpmap->pcid == 0) {
+        return;
+    }
+    spinlock_acquire(&pcid_lock);
+    pcid_bitmap[vpmap->pcid / 32] &= ~((uint32_t)1 << (vpmap->pcid % 32));
+    spinlock_release(&pcid_lock);
+    vpmap->pcid = 0;
+}
+
+err_t
+vpmap_load(struct vpmap *vpmap)
+{
+    struct x86_64_cpu *c;
+    uint32_t bit;
+
+    kassert(vpmap);
+    kassert(vpmap->pml4);
+    if (!tlb_ready) {
+        lcr3(KMAP_V2P(vpmap->pml4));
+        return ERR_OK;
+    }
+
+    intr_set_level(INTR_OFF);
+    c = mycpu();
+    bit = cpu_bit(c);
+    if (c->vpmap != vpmap) {
+        if (c->vpmap) {
+            __sync_fetch_and_and(&c->vpmap->active, ~bit);
+        }
+        __sync_fetch_and_or(&vpmap->active, bit);
+        c->vpmap = vpmap;
+    }
+    // Keep the vpmap's entries unless its mappings changed since it last ran
+    // here. PCID 0 is shared, its entries are never kept.
+    if ((__sync_fetch_and_and(&vpmap->stale, ~bit) & bit) || !c->pcide || vpmap->pcid == 0) {
+        lcr3(KMAP_V2P(vpmap->pml4) | (c->pcide ? vpmap->pcid : 0));
+    } else {
+        lcr3(KMAP_V2P(vpmap->pml4) | vpmap->pcid | CR3_NOFLUSH);
+    }
+    intr_set_level(INTR_ON);
+    return ERR_OK;
+}
+
+void
+vpmap_flush_range(struct vpmap *vpmap, vaddr_t vaddr, size_t n)
+{
+    struct x86_64_cpu *c;
+    uint32_t bit, cpus;
+
+    kassert(vpmap);
+    if (n == 0) {
+        return;
+    }
+    if (!tlb_ready) {
+        // Only the boot processor is up, and it runs the kernel vpmap
+        if (vpmap == kvpmap) {
+            flush_local(vpmap, vaddr, n);
+        }
+        return;
+    }
+
+    intr_set_level(INTR_OFF);
+    c = mycpu();
+    bit = cpu_bit(c);
+    // Mark everyone else stale first: a processor that loads the vpmap after
+    // the active bitmap is read below finds its stale bit set
+    __sync_fetch_and_or(&vpmap->stale, ~bit);
+    if (c->vpmap == vpmap) {
+        flush_local(vpmap, vaddr, n);
+    } else {
+        __sync_fetch_and_or(&vpmap->stale, bit);
+    }
+    if ((cpus = vpmap->active & ~bit) != 0) {
+        shootdown_send(vpmap, vaddr, n, cpus);
+    }
+    intr_set_level(INTR_ON);
+}
+
+void
+vpmap_flush_pending(void)
+{
+    if (tlb_ready) {
+        shootdown_serve();
+    }
+}
+
+void
+vpmap_flush_tlb(struct vpmap *vpmap)
+{
+    vpmap_flush_range(vpmap, 0, TLB_FLUSH_ALL);
+}
@@ -1,5 +1,6 @@
 #include <kernel/vpmap.h>
 #include <kernel/pmem.h>
+#include <kernel/rmap.h>
 #include <kernel/proc.h>
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
@@ -16,107 +17,490 @@
  */
 static struct kmem_cache *vpmap_allocator = NULL;
 
+/*
+ * Page tables (the last level of the paging structure) are shared
+ * copy-on-write between the address spaces of a forked process tree. A shared
+ * page table is referenced by a read-only page directory entry in each sharer,
+ * so that every write through it faults, and its reference count is the number
+ * of sharers. The first sharer is the holder: the reverse mappings of the
+ * pages mapped by the shared table are recorded under the holder's vpmap only.
+ * A sharer gets a private copy of the table before modifying any entry.
+ */
+struct pgtable_sharer {
+    Node node;      // linked in the page table page's pt_sharers
+    struct vpmap *vpmap;
+};
+
+static struct kmem_cache *pgtable_sharer_allocator = NULL;
+
+/*
+ * Find the page directory entry for virtual address ``vaddr``. If ``alloc`` is
+ * set, allocate upper level page directories if not present.
+ */
+static pde_t *find_pde(pml4e_t *pml4, vaddr_t vaddr, int alloc);
+
 /*
  * Find the page table entry for virtual address ``vaddr``. If ``alloc`` is set,
  * allocate a page table if not present.
  */
 static pte_t *find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc);
 
+/*
+ * Same as find_pte, but the page table holding the entry is made private to
+ * ``vpmap`` first, so that the caller can modify the entry.
+ */
+static pte_t *find_pte_private(struct vpmap *vpmap, vaddr_t vaddr, int alloc);
+
+/*
+ * Share the page table referenced by ``src_pde`` of ``srcvpmap`` with
+ * ``dstvpmap``, by pointing ``dst_pde`` to it. Both entries become read-only;
+ * the caller flushes ``srcvpmap``'s stale writable translations once all its
+ * tables are shared. Return ERR_NOMEM if failed to record the sharers.
+ */
+static err_t pgtable_share(struct vpmap *srcvpmap, pde_t *src_pde, struct vpmap *dstvpmap, pde_t *dst_pde);
+
+/*
+ * Give ``vpmap`` a private copy of the shared page table referenced by ``pde``,
+ * which maps virtual addresses from ``base``. The pages mapped by the table are
+ * then referenced by both copies, so their entries become read-only. If the
+ * other sharers are gone already, the table is simply made writable again.
+ * The range of the table is flushed once ``pde`` points to the copy.
+ * Return ERR_NOMEM if failed to copy the table.
+ */
+static err_t pgtable_unshare(struct vpmap *vpmap, pde_t *pde, vaddr_t base);
+
+/*
+ * Drop ``vpmap``'s reference to the page table referenced by ``pde`` and clear
+ * ``pde``, without touching the entries of the table, and flush the range of
+ * the table. Return False, leaving
+ * ``pde`` writable, if no other vpmap shares the table: the caller then owns
+ * the table and its pages.
+ */
+static bool pgtable_put(struct vpmap *vpmap, pde_t *pde, vaddr_t base);
+
+/*
+ * Return the sharer entry of ``vpmap`` for page table page ``pt``.
+ */
+static struct pgtable_sharer *pgtable_find_sharer(struct page *pt, struct vpmap *vpmap);
+
+/*
+ * Forget all sharers of a page table page.
+ */
+static void pgtable_clear_sharers(struct page *pt);
+
+/*
+ * Allocate a zeroed page table page, at any level of the paging structure.
+ * Page table pages count their present entries (pt_live of their struct page),
+ * so that the ones left empty by an unmap can be freed.
+ */
+static err_t pgtable_alloc(paddr_t *paddr);
+
+/*
+ * Add n to the live entry count of the page table page holding ``entry``.
+ */
+static void pgtable_count(pte_t *entry, int n);
+
+/*
+ * Clear ``entry``, which refers to an empty page table page, and queue the
+ * page on ``reclaim``. The page is freed by the caller once no TLB can cache
+ * entries of it anymore.
+ */
+static void pgtable_reclaim(pte_t *entry, List *reclaim);
+
+/*
+ * Count a user page table entry ``pte`` becoming present (n = 1) or going
+ * away (n = -1) in the resident page counters of vpmap. Entries mapping page
+ * cache pages carry PTE_CACHED.
+ */
+static void rss_account(struct vpmap *vpmap, pte_t pte, int n);
+
+/*
+ * Count all present entries of page table ``pgtab`` with rss_account.
+ */
+static void rss_account_table(struct vpmap *vpmap, pte_t *pgtab, int n);
+
 /*
  * Clear entry of a pte. Decrement page reference count if page present. Free
- * swap entry if in swap.
+ * swap entry if in swap. ``vaddr`` is the address the pte maps in ``vpmap``,
+ * used to drop the page's reverse mapping.
  */
-static void clear_pte(pml4e_t *pml4, int free_swap);
+static void clear_pte(struct vpmap *vpmap, vaddr_t vaddr, pte_t *pte, int free_swap);
 
 /*
  * Map a range of virtual addresses from ``vaddr`` to ``vaddr + size``, to
  * physical address starting at ``paddr``. Set all page permission to ``perm``.
+ * Mappings in user vpmaps are recorded in the pages' reverse mappings.
  * Return ERR_VPMAP_MAP if failed to map any page in range.
  */
-static err_t map_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm);
+static err_t map_pages(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm);
 
 /*
  * Unmap a range of virtual addresses from ``vaddr`` to ``end``. end exclusive
  * When ``free_swap`` is set, entry in swap will be freed.
- * When ``free_imm`` is set, all intermediate page tables are freed as well
+ * When ``free_imm`` is set, all intermediate page tables are freed as well.
+ * Otherwise, if ``reclaim`` is not NULL, intermediate page tables left empty
+ * are unlinked and queued on ``reclaim``.
  */
-static void unmap_pages(pml4e_t *pml4, vaddr_t vaddr, vaddr_t end, int free_swap, int free_imm);
+static void unmap_pages(struct vpmap *vpmap, vaddr_t vaddr, vaddr_t end, int free_swap, int free_imm,
+    List *reclaim);
 
-/* Utility functions for unmapping other page dir*/
-static void unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr,
-    int pdptx_start, int pdptx_end, int free_swap, int free_imm);
+/*
+ * Utility functions for unmapping other page dir. ``base`` is the virtual
+ * address mapped by the first entry of the page dir.
+ */
+static void unmap_pdpt(struct vpmap *vpmap, pdpte_t *pdpt, vaddr_t base, vaddr_t start_addr,
+    vaddr_t end_addr, int free_swap, int free_imm, List *reclaim);
+
+static void unmap_pd(struct vpmap *vpmap, pde_t *pde, vaddr_t base, vaddr_t start_addr,
+    vaddr_t end_addr, int free_swap, int free_imm, List *reclaim);
+
+/*
+ * Index range [*first, *last] of the entries of a page dir that map part of
+ * [start_addr, end_addr). ``base`` is the virtual address mapped by the first
+ * entry and ``shift`` the log2 of the size mapped by one entry.
+ */
+static void entry_range(vaddr_t base, int shift, vaddr_t start_addr, vaddr_t end_addr, int *first, int *last);
 
-static void unmap_pd(pde_t *pde, vaddr_t start_addr, vaddr_t end_addr,
-    int pdx_start, int pdx_end, int free_swap, int free_imm);
+/*
+ * Build a canonical virtual address from page table indices.
+ */
+static vaddr_t pgaddr(int pml4x, int pdptx, int pdx, int ptx);
 
 /*
  * memperm to pteperm translation.
  */
 static pteperm_t memperm_to_pteperm(memperm_t memperm);
 
-static pte_t*
-find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
+static pde_t*
+find_pde(pml4e_t *pml4, vaddr_t vaddr, int alloc)
 {
     kassert(pml4);
     pml4e_t *pml4e;
     pdpte_t *pdpt, *pdpte;
-    pde_t *pgdir, *pde;
-    pte_t *pgtab;
+    pde_t *pgdir;
     paddr_t paddr;
 
     // top level walk
     pml4e = &pml4[PML4X(vaddr)];
     if ((*pml4e & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pgtable_alloc(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pml4e = paddr | PTE_P | PTE_W | PTE_U;
+        pgtable_count(pml4e, 1);
     }
 
     // second level walk
     pdpt = (pdpte_t* )KMAP_P2V(PML4E_ADDR(*pml4e));
     pdpte = &pdpt[PDPTX(vaddr)];
     if ((*pdpte & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pgtable_alloc(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pdpte = paddr | PTE_P | PTE_W | PTE_U;
+        pgtable_count(pdpte, 1);
     }
 
-    // third level walk
     pgdir = (pde_t*) KMAP_P2V(PDPTE_ADDR(*pdpte));
-    pde = &pgdir[PDX(vaddr)];
+    return &pgdir[PDX(vaddr)];
+}
+
+static pte_t*
+find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
+{
+    pde_t *pde;
+    pte_t *pgtab;
+    paddr_t paddr;
+
+    // third level walk
+    if ((pde = find_pde(pml4, vaddr, alloc)) == NULL) {
+        return NULL;
+    }
     if ((*pde & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pgtable_alloc(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pde = paddr | PTE_P | PTE_W | PTE_U;
+        pgtable_count(pde, 1);
     }
 
     pgtab = (pte_t*) KMAP_P2V(PDE_ADDR(*pde));
     return &pgtab[PTX(vaddr)];
 }
 
+static pte_t*
+find_pte_private(struct vpmap *vpmap, vaddr_t vaddr, int alloc)
+{
+    pde_t *pde;
+
+    kassert(vpmap);
+    if ((pde = find_pde(vpmap->pml4, vaddr, alloc)) == NULL) {
+        return NULL;
+    }
+    // Page directory entries are only read-only when the table is shared
+    if ((*pde & PTE_P) && !(*pde & PTE_W) &&
+        pgtable_unshare(vpmap, pde, vaddr & ~(((vaddr_t)1 << PDX_SHIFT) - 1)) != ERR_OK) {
+        return NULL;
+    }
+    return find_pte(vpmap->pml4, vaddr, alloc);
+}
+
+static err_t
+pgtable_share(struct vpmap *srcvpmap, pde_t *src_pde, struct vpmap *dstvpmap, pde_t *dst_pde)
+{
+    struct page *pt;
+    struct pgtable_sharer *src, *dst;
+
+    kassert(*src_pde & PTE_P);
+    kassert(!(*dst_pde & PTE_P));
+
+    if ((src = kmem_cache_alloc(pgtable_sharer_allocator)) == NULL) {
+        return ERR_NOMEM;
+    }
+    if ((dst = kmem_cache_alloc(pgtable_sharer_allocator)) == NULL) {
+        kmem_cache_free(pgtable_sharer_allocator, src);
+        return ERR_NOMEM;
+    }
+    src->vpmap = srcvpmap;
+    dst->vpmap = dstvpmap;
+
+    pt = paddr_to_page(PDE_ADDR(*src_pde));
+    sleeplock_acquire(&pt->lock);
+    // The source becomes the holder if the table was not shared before
+    if (list_empty(&pt->pt_sharers)) {
+        list_append(&pt->pt_sharers, &src->node);
+        src = NULL;
+    }
+    list_append(&pt->pt_sharers, &dst->node);
+    pmem_inc_refcnt(PDE_ADDR(*src_pde), 1);
+    *src_pde &= ~PTE_W;
+    *dst_pde = *src_pde;
+    pgtable_count(dst_pde, 1);
+    rss_account_table(dstvpmap, (pte_t*) KMAP_P2V(PDE_ADDR(*src_pde)), 1);
+    sleeplock_release(&pt->lock);
+
+    if (src) {
+        kmem_cache_free(pgtable_sharer_allocator, src);
+    }
+    return ERR_OK;
+}
+
+static err_t
+pgtable_unshare(struct vpmap *vpmap, pde_t *pde, vaddr_t base)
+{
+    struct page *pt;
+    struct pgtable_sharer *sharer, *holder;
+    struct vpmap *owner;
+    pte_t *src, *dst;
+    paddr_t paddr;
+    int i;
+
+    pt = paddr_to_page(PDE_ADDR(*pde));
+    sleeplock_acquire(&pt->lock);
+    if (pt->refcnt == 1) {
+        // The other sharers are gone, the table is ours
+        pgtable_clear_sharers(pt);
+        *pde |= PTE_W;
+        sleeplock_release(&pt->lock);
+        return ERR_OK;
+    }
+
+    if (pgtable_alloc(&paddr) != ERR_OK) {
+        sleeplock_release(&pt->lock);
+        return ERR_NOMEM;
+    }
+
+    // Find our sharer entry. Our mappings will live in the copy, so the
+    // reverse mappings of the pages now need an entry for the vpmap that
+    // keeps the shared table: the next holder if we are the holder, otherwise
+    // an entry for us.
+    holder = list_entry(list_begin(&pt->pt_sharers), struct pgtable_sharer, node);
+    sharer = pgtable_find_sharer(pt, vpmap);
+    owner = vpmap;
+    if (sharer == holder) {
+        owner = list_entry(list_next(&holder->node), struct pgtable_sharer, node)->vpmap;
+    }
+
+    src = (pte_t*) KMAP_P2V(PDE_ADDR(*pde));
+    dst = (pte_t*) KMAP_P2V(paddr);
+    for (i = 0; i < N_PTE_PER_PG; i++) {
+        if (src[i] & PTE_P) {
+            if (rmap_add_mapping(PTE_ADDR(src[i]), owner, base + ((vaddr_t)i << PTX_SHIFT)) != ERR_OK) {
+                break;
+            }
+            src[i] &= ~PTE_W;
+            pmem_inc_refcnt(PTE_ADDR(src[i]), 1);
+        }
+        dst[i] = src[i];
+    }
+    if (i < N_PTE_PER_PG) {
+        // Out of memory, roll back. Entries stay read-only, which only costs
+        // an extra copy-on-write fault.
+        while (--i >= 0) {
+            if (src[i] & PTE_P) {
+                rmap_remove_mapping(PTE_ADDR(src[i]), owner, base + ((vaddr_t)i << PTX_SHIFT));
+                pmem_dec_refcnt(PTE_ADDR(src[i]));
+            }
+        }
+        sleeplock_release(&pt->lock);
+        pmem_free(paddr);
+        return ERR_NOMEM;
+    }
+
+    paddr_to_page(paddr)->pt_live = pt->pt_live;
+    list_remove(&sharer->node);
+    pmem_dec_refcnt(PDE_ADDR(*pde));
+    *pde = paddr | PTE_P | PTE_W | PTE_U;
+    sleeplock_release(&pt->lock);
+    // Translations cached through the shared table must go before the copy's
+    // entries change
+    vpmap_flush_range(vpmap, base, N_PTE_PER_PG);
+    kmem_cache_free(pgtable_sharer_allocator, sharer);
+    return ERR_OK;
+}
+
+static bool
+pgtable_put(struct vpmap *vpmap, pde_t *pde, vaddr_t base)
+{
+    struct page *pt;
+    struct pgtable_sharer *sharer, *holder;
+    pte_t *pgtab;
+    int i;
+
+    pt = paddr_to_page(PDE_ADDR(*pde));
+    sleeplock_acquire(&pt->lock);
+    if (pt->refcnt == 1) {
+        pgtable_clear_sharers(pt);
+        *pde |= PTE_W;
+        sleeplock_release(&pt->lock);
+        return False;
+    }
+
+    holder = list_entry(list_begin(&pt->pt_sharers), struct pgtable_sharer, node);
+    sharer = pgtable_find_sharer(pt, vpmap);
+    if (sharer == holder) {
+        // Hand the reverse mappings over to the next holder
+        struct vpmap *next = list_entry(list_next(&holder->node), struct pgtable_sharer, node)->vpmap;
+        pgtab = (pte_t*) KMAP_P2V(PDE_ADDR(*pde));
+        for (i = 0; i < N_PTE_PER_PG; i++) {
+            if (pgtab[i] & PTE_P) {
+                rmap_move_mapping(PTE_ADDR(pgtab[i]), base + ((vaddr_t)i << PTX_SHIFT), vpmap, next);
+            }
+        }
+    }
+    rss_account_table(vpmap, (pte_t*) KMAP_P2V(PDE_ADDR(*pde)), -1);
+    list_remove(&sharer->node);
+    pmem_dec_refcnt(PDE_ADDR(*pde));
+    *pde = 0;
+    pgtable_count(pde, -1);
+    sleeplock_release(&pt->lock);
+    // The table lives on for the other sharers, nothing of ours may use it
+    vpmap_flush_range(vpmap, base, N_PTE_PER_PG);
+    kmem_cache_free(pgtable_sharer_allocator, sharer);
+    return True;
+}
+
+static struct pgtable_sharer*
+pgtable_find_sharer(struct page *pt, struct vpmap *vpmap)
+{
+    for (Node *n = list_begin(&pt->pt_sharers); n != list_end(&pt->pt_sharers); n = list_next(n)) {
+        struct pgtable_sharer *sharer = list_entry(n, struct pgtable_sharer, node);
+        if (sharer->vpmap == vpmap) {
+            return sharer;
+        }
+    }
+    panic("vpmap: page table not shared by vpmap");
+    return NULL;
+}
+
+static void
+pgtable_clear_sharers(struct page *pt)
+{
+    while (!list_empty(&pt->pt_sharers)) {
+        Node *n = list_begin(&pt->pt_sharers);
+        list_remove(n);
+        kmem_cache_free(pgtable_sharer_allocator, list_entry(n, struct pgtable_sharer, node));
+    }
+}
+
+static void
+rss_account(struct vpmap *vpmap, pte_t pte, int n)
+{
+    struct rss_stat *rss = vpmap->rss;
+
+    if (rss == NULL || !(pte & PTE_P)) {
+        return;
+    }
+    rss->resident += n;
+    if (pte & PTE_CACHED) {
+        rss->shared += n;
+    }
+    if (rss->resident > rss->peak) {
+        rss->peak = rss->resident;
+    }
+}
+
 static void
-clear_pte(pte_t *pte, int free_swap) {
+rss_account_table(struct vpmap *vpmap, pte_t *pgtab, int n)
+{
+    for (int i = 0; i < N_PTE_PER_PG; i++) {
+        rss_account(vpmap, pgtab[i], n);
+    }
+}
+
+static err_t
+pgtable_alloc(paddr_t *paddr)
+{
+    err_t err;
+
+    if ((err = pmem_alloc_class(paddr, PMEM_CLASS_PGTABLE)) != ERR_OK) {
+        return err;
+    }
+    memset((void*) KMAP_P2V(*paddr), 0, pg_size);
+    paddr_to_page(*paddr)->pt_live = 0;
+    return ERR_OK;
+}
+
+static void
+pgtable_count(pte_t *entry, int n)
+{
+    struct page *table = paddr_to_page(KMAP_V2P(entry));
+    table->pt_live += n;
+    kassert(table->pt_live >= 0 && table->pt_live <= N_PTE_PER_PG);
+}
+
+static void
+pgtable_reclaim(pte_t *entry, List *reclaim)
+{
+    struct page *table = paddr_to_page(PTE_ADDR(*entry));
+    kassert(table->pt_live == 0);
+    list_append(reclaim, &table->node);
+    *entry = 0;
+    pgtable_count(entry, -1);
+}
+
+static void
+clear_pte(struct vpmap *vpmap, vaddr_t vaddr, pte_t *pte, int free_swap) {
     kassert(pte);
     if (*pte & PTE_P) {
+        rmap_remove_mapping(PPN(*pte), vpmap, vaddr);
         pmem_dec_refcnt(PPN(*pte));
+        pgtable_count(pte, -1);
+        rss_account(vpmap, *pte, -1);
     }
     //*pte = PTE_FLAGS(*pte) & 0xffe;
     *pte = 0;
 }
 
 static err_t
-map_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm)
+map_pages(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm)
 {
-    pte_t *pte;
+    pte_t *pte, cached;
     vaddr_t v, vend;
+    bool replaced = False;
+    err_t err = ERR_OK;
 
-    kassert(pml4 != 0);
+    kassert(vpmap->pml4 != 0);
 
     v = pg_round_down(vaddr);
     vend = pg_round_down(vaddr + size);
@@ -125,70 +509,149 @@ map_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t pe
     // We can't test using '<=' in the for loop, because some mappings end at
     // virtual address 0
     for (; v != vend; v += pg_size, paddr += pg_size) {
-        if ((pte = find_pte(pml4, v, 1)) == NULL) {
-            return ERR_VPMAP_MAP;
+        if ((pte = find_pte_private(vpmap, v, 1)) == NULL) {
+            err = ERR_VPMAP_MAP;
+            break;
+        }
+        replaced |= (*pte & PTE_P) != 0;
+        cached = 0;
+        if (vpmap != kvpmap) {
+            // The caller owns the reference of a replaced page, only its
+            // reverse mapping goes away here
+            if ((*pte & PTE_P) && PPN(*pte) != PPN(paddr)) {
+                rmap_remove_mapping(PPN(*pte), vpmap, v);
+            }
+            if (!(*pte & PTE_P) || PPN(*pte) != PPN(paddr)) {
+                if (rmap_add_mapping(paddr, vpmap, v) != ERR_OK) {
+                    if (*pte & PTE_P) {
+                        pgtable_count(pte, -1);
+                    }
+                    rss_account(vpmap, *pte, -1);
+                    *pte = 0;
+                    err = ERR_VPMAP_MAP;
+                    break;
+                }
+            }
+            cached = paddr_to_page(paddr)->store ? PTE_CACHED : 0;
         }
-        *pte = PPN(paddr) | PTE_P | perm;
+        if (!(*pte & PTE_P)) {
+            pgtable_count(pte, 1);
+        }
+        rss_account(vpmap, *pte, -1);
+        *pte = PPN(paddr) | PTE_P | cached | perm;
+        rss_account(vpmap, *pte, 1);
     }
-    return ERR_OK;
+    // Any processor that ran vpmap may still cache a replaced entry, e.g. the
+    // shared page of a copy-on-write fault
+    if (replaced) {
+        vpmap_flush_range(vpmap, pg_round_down(vaddr), (vend - pg_round_down(vaddr)) / pg_size);
+    }
+    return err;
+}
+
+static vaddr_t
+pgaddr(int pml4x, int pdptx, int pdx, int ptx)
+{
+    vaddr_t vaddr = ((vaddr_t)pml4x << PML4X_SHIFT) | ((vaddr_t)pdptx << PDPTX_SHIFT) |
+                    ((vaddr_t)pdx << PDX_SHIFT) | ((vaddr_t)ptx << PTX_SHIFT);
+    // sign extend the upper half of the address space
+    if (pml4x >= N_PML4E_PER_PG / 2) {
+        vaddr |= 0xFFFF000000000000;
+    }
+    return vaddr;
 }
 
 
 static void
-unmap_pages(pml4e_t *pml4, vaddr_t start, vaddr_t end, int free_swap, int free_imm)
+unmap_pages(struct vpmap *vpmap, vaddr_t start, vaddr_t end, int free_swap, int free_imm, List *reclaim)
 {
     kassert(PML4X(start) <= PML4X(end-1));
 
-    int pml4x, pdptx, limit;
+    int pml4x;
+    pml4e_t *pml4 = vpmap->pml4;
     // Optimization: instead of walking the page table for each page in range
     // (using find_pte), iterate through the page directory and each page table.
-    for (pml4x = PML4X(start), pdptx = PDPTX(start); pml4x <= PML4X(end-1); pml4x++, pdptx = 0) {
+    for (pml4x = PML4X(start); pml4x <= PML4X(end-1); pml4x++) {
         if (pml4[pml4x] & PTE_P) {
-            limit = pdptx < PDPTX(end) ? N_PDPTE_PER_PG : PDPTX(end) + 1;
-            unmap_pdpt((pdpte_t*) KMAP_P2V(PML4E_ADDR(pml4[pml4x])), start, end, pdptx, limit, free_swap, free_imm);
+            pdpte_t *pdpt = (pdpte_t*) KMAP_P2V(PML4E_ADDR(pml4[pml4x]));
+            unmap_pdpt(vpmap, pdpt, pgaddr(pml4x, 0, 0, 0), start, end, free_swap, free_imm, reclaim);
             if (free_imm) {
                 pmem_free(PML4E_ADDR(pml4[pml4x]));
+            } else if (reclaim && paddr_to_page(KMAP_V2P(pdpt))->pt_live == 0) {
+                pgtable_reclaim(&pml4[pml4x], reclaim);
             }
         }
     }
 }
 
 static void
-unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr, int pdptx_start, int pdptx_end, int free_swap, int free_imm)
+unmap_pdpt(struct vpmap *vpmap, pdpte_t *pdpt, vaddr_t base, vaddr_t start_addr, vaddr_t end_addr,
+    int free_swap, int free_imm, List *reclaim)
 {
-    int pdptx, pdx, limit;
+    int pdptx, first, last;
 
-    for (pdptx = pdptx_start, pdx = PDX(start_addr); pdptx < pdptx_end; pdptx++, pdx = 0) {
+    entry_range(base, PDPTX_SHIFT, start_addr, end_addr, &first, &last);
+    for (pdptx = first; pdptx <= last; pdptx++) {
         if (pdpt[pdptx] & PTE_P) {
-            limit = pdx < PDX(end_addr) ? N_PDE_PER_PG : PDX(end_addr) + 1;
-            unmap_pd((pde_t*) KMAP_P2V(PDPTE_ADDR(pdpt[pdptx])), start_addr, end_addr, pdx, limit, free_swap, free_imm);
+            pde_t *pgdir = (pde_t*) KMAP_P2V(PDPTE_ADDR(pdpt[pdptx]));
+            unmap_pd(vpmap, pgdir, base + ((vaddr_t)pdptx << PDPTX_SHIFT),
+                start_addr, end_addr, free_swap, free_imm, reclaim);
             if (free_imm) {
                 pmem_free(PDPTE_ADDR(pdpt[pdptx]));
+            } else if (reclaim && paddr_to_page(KMAP_V2P(pgdir))->pt_live == 0) {
+                pgtable_reclaim(&pdpt[pdptx], reclaim);
             }
         }
     }
 }
 
 static void
-unmap_pd(pde_t *pde, vaddr_t start_addr, vaddr_t end_addr, int pdx_start, int pdx_end, int free_swap, int free_imm)
+unmap_pd(struct vpmap *vpmap, pde_t *pde, vaddr_t base, vaddr_t start_addr, vaddr_t end_addr,
+    int free_swap, int free_imm, List *reclaim)
 {
-    int pdx, ptx, limit;
+    int pdx, ptx, first, last, ptx_first, ptx_last;
+    vaddr_t pt_base;
     pte_t *pgtable;
 
-    for (pdx = pdx_start, ptx = PTX(start_addr); pdx < pdx_end; pdx++, ptx = 0) {
+    entry_range(base, PDX_SHIFT, start_addr, end_addr, &first, &last);
+    for (pdx = first; pdx <= last; pdx++) {
         if (pde[pdx] & PTE_P) {
-            limit = ptx < PTX(end_addr) ? N_PTE_PER_PG : PTX(end_addr) + 1;
+            pt_base = base + ((vaddr_t)pdx << PDX_SHIFT);
+            entry_range(pt_base, PTX_SHIFT, start_addr, end_addr, &ptx_first, &ptx_last);
+            if (!(pde[pdx] & PTE_W)) {
+                // Shared page table: if the whole table goes away, just drop
+                // our reference, otherwise take a private copy to clear
+                if (free_imm || (ptx_first == 0 && ptx_last == N_PTE_PER_PG - 1)) {
+                    if (pgtable_put(vpmap, &pde[pdx], pt_base)) {
+                        continue;
+                    }
+                } else if (pgtable_unshare(vpmap, &pde[pdx], pt_base) != ERR_OK) {
+                    panic("vpmap: out of memory unsharing a page table");
+                }
+            }
             pgtable = (pte_t*) KMAP_P2V(PDE_ADDR(pde[pdx]));
-            for (; ptx < limit; ptx++) {
-                clear_pte(&pgtable[ptx], free_swap);
+            for (ptx = ptx_first; ptx <= ptx_last; ptx++) {
+                clear_pte(vpmap, pt_base + ((vaddr_t)ptx << PTX_SHIFT), &pgtable[ptx], free_swap);
             }
             if (free_imm) {
                 pmem_free(PDE_ADDR(pde[pdx]));
+            } else if (reclaim && paddr_to_page(KMAP_V2P(pgtable))->pt_live == 0) {
+                pgtable_reclaim(&pde[pdx], reclaim);
             }
         }
     }
 }
 
+static void
+entry_range(vaddr_t base, int shift, vaddr_t start_addr, vaddr_t end_addr, int *first, int *last)
+{
+    // Only the first page dir visited contains start_addr, and only the last
+    // one contains end_addr - 1
+    vaddr_t span = (vaddr_t)N_PTE_PER_PG << shift;
+    *first = start_addr > base ? (int)(((start_addr - base) >> shift) & (N_PTE_PER_PG - 1)) : 0;
+    *last = end_addr - 1 - base < span ? (int)((end_addr - 1 - base) >> shift) : N_PTE_PER_PG - 1;
+}
+
 static pteperm_t
 memperm_to_pteperm(memperm_t memperm) {
     pteperm_t pteperm;
@@ -238,15 +701,14 @@ vpmap_init(void)
     };
 
     // Allocate one physical page for the kvpmap page directory.
-    if (pmem_alloc(&paddr) != ERR_OK) {
+    if (pgtable_alloc(&paddr) != ERR_OK) {
         panic("vpmap: cannot allocate physical memory for kvpmap pgdir");
     }
     kvpmap->pml4 = (pde_t*)KMAP_P2V(paddr);
-    memset(kvpmap->pml4, 0, pg_size);
 
     // Create kernel mappings
     for (m = kernel_mappings; m < &kernel_mappings[N_ELEM(kernel_mappings)]; m++) {
-        if (map_pages(kvpmap->pml4, m->vaddr, m->paddr_start, m->paddr_end - m->paddr_start, m->perm) != ERR_OK) {
+        if (map_pages(kvpmap, m->vaddr, m->paddr_start, m->paddr_end - m->paddr_start, m->perm) != ERR_OK) {
             panic("vpmap: failed to create kernel mappings");
         }
     }
@@ -268,30 +730,25 @@ vpmap_create(void)
         if ((vpmap_allocator = kmem_cache_create(sizeof(struct vpmap))) == NULL) {
             panic("vpmap: failed to create allocator");
         }
+        if ((pgtable_sharer_allocator = kmem_cache_create(sizeof(struct pgtable_sharer))) == NULL) {
+            panic("vpmap: failed to create page table sharer allocator");
+        }
     }
 
     if ((vpmap = kmem_cache_alloc(vpmap_allocator)) == NULL) {
         return NULL;
     }
-    if (pmem_alloc(&paddr) != ERR_OK) {
+    if (pgtable_alloc(&paddr) != ERR_OK) {
         return NULL;
     }
     vpmap->pml4 = (pde_t*)KMAP_P2V(paddr);
-    memset(vpmap->pml4, 0, pg_size);
+    vpmap->rss = NULL;
+    tlb_init_vpmap(vpmap);
 
     // TODO: initialize with no regions?
     return vpmap;
 }
 
-err_t
-vpmap_load(struct vpmap *vpmap)
-{
-    kassert(vpmap);
-    kassert(vpmap->pml4);
-    lcr3(KMAP_V2P(vpmap->pml4));
-    return ERR_OK;
-}
-
 err_t
 vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t memperm)
 {
@@ -299,7 +756,7 @@ vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t
     if (n == 0) {
         return ERR_OK;
     }
-    return map_pages(vpmap->pml4, pg_round_down(vaddr), pg_round_down(paddr), n * pg_size, memperm_to_pteperm(memperm));
+    return map_pages(vpmap, pg_round_down(vaddr), pg_round_down(paddr), n * pg_size, memperm_to_pteperm(memperm));
 }
 
 void
@@ -311,7 +768,25 @@ vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap)
     vaddr_t start = pg_round_down(vaddr);
     vaddr_t end = start + n * pg_size;
     kassert(PML4X(start) <= PML4X(end));
-    unmap_pages(vpmap->pml4, start, end, free_swap, 0);
+    List reclaim;
+    list_init(&reclaim);
+    // Kernel page tables are shared by every vpmap, they are never freed
+    unmap_pages(vpmap, start, end, free_swap, 0, vpmap == kvpmap ? NULL : &reclaim);
+    // One flush covers both the cleared entries and the paging structure
+    // caches of the unlinked tables, which can be reused after it
+    vpmap_flush_range(vpmap, start, n);
+    while (!list_empty(&reclaim)) {
+        Node *node = list_begin(&reclaim);
+        list_remove(node);
+        pmem_free(page_to_paddr(list_entry(node, struct page, node)));
+    }
+}
+
+void
+vpmap_track_rss(struct vpmap *vpmap, struct rss_stat *rss)
+{
+    kassert(vpmap && vpmap != kvpmap);
+    vpmap->rss = rss;
 }
 
 void
@@ -323,7 +798,8 @@ vpmap_destroy(struct vpmap *vpmap)
     kassert(vpmap != kvpmap);
     // Deallocate all allocated userspace memory and their corresponding
     // page tables. shouldn't use unmap because we need to free intermediate page tables.
-    unmap_pages(vpmap->pml4, 0, USTACK_UPPERBOUND, 1, 1);
+    unmap_pages(vpmap, 0, USTACK_UPPERBOUND, 1, 1, NULL);
+    tlb_release_vpmap(vpmap);
     pmem_free(KMAP_V2P(vpmap->pml4));
     kmem_cache_free(vpmap_allocator, vpmap);
 }
@@ -342,18 +818,27 @@ vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vadd
             PPN(*src_pte) == 0) {
             continue;
         }
-        if ((dst_pte = find_pte(dstvpmap->pml4, dstaddr, 1)) == NULL ||
+        if ((dst_pte = find_pte_private(dstvpmap, dstaddr, 1)) == NULL ||
             PPN(*dst_pte) != 0) {
             // Return an error if address already mapped
             return ERR_VPMAP_MAP;
         }
         err_t err;
         paddr_t paddr;
-        if ((err = pmem_alloc(&paddr)) != ERR_OK) {
+        if ((err = pmem_alloc_class(&paddr, PMEM_CLASS_ANON)) != ERR_OK) {
             return err;
         }
         memcpy((void*)KMAP_P2V(paddr), (void*)KMAP_P2V(PTE_ADDR(*src_pte)), pg_size);
+        if ((err = rmap_add_mapping(paddr, dstvpmap, dstaddr)) != ERR_OK) {
+            pmem_free(paddr);
+            return err;
+        }
+        if (!(*dst_pte & PTE_P)) {
+            pgtable_count(dst_pte, 1);
+        }
+        rss_account(dstvpmap, *dst_pte, -1);
         *dst_pte = PPN(paddr) | PTE_P | perm;
+        rss_account(dstvpmap, *dst_pte, 1);
     }
     return ERR_OK;
 }
@@ -371,24 +856,83 @@ vpmap_cow_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr,
     for (i = 0; i < n; i++, srcaddr += pg_size, dstaddr += pg_size) {
         // for source, if we can't find the pte or ppn == 0, continue
         
-        if ((src_pte = find_pte(srcvpmap->pml4, srcaddr, 0)) == NULL ||
+        if ((src_pte = find_pte_private(srcvpmap, srcaddr, 0)) == NULL ||
             PPN(*src_pte) == 0) {
             continue;
         }
 
+        // for destination, if we can't find the pte or there's already data, return error
+        if ((dst_pte = find_pte_private(dstvpmap, dstaddr, 1)) == NULL ||
+            PPN(*dst_pte) != 0) {
+            // Return an error if address already mapped
+            return ERR_VPMAP_MAP;
+        }
+        if (rmap_add_mapping(PTE_ADDR(*src_pte), dstvpmap, dstaddr) != ERR_OK) {
+            return ERR_VPMAP_MAP;
+        }
+
         // change permission of src to read-only - change the second bit to 0
         *src_pte = ~(1 << 1) & *src_pte;
 
         // increment the count of each physical page
         pmem_inc_refcnt(PTE_ADDR(*src_pte), 1);
 
-        // for destination, if we can't find the pte or there's already data, return error
-        if ((dst_pte = find_pte(dstvpmap->pml4, dstaddr, 1)) == NULL ||
-            PPN(*dst_pte) != 0) {
-            // Return an error if address already mapped
-            return ERR_VPMAP_MAP;
+        if (!(*dst_pte & PTE_P)) {
+            pgtable_count(dst_pte, 1);
         }
+        rss_account(dstvpmap, *dst_pte, -1);
         *dst_pte = *src_pte; // check if it doesn't work
+        rss_account(dstvpmap, *dst_pte, 1);
+    }
+    return ERR_OK;
+}
+
+err_t
+vpmap_unshare(struct vpmap *vpmap, vaddr_t vaddr)
+{
+    pde_t *pde;
+
+    kassert(vpmap);
+    if ((pde = find_pde(vpmap->pml4, vaddr, 0)) == NULL || !(*pde & PTE_P) || (*pde & PTE_W)) {
+        return ERR_OK;
+    }
+    return pgtable_unshare(vpmap, pde, vaddr & ~(((vaddr_t)1 << PDX_SHIFT) - 1));
+}
+
+err_t
+vpmap_fork(struct vpmap *srcvpmap, struct vpmap *dstvpmap)
+{
+    kassert(srcvpmap && dstvpmap);
+    int pml4x, pdptx, pdx;
+    pdpte_t *pdpt;
+    pde_t *pgdir, *dst_pde;
+    vaddr_t base;
+    err_t err;
+
+    // Only the upper level page directories are copied, page tables are shared
+    for (pml4x = 0; pml4x <= PML4X(USTACK_UPPERBOUND - 1); pml4x++) {
+        if (!(srcvpmap->pml4[pml4x] & PTE_P)) {
+            continue;
+        }
+        pdpt = (pdpte_t*) KMAP_P2V(PML4E_ADDR(srcvpmap->pml4[pml4x]));
+        for (pdptx = 0; pdptx < N_PDPTE_PER_PG; pdptx++) {
+            if (!(pdpt[pdptx] & PTE_P)) {
+                continue;
+            }
+            pgdir = (pde_t*) KMAP_P2V(PDPTE_ADDR(pdpt[pdptx]));
+            for (pdx = 0; pdx < N_PDE_PER_PG; pdx++) {
+                base = pgaddr(pml4x, pdptx, pdx, 0);
+                if (!(pgdir[pdx] & PTE_P) || base >= USTACK_UPPERBOUND) {
+                    continue;
+                }
+                if ((dst_pde = find_pde(dstvpmap->pml4, base, 1)) == NULL) {
+                    return ERR_NOMEM;
+                }
+                if ((err = pgtable_share(srcvpmap, &pgdir[pdx], dstvpmap, dst_pde)) != ERR_OK) {
+                    return err;
+                }
+            }
+        }
     }
     return ERR_OK;
 }
@@ -400,6 +944,7 @@ vpmap_copy_kernel_mapping(struct vpmap *dstvpmap) {
     for (pml4x = PML4X(KMAP_BASE); pml4x < N_PML4E_PER_PG; pml4x++) {
         if (kvpmap->pml4[pml4x] & PTE_P) {
             dstvpmap->pml4[pml4x] = kvpmap->pml4[pml4x];
+            pgtable_count(&dstvpmap->pml4[pml4x], 1);
             // TODO: may need to increment refcnt if we ever allow kernel pt to be swapped
         }
     }
@@ -449,6 +994,52 @@ kmap_io2v(paddr_t paddr)
     return KMAP_IO2V(paddr);
 }
 
+bool
+vpmap_is_shared(struct vpmap *vpmap, vaddr_t vaddr)
+{
+    pde_t *pde;
+
+    kassert(vpmap);
+    // Page directory entries are only read-only when the table is shared
+    pde = find_pde(vpmap->pml4, vaddr, 0);
+    return pde != NULL && (*pde & PTE_P) && !(*pde & PTE_W);
+}
+
+err_t
+vpmap_write_protect(struct vpmap *vpmap, vaddr_t vaddr, int *writable)
+{
+    pte_t *pte;
+
+    kassert(vpmap && writable);
+    vaddr = pg_round_down(vaddr);
+    // Other sharers of the table would keep their translations
+    if (vpmap_is_shared(vpmap, vaddr)) {
+        return ERR_VPMAP_MAP;
+    }
+    if ((pte = find_pte(vpmap->pml4, vaddr, 0)) == NULL || !(*pte & PTE_P)) {
+        return ERR_VPMAP_NOTPRESENT;
+    }
+    // The processor may set the dirty bit meanwhile
+    *writable = (__sync_fetch_and_and(pte, ~(pte_t)PTE_W) & PTE_W) != 0;
+    vpmap_flush_range(vpmap, vaddr, 1);
+    return ERR_OK;
+}
+
+void
+vpmap_remap(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, int writable)
+{
+    pte_t *pte;
+
+    kassert(vpmap);
+    vaddr = pg_round_down(vaddr);
+    if ((pte = find_pte(vpmap->pml4, vaddr, 0)) == NULL || !(*pte & PTE_P)) {
+        return;
+    }
+    // Keep the other permission bits, only the frame changes
+    *pte = PPN(paddr) | PTE_FLAGS(*pte) | (writable ? PTE_W : 0);
+    vpmap_flush_range(vpmap, vaddr, 1);
+}
+
 void
 vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memperm) {
     kassert(vpmap);
@@ -457,21 +1048,34 @@ vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memperm)
     vaddr = pg_round_down(vaddr);
     // TODO: fix pte flags. only using the last 3 bits right now.
     for (i = 0; i < n; i++) {
-        pte_t* pte = find_pte(vpmap->pml4, vaddr+i*pg_size, 0);
+        pte_t* pte = find_pte_private(vpmap, vaddr+i*pg_size, 0);
         if (pte) {
-            *pte = PPN(*pte) | (PTE_FLAGS(*pte)&PTE_P) | perm;
+            // Migration write-protects the entry while it copies the page
+            rmap_lock();
+            *pte = PPN(*pte) | (PTE_FLAGS(*pte) & (PTE_P | PTE_CACHED)) | perm;
+            rmap_unlock();
         }
     }
 }
 
 void
 vpmap_set_dirty(struct vpmap *vpmap, vaddr_t vaddr) {
-    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    pte_t *pte = find_pte_private(vpmap, vaddr, 0);
     if (pte) {
         *pte = *pte | PTE_D;
     }
 }
 
+void
+vpmap_clear_dirty(struct vpmap *vpmap, vaddr_t vaddr) {
+    // A shared page table maps the same page for every sharer, so the entry
+    // can be cleaned in place
+    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    if (pte) {
+        *pte = *pte & ~PTE_D;
+    }
+}
+
 err_t
 vpmap_get_dirty(struct vpmap *vpmap, vaddr_t vaddr, int *dirty) {
     kassert(dirty);
@@ -494,14 +1098,3 @@ vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed) {
     return ERR_VPMAP_NOTPRESENT;
 }
 
-void
-vpmap_flush_tlb() {
-    intr_set_level(INTR_OFF);
-    vaddr_t pml4 = (vaddr_t) kvpmap->pml4;
-    struct proc *p = proc_current();
-    if (p) {
-        pml4 = (vaddr_t) p->as.vpmap->pml4;
-    }
-    lcr3(KMAP_V2P(pml4));
-    intr_set_level(INTR_ON);
-}
@@ -1,11 +1,13 @@
 #include <arch/trap.h>
 #include <arch/asm.h>
 #include <kernel/thread.h>
+#include <kernel/proc.h>
 #include <kernel/types.h>
 #include <kernel/pgfault.h>
 #include <kernel/console.h>
 #include <kernel/trap.h>
 #include <lib/stddef.h>
+#include <lib/errcode.h>
 
 /*
  * Page fault error masks
@@ -14,6 +16,12 @@
 #define PF_W    0x2
 #define PF_U    0x4
 
+/*
+ * The instruction of copy_user that touches user memory, and where copy_user
+ * resumes to fail the copy.
+ */
+extern char copy_user_insn[], copy_user_fault[];
+
 /*
  * x86_64 page fault trap handler
  */
@@ -28,8 +36,19 @@ x86_64_pgfault_trap_handler(irq_t irq, void *dev, void *regs)
     kassert(irq == T_PF);
 
     uint32_t err_code = tf->err;
-    thread_current()->tf = tf;
-    handle_page_fault(rcr2(), err_code & PF_P, err_code & PF_W, err_code & PF_U);
+    // A fault in the kernel keeps the trapframe of the syscall being served
+    if (err_code & PF_U) {
+        thread_current()->tf = tf;
+    }
+    if (handle_page_fault(rcr2(), err_code & PF_P, err_code & PF_W, err_code & PF_U) != ERR_OK) {
+        // The kernel could not access user memory. Fail copy_user, the
+        // syscall then releases what it holds. Other accesses cannot recover.
+        if (tf->rip == (uint64_t)copy_user_insn) {
+            tf->rip = (uint64_t)copy_user_fault;
+        } else {
+            proc_exit(-1);
+        }
+    }
 }
 
 err_t
@@ -12,10 +12,16 @@ struct bdev;
 struct bdev_request;
 struct bio;
 struct super_block;
+struct iosched;
 
 // Block size used by the block device interface
 #define BDEV_BLK_SIZE 512
 
+/*
+ * Error codes
+ */
+#define ERR_BDEV_IO 1 // the device failed the transfer
+
 /*
  * Initialize the block device subsystem.
  */
@@ -28,33 +34,48 @@ struct bdev {
     dev_t dev; // device number
     struct list request_queue; // request queue for this device
     struct spinlock queue_lock; // spinlock to protect the request queue
+    const struct iosched *iosched; // orders and merges queued requests
+    blk_t iosched_pos; // block after the last issued request
+    size_t max_blks; // largest request the driver takes, in blocks
     void (*request_handler)(struct bdev*); // request handler function (defined by drivers)
     void *data; // device specific data
     struct memstore *store; // memstore to read memory pages from this device
     struct super_block *sb; // bdev's super block if available
+    struct list dirty_pages; // cached pages with dirty blocks, oldest first
+    struct spinlock dirty_lock; // spinlock to protect dirty_pages
 };
 
 // Root block device (for root file system)
 struct bdev *root_bdev;
 
+typedef enum {
+    BIO_READ,
+    BIO_WRITE
+} bio_op_t;
+
 /*
- * Block device request.
+ * Block device request: one transfer of contiguous blocks, made of one or more
+ * bios.
  */
 struct bdev_request {
-    struct bio *bio; // operation
+    struct list bios; // bios of the request, in block order
+    blk_t blk; // starting block number
+    size_t size; // number of blocks in the request
+    bio_op_t op;
     struct list_node node; // list node for request queue
 };
 
-typedef enum {
-    BIO_READ,
-    BIO_WRITE
-} bio_op_t;
-
 typedef enum {
     BIO_PENDING,
     BIO_COMPLETE
 } bio_status_t;
 
+/*
+ * Completion callback of a bio. Called from the driver's interrupt handler, so
+ * it must not sleep or submit other bios.
+ */
+typedef void (*bio_end_io_t)(struct bio*);
+
 /*
  * Block device operation
  */
@@ -65,8 +86,14 @@ struct bio {
     void *buffer; // buffer for data transfer
     bio_op_t op;
     bio_status_t status;
-    struct spinlock lock; // lock to synchronize access to status
+    err_t err; // first error of the transfer or of a chained bio, ERR_OK if none
+    struct spinlock lock; // lock to synchronize access to status, err and remaining
     struct condvar cv; // cv to check status
+    bio_end_io_t end_io; // called on completion if set
+    void *private; // data for end_io
+    struct bio *parent; // bio that completes after this one, if chained
+    int remaining; // this bio's own transfer plus its unfinished children
+    struct list_node req_node; // list node for request->bios
 };
 
 /*
@@ -97,11 +124,71 @@ struct bio *bio_alloc(void);
  */
 void bio_free(struct bio *bio);
 
+/*
+ * Submit a block device request without waiting for it. The bio completes once
+ * its own transfer and all bios chained to it are done: end_io is then called
+ * if set, otherwise bio_wait returns. A bio with an end_io callback belongs to
+ * the callback once it completes, so do not bio_wait on it.
+ *
+ * A bio without a block device carries no transfer of its own, and only
+ * collects the completion of its children. Otherwise the bio must not be
+ * larger than bdev->max_blks.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate the request. The bio is not submitted.
+ */
+err_t bdev_submit_bio(struct bio *bio);
+
 /*
  * Submit a block device request. This function is synchronous: it returns only
  * when the request is completed by the block device.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate the request.
+ * ERR_BDEV_IO - The device failed the transfer.
  */
-void bdev_make_request(struct bio *bio);
+err_t bdev_make_request(struct bio *bio);
+
+/*
+ * Make parent complete only after child does. Must be called before either
+ * bio is submitted.
+ */
+void bio_chain(struct bio *child, struct bio *parent);
+
+/*
+ * Submit a transfer of size blocks between buffer and bdev, starting at blk,
+ * as a child of parent. The child bio is freed when it completes.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory. Nothing is submitted.
+ */
+err_t bdev_submit_child(struct bio *parent, struct bdev *bdev, bio_op_t op,
+                        blk_t blk, size_t size, void *buffer);
+
+/*
+ * Wait for a submitted bio without an end_io callback to complete. Return the
+ * bio's err: ERR_BDEV_IO if its transfer or the one of a chained bio failed.
+ */
+err_t bio_wait(struct bio *bio);
+
+/*
+ * Called when the transfer of a bio is done, with err ERR_OK or the error of
+ * the transfer. Completes the bio and its parent if nothing else is pending on
+ * them. An error is kept in the bio's err and passed on to its parent.
+ */
+void bio_endio(struct bio *bio, err_t err);
+
+/*
+ * Called by drivers to take the next request to issue off the device's request
+ * queue. Return NULL if the queue is empty.
+ */
+struct bdev_request *bdev_next_request(struct bdev *bdev);
+
+/*
+ * Called by drivers when a request is done, with err ERR_OK or ERR_BDEV_IO if
+ * the device failed it. Completes all bios of the request and frees it.
+ */
+void bdev_end_request(struct bdev_request *request, err_t err);
 
 /*
  * Header for bdev blocks stored in page cache.
@@ -109,8 +196,6 @@ void bdev_make_request(struct bio *bio);
 struct blk_header {
     // Lock to protect data structures in the header
     struct sleeplock lock;
-    // List node for page->blk_headers
-    Node node;
     // Block device that the block belongs to
     struct bdev *bdev;
     // Block number
@@ -126,6 +211,10 @@ struct blk_header {
     state_t state;
     // Reference counter. This counter is protected by page->lock.
     unsigned int ref;
+    // Bumped each time the block is set dirty, so that writeback only cleans
+    // blocks not dirtied again since their write was submitted. Protected by
+    // page->lock.
+    unsigned int dirty_gen;
 };
 
 /*
@@ -166,6 +255,12 @@ void bdev_release_blk(struct blk_header *bh);
  */
 void bdev_release_blk_unlocked(struct blk_header *bh);
 
+/*
+ * Take one more reference on a block buffer that the caller already holds a
+ * reference on. Dropped with bdev_release_blk(_unlocked).
+ */
+void bdev_hold_blk(struct blk_header *bh);
+
 /*
  * Write a block buffer to the backing block device.
  *
@@ -174,7 +269,29 @@ void bdev_release_blk_unlocked(struct blk_header *bh);
  *
  * Return:
  * ERR_NOMEM - Failed to allocate memory.
+ * ERR_BDEV_IO - The device failed the write, the block stays dirty.
  */
 err_t bdev_write_blk(struct blk_header *bh);
 
+/*
+ * Write back the dirty blocks of bdev's pages that got dirty at least age timer
+ * ticks ago. Adjacent dirty blocks are written together, and the written blocks
+ * become clean unless they were dirtied again meanwhile.
+ *
+ * Precondition:
+ * Dirty blocks must not be modified during writeback, e.g. the caller holds
+ * the journal of the file system on bdev.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory. Some pages may be left dirty.
+ * ERR_BDEV_IO - The device failed a write. Some pages may be left dirty.
+ */
+err_t bdev_writeback(struct bdev *bdev, uint32_t age);
+
+/*
+ * Return True if there are so many dirty pages that writers should write them
+ * back before dirtying more.
+ */
+bool bdev_dirty_exceeded(void);
+
 #endif /* _BDEV_H_ */
@@ -90,12 +90,29 @@ struct super_operations {
     blk_t (*journal_bmap)(struct super_block *sb, blk_t lb);
     /*
      * Start a journal transaction.
+     *
+     * Return:
+     * Error of writing back dirty blocks past the dirty limit. The transaction
+     * is started anyway, writers should end it and not dirty more blocks.
      */
-    void (*journal_begin_txn)(struct super_block *sb);
+    err_t (*journal_begin_txn)(struct super_block *sb);
     /*
      * End a journal transaction.
+     *
+     * Return:
+     * ERR_NOMEM - Failed to allocate memory.
+     * ERR_BDEV_IO - The device failed to commit the transaction.
      */
-    void (*journal_end_txn)(struct super_block *sb);
+    err_t (*journal_end_txn)(struct super_block *sb);
+    /*
+     * Write back dirty blocks of the file system that got dirty at least age
+     * timer ticks ago. Called by the writeback thread.
+     *
+     * Return:
+     * ERR_NOMEM - Failed to allocate memory.
+     * ERR_BDEV_IO - The device failed a write.
+     */
+    err_t (*writeback)(struct super_block *sb, uint32_t age);
     /*
      * Allocate a new in-memory inode.
      *
@@ -274,7 +291,8 @@ struct inode_operations {
      */
     err_t (*lookup)(struct inode *dir, const char *name, struct inode **inode);
     /*
-     * Fill in memory page with data read from an inode.
+     * Fill in memory page with data read from an inode. The part of the page
+     * past the end of the file is filled with zeros.
      *
      * Precondition:
      * Caller must hold inode->i_lock.
@@ -283,6 +301,18 @@ struct inode_operations {
      * ERR_INCOMP - Failed to fill in the entire page.
      */
     err_t (*fillpage)(struct inode *inode, offset_t ofs, struct page *page);
+    /*
+     * Write a memory page back to an inode. The part of the page past the end
+     * of the file is not written, the file does not grow.
+     *
+     * Precondition:
+     * Caller must hold inode->i_lock.
+     * Caller must be within a journal transaction.
+     *
+     * Return:
+     * ERR_INCOMP - Failed to write the entire page.
+     */
+    err_t (*writepage)(struct inode *inode, offset_t ofs, struct page *page);
     /*
      * Create a new hard link in directory dir that refers to inode src. The
      * new hard link has name ``name``.
@@ -350,6 +380,11 @@ void fs_free_inode(struct inode *inode);
  */
 err_t fs_get_inode(struct super_block *sb, inum_t inum, struct inode **inode);
 
+/*
+ * Take an additional reference on an inode the caller already holds.
+ */
+void fs_ref_inode(struct inode *inode);
+
 /*
  * Release an inode reference. If the inode has no more references, perform the
  * following actions:
@@ -435,6 +470,16 @@ err_t fs_mkdir(const char *pathname);
  */
 err_t fs_rmdir(const char *pathname);
 
+/*
+ * Readahead state of a file. A read that starts where the previous one ended
+ * is sequential, and grows the readahead window. Any other read resets it.
+ */
+struct file_ra {
+    offset_t prev_end; // end of the previous read
+    offset_t ra_end; // end of the data read ahead so far
+    size_t window; // bytes to keep read ahead of sequential reads
+};
+
 /*
  * File structure
  */
@@ -446,6 +491,8 @@ struct file {
     struct sleeplock f_lock; // Lock protecting file data structures
     struct file_operations *f_ops; // File operations
     struct pipe *info; // Additional info for pipes
+    struct memstore *shm; // Shared memory segment, NULL for other files
+    struct file_ra f_ra; // Readahead state, protected by the inode lock
 };
 
 /*
@@ -560,21 +607,27 @@ void fs_close_file(struct file *file);
 
 /*
  * Read count bytes from file f at offset *ofs into a buffer buf. Update ofs with
- * the new offset.
+ * the new offset. buf may be user memory: file data is copied to it without
+ * holding file system locks.
  *
  * Return:
  * The number of bytes read, or -1 if an error occurs. If -1 is returned, no
  * data is read from the file.
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_FAULT - buf cannot be written, no data is read.
  */
 ssize_t fs_read_file(struct file *file, void *buf, size_t count, offset_t *ofs);
 
 /*
  * Write count bytes to file f at offset *ofs from a buffer buf. Update ofs with
- * the new offset.
+ * the new offset. buf may be user memory: it is copied without holding file
+ * system locks, and large writes take one journal transaction per page.
  *
  * Return:
  * The number of bytes written, or -1 if an error occurs. If -1 is returned, no
  * data is written to the file.
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_FAULT - buf cannot be read, no data is written.
  */
 ssize_t fs_write_file(struct file *file, const void *buf, size_t count, offset_t *ofs);
 
@@ -585,6 +638,7 @@ ssize_t fs_write_file(struct file *file, const void *buf, size_t count, offset_t
  * ERR_FTYPE - dir is not a directory.
  * ERR_NOMEM - Failed to allocate memory.
  * ERR_END - End of directory is reached.
+ * ERR_FAULT - dirent cannot be written.
  */
 err_t fs_readdir(struct file *dir, struct dirent *dirent);
 
@@ -22,6 +22,8 @@ typedef enum {
     IDE_BUSY
 } ide_status_t;
 
+struct ide_prd;
+
 /*
  * IDE device descriptor
  */
@@ -29,6 +31,15 @@ struct ide_dev {
     struct spinlock lock; // lock to protect this descriptor
     ide_status_t status;
     uint8_t ide_index; // 0 for master, 1 for slave
+    uint8_t mult; // sectors moved per interrupt
+    struct bdev_request *active; // request being transferred
+    Node *seg; // bio of the active request being transferred
+    size_t seg_ofs; // bytes of seg already transferred
+    size_t left; // sectors of the active request left to transfer
+    port_t bmide; // bus master DMA registers
+    struct ide_prd *prdt; // DMA descriptor table, NULL if DMA is unavailable
+    paddr_t prdt_paddr;
+    bool dma; // active request is transferred by DMA
 };
 
 /*
@@ -12,6 +12,16 @@
  */
 uint8_t readb(port_t port);
 
+/*
+ * Read 2 bytes from the device.
+ */
+uint16_t readw(port_t port);
+
+/*
+ * Read 4 bytes from the device.
+ */
+uint32_t readl(port_t port);
+
 /*
  * Write n bytes into buffer at addr.
  */
@@ -22,6 +32,16 @@ void readn(port_t port, void *addr, size_t n);
  */
 void writeb(port_t port, uint8_t data);
 
+/*
+ * Write 2 bytes into the device.
+ */
+void writew(port_t port, uint16_t data);
+
+/*
+ * Write 4 bytes into the device.
+ */
+void writel(port_t port, uint32_t data);
+
 /*
  * Write n bytes from buffer to the device.
  */
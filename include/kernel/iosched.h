@@ -0,0 +1,48 @@
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * I/O schedulers. A block device's scheduler decides how bios are grouped
+ * into requests on the device's request queue, and in which order drivers
+ * issue the requests. Bios for contiguous blocks are merged into one request,
+ * up to the largest transfer the driver takes (bdev->max_blks).
+ */
+#include <kernel/types.h>
+
+struct bdev;
+struct bdev_request;
+struct bio;
+
+struct iosched {
+    const char *name;
+    /*
+     * Queue bio, by merging it into a queued request if possible, otherwise by
+     * queuing request, an unused request the caller allocated. Return True if
+     * request was queued.
+     *
+     * Precondition:
+     * Caller must hold bdev->queue_lock.
+     */
+    bool (*add_bio)(struct bdev *bdev, struct bio *bio, struct bdev_request *request);
+    /*
+     * Remove the next request to issue from the queue and return it. Return
+     * NULL if the queue is empty.
+     *
+     * Precondition:
+     * Caller must hold bdev->queue_lock.
+     */
+    struct bdev_request *(*next_request)(struct bdev *bdev);
+};
+
+/*
+ * Issues requests in arrival order, only merging a bio into the last request.
+ */
+extern const struct iosched iosched_fifo;
+
+/*
+ * Keeps requests sorted by block, and issues them in ascending sweeps across
+ * the device (C-LOOK). A bio is merged into any queued request it extends.
+ */
+extern const struct iosched iosched_elevator;
+
+#endif /* _IOSCHED_H_ */
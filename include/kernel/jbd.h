@@ -15,6 +15,8 @@
 
 // Number of journal data blocks
 #define JOURNAL_SIZE 128
+// Number of times a failed commit is retried before the transaction is dropped
+#define JOURNAL_COMMIT_RETRIES 3
 
 struct super_block;
 
@@ -36,6 +38,14 @@ struct journal {
     int next_index;
     // Journal data blocks
     struct blk_header *datablks[JOURNAL_SIZE];
+    // Last committed transaction, until it is checkpointed: home block numbers
+    // of its data blocks, and the journal blocks holding their committed
+    // content
+    int n_ckpt;
+    blk_t ckpt_blks[JOURNAL_SIZE];
+    struct blk_header *ckpt_bhs[JOURNAL_SIZE];
+    // Timer tick at which that transaction committed
+    uint32_t commit_time;
 };
 
 struct journal_header {
@@ -58,14 +68,39 @@ struct journal *jbd_alloc_journal(struct super_block *sb);
 void jbd_free_journal(struct journal *journal);
 
 /*
- * Start a journal transaction.
+ * Start a journal transaction. Past the dirty limit, write dirty blocks back
+ * first.
+ *
+ * Return:
+ * Error of that writeback, see jbd_writeback. The transaction is started
+ * anyway: callers about to dirty much data should end it and give up.
+ */
+err_t jbd_begin_txn(struct journal *journal);
+
+/*
+ * End a journal transaction. The transaction is committed to the journal when
+ * this function returns, its data blocks are written back later.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_BDEV_IO - The device failed to write the journal.
+ * On error the commit was retried JOURNAL_COMMIT_RETRIES times, and the
+ * transaction is dropped from the journal: its blocks stay dirty, and are
+ * written back without the journal's guarantee.
  */
-void jbd_begin_txn(struct journal *journal);
+err_t jbd_end_txn(struct journal *journal);
 
 /*
- * End a journal transaction.
+ * Write back dirty blocks of the file system that got dirty at least age timer
+ * ticks ago, and checkpoint the last committed transaction if it is that old.
+ * Waits for the running transaction to end first.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_BDEV_IO - The device failed a write. Some blocks are left dirty, or the
+ *               transaction is left in the journal.
  */
-void jbd_end_txn(struct journal *journal);
+err_t jbd_writeback(struct journal *journal, uint32_t age);
 
 /*
  * Log a modified block in the journal.
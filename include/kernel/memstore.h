@@ -35,6 +35,12 @@ struct memstore {
      */
     struct sleeplock pgcache_lock;
     struct radix_tree_root cached_pages;
+    List pages; // list of cached pages, linked by page->cache_node
+    /*
+     * True if unused cached pages can be evicted, and read back with fillpage
+     * when needed again. False for stores that only live in memory.
+     */
+    bool evictable;
 
     /*
      * Fill a page with data read from this store at the offset position. Each
@@ -45,12 +51,29 @@ struct memstore {
      */
     err_t (*fillpage)(struct memstore*, offset_t, struct page*);
 
+    /*
+     * Start filling a page like fillpage, without waiting for the data. Call
+     * pgcache_fill_done on the page once the fill is done or failed. NULL if
+     * the store only fills pages synchronously.
+     * Return:
+     * ERR_MEMSTORE_NOMEM if failed to allocate memory.
+     */
+    err_t (*fillpage_async)(struct memstore*, offset_t, struct page*);
+
     /*
      * Write a page to this store.
      * Function prototype:
      * err_t write(struct memstore *this, paddr_t paddr, offset_t ofs);
      */
     err_t (*write)(struct memstore*, paddr_t, offset_t);
+
+    /*
+     * Take and drop a reference on the object backing this store, so that the
+     * store stays alive while memregions map it. NULL if the store does not
+     * need one.
+     */
+    void (*get)(struct memstore*);
+    void (*put)(struct memstore*);
 };
 
 /*
@@ -0,0 +1,66 @@
+#ifndef _PCI_H_
+#define _PCI_H_
+
+/*
+ * PCI configuration space access.
+ */
+#include <kernel/types.h>
+
+// Configuration space registers
+#define PCI_REG_ID          0x00 // vendor id (low 16 bits), device id (high)
+#define PCI_REG_COMMAND     0x04 // command (low 16 bits), status (high)
+#define PCI_REG_CLASS       0x08 // revision, prog if, subclass, class (high)
+#define PCI_REG_HEADER      0x0C // header type in bits 16-23
+#define PCI_REG_BAR(n)      (0x10 + 4 * (n)) // base address registers
+#define PCI_REG_IRQ         0x3C // interrupt line (low 8 bits)
+
+// Command register bits
+#define PCI_COMMAND_IO      0x1 // respond to I/O space accesses
+#define PCI_COMMAND_MEM     0x2 // respond to memory space accesses
+#define PCI_COMMAND_MASTER  0x4 // allow bus mastering
+
+// Base address register bits
+#define PCI_BAR_IO          0x1 // BAR is in I/O space
+#define PCI_BAR_IO_MASK     (~(uint32_t)0x3)
+
+// Device classes
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+
+/*
+ * Location of a PCI function.
+ */
+struct pci_dev {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor;
+    uint16_t device;
+};
+
+/*
+ * Read/write a 32-bit register in a function's configuration space. reg must
+ * be 4 byte aligned.
+ */
+uint32_t pci_read(struct pci_dev *dev, uint8_t reg);
+void pci_write(struct pci_dev *dev, uint8_t reg, uint32_t val);
+
+/*
+ * Find the first function of the given class and subclass, and store its
+ * location in *dev.
+ *
+ * Return:
+ * ERR_NOTEXIST - No such function.
+ */
+err_t pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *dev);
+
+/*
+ * Find the first function with the given vendor and device id, and store its
+ * location in *dev.
+ *
+ * Return:
+ * ERR_NOTEXIST - No such function.
+ */
+err_t pci_find_device(uint16_t vendor, uint16_t device, struct pci_dev *dev);
+
+#endif /* _PCI_H_ */
@@ -10,9 +10,19 @@
 struct page;
 struct memstore;
 
+/*
+ * Initialize the page cache.
+ */
+void pgcache_init(void);
+
 /*
  * Query a page from the page cache. If the page is not present in the cache,
- * read the page using the memstore, and store the page into the cache.
+ * read the page using the memstore, and store the page into the cache. If the
+ * page is still being read, wait for it.
+ *
+ * The page is cached before it is read, and store->pgcache_lock is dropped
+ * during the read and the wait: other lookups of the store go on meanwhile,
+ * and lookups of the same page wait for the same read.
  *
  * Precondition:
  * Caller must hold store->pgcache_lock.
@@ -22,12 +32,65 @@ struct memstore;
  */
 struct page *pgcache_get_page(struct memstore *store, offset_t ofs);
 
+/*
+ * Start reading the page at offset ofs into the cache if it is not cached yet,
+ * without waiting for the data. Does nothing for stores that do not support
+ * asynchronous fills.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+err_t pgcache_readahead(struct memstore *store, offset_t ofs);
+
+/*
+ * Called by memstores when an asynchronous fill of page is done, with err
+ * ERR_OK or the error of the fill. Wakes up the threads waiting for the page.
+ * A page whose fill failed is read again by the next lookup.
+ */
+void pgcache_fill_done(struct page *page, err_t err);
+
 /*
  * Remove a cached page from the page cache.
  *
  * Precondition:
  * Caller must hold store->pgcache_lock.
+ * The page is not being filled.
  */
 void pgcache_remove_page(struct memstore *memstore, offset_t ofs);
 
+/*
+ * Copy count bytes of buf, just written to the store's backing object at
+ * offset ofs, into the cached pages that cover them, so that mappings of the
+ * store see the new data.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+void pgcache_update(struct memstore *store, offset_t ofs, const void *buf, size_t count);
+
+/*
+ * Remove all pages of a memstore from the page cache, and drop the cache's
+ * reference on them.
+ *
+ * Precondition:
+ * No memregion maps the store.
+ */
+void pgcache_release(struct memstore *store);
+
+/*
+ * Return True if the page cache is over its budget, or free memory is below
+ * the low watermark. The cache then evicts pages as it allocates new ones, but
+ * dirty pages must be written back before they can go.
+ */
+bool pgcache_need_reclaim(void);
+
+/*
+ * Evict clean pages that only the cache uses, in clock order, until the cache
+ * is within its budget and free memory is above the high watermark.
+ */
+void pgcache_reclaim(void);
+
 #endif /* _PGCACHE_H_ */
@@ -4,9 +4,43 @@
 #include <kernel/types.h>
 
 /*
- * Page fault handler.
+ * Fault-around: a fault on a page that is not present also maps a window of
+ * neighboring pages of the memregion. The window stays at one page until
+ * FAULT_AROUND_MIN_STREAK faults in a row hit the page right after (or right
+ * before) the previous window, then doubles on each sequential fault, up to
+ * FAULT_AROUND_MAX_PAGES. Any other fault resets it.
+ *
+ * Regions advised MADV_SEQUENTIAL always use a window of
+ * FAULT_AROUND_SEQ_PAGES, regions advised MADV_RANDOM a single page.
  */
- 
-void handle_page_fault(vaddr_t fault_addr, int present, int write, int user);
+#define FAULT_AROUND_MAX_PAGES 16
+#define FAULT_AROUND_MIN_STREAK 8
+#define FAULT_AROUND_SEQ_PAGES 64
+
+/*
+ * Initialize page fault handling state.
+ */
+void pgfault_init(void);
+
+/*
+ * Page fault handler. A fault that cannot be resolved exits the process if it
+ * was raised by user code.
+ *
+ * Return:
+ * ERR_FAULT - The address is not mapped, or not with the access's permission.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+err_t handle_page_fault(vaddr_t fault_addr, int present, int write, int user);
+
+/*
+ * Copy n bytes between user and kernel memory. A fault on the user buffer is
+ * resolved like one of the process, and fails the copy if it cannot be,
+ * instead of exiting the process in the middle of the syscall.
+ *
+ * Return:
+ * ERR_FAULT - Part of the user buffer cannot be accessed. The bytes before it
+ *             may have been copied.
+ */
+err_t copy_user(void *dst, const void *src, size_t n);
 
 #endif /* _PGFAULT_H_ */
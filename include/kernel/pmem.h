@@ -10,6 +10,9 @@
  * Physical memory allocator.
  */
 
+struct memstore;
+struct blk_header;
+
 /*
  * Each physical page has an associated struct page.
  */
@@ -27,8 +30,74 @@ struct page {
     // Status of the page. Contains the following flags:
     // - DIRTY
     state_t state;
-    // used by bdev to locate block headers
-    List blk_headers;
+    // used by bdev: headers of the blocks in the page, indexed by block
+    // position in the page (NULL if not allocated), and the number of headers
+    // with a nonzero reference count plus writebacks holding the headers
+    struct blk_header *blk_headers;
+    int blk_refs;
+    // page cache: owning memstore (NULL if not cached), offset of the page in
+    // the store, and link in the store's list of cached pages
+    struct memstore *store;
+    offset_t ofs;
+    Node cache_node;
+    // page cache: link in the cache's clock list, and whether the page was
+    // used since the clock hand last passed it
+    Node lru_node;
+    bool referenced;
+    // set while the page is cached but not filled yet, and if its fill failed
+    volatile int inflight;
+    bool fill_failed;
+    // writeback: link in the bdev's list of dirty pages (oldest first), and
+    // the timer tick at which the page got dirty
+    Node dirty_node;
+    uint32_t dirtied_at;
+    // vpmaps sharing this page, when it is a page table shared after fork
+    List pt_sharers;
+    // number of present entries, when it is a page table
+    int pt_live;
+};
+
+/*
+ * Largest block order of the buddy allocator.
+ */
+#define PMEM_MAX_ORDER 10
+
+/*
+ * Classes of callers, used to account physical page allocations.
+ */
+typedef enum {
+    PMEM_CLASS_OTHER = 0,
+    PMEM_CLASS_SLAB = 1,    // kmalloc slabs
+    PMEM_CLASS_PGCACHE = 2, // page cache pages
+    PMEM_CLASS_ANON = 3,    // anonymous user memory
+    PMEM_CLASS_PGTABLE = 4, // page tables
+    PMEM_N_CLASSES = 5
+} pmem_class_t;
+
+/*
+ * Allocation latency histogram: bucket 0 counts allocations that took fewer
+ * than 2^PMEM_LAT_BASE_SHIFT cycles, and each following bucket is four times
+ * wider than the previous one. The last bucket counts everything slower.
+ */
+#define PMEM_N_LAT_BUCKETS 8
+#define PMEM_LAT_BASE_SHIFT 8
+
+/*
+ * Physical memory statistics.
+ */
+struct memstat {
+    size_t total_pages;
+    size_t free_pages;
+    size_t free_blocks[PMEM_MAX_ORDER+1];       // free blocks of each order
+    size_t n_alloc;                             // successful allocations
+    size_t n_fail;                              // failed allocations
+    size_t n_free;                              // pages freed
+    size_t class_pages[PMEM_N_CLASSES];         // pages allocated by each caller class
+    size_t latency[PMEM_N_LAT_BUCKETS];         // allocation latency histogram
+    size_t compact_attempts;
+    size_t compact_success;
+    size_t compact_fail;
+    size_t compact_migrated;
 };
 
 /*
@@ -56,6 +125,17 @@ void pmem_init(void);
  */
 void pmem_info(void);
 
+/*
+ * Print the number of free blocks of each order, the fraction of free memory
+ * that is unusable for an allocation of each order, and compaction statistics.
+ */
+void pmem_frag_info(void);
+
+/*
+ * Fill in physical memory statistics.
+ */
+void pmem_get_stat(struct memstat *stat);
+
 /*
  * Machine-dependent physical memory initialization: store the physical memory
  * configuration in a ``pmemconfig`` struct.
@@ -78,6 +158,7 @@ err_t pmem_alloc(paddr_t *paddr);
 
 /*
  * Allocate n physical pages. Physical pages are guaranteed to be contiguous.
+ * Exactly n pages are allocated, n need not be a power of two.
  * Store the address of the first physical page in ``paddr``.
  *
  * Return:
@@ -86,13 +167,21 @@ err_t pmem_alloc(paddr_t *paddr);
  */
 err_t pmem_nalloc(paddr_t *paddr, size_t n);
 
+/*
+ * Same as pmem_alloc and pmem_nalloc, but account the allocation to caller
+ * class ``class``. pmem_alloc and pmem_nalloc account to PMEM_CLASS_OTHER.
+ */
+err_t pmem_alloc_class(paddr_t *paddr, pmem_class_t class);
+err_t pmem_nalloc_class(paddr_t *paddr, size_t n, pmem_class_t class);
+
 /*
  * Deallocate one physical page at ``addr``.
  */
 void pmem_free(paddr_t paddr);
 
 /*
- * Deallocate n physical pages starting at ``addr``.
+ * Deallocate n physical pages starting at ``addr``. The pages may be any
+ * subrange of a previous allocation.
  */
 void pmem_nfree(paddr_t paddr, size_t n);
 
@@ -105,6 +194,11 @@ void pmem_nfree(paddr_t paddr, size_t n);
 int pmem_is_page_dirty(struct page *page);
 void pmem_set_page_dirty(struct page *page, int dirty);
 
+/*
+ * Return the number of free physical pages. Cheaper than pmem_get_stat.
+ */
+size_t pmem_get_free_pages(void);
+
 int pmem_get_refcnt(paddr_t paddr);
 
 /*
@@ -35,9 +35,60 @@ void proc_sys_init(void);
 /* Spawn a new process specified by executable name and argument */
 err_t proc_spawn(char *name, char** argv, struct proc **p);
 
+/*
+ * File actions, applied in order to the file table of a process created by
+ * proc_spawn_fa before it starts running.
+ */
+#define SPAWN_DUP2  0   // make fd refer to the open file of srcfd
+#define SPAWN_CLOSE 1   // close fd
+#define SPAWN_MAX_ACTIONS 16
+
+struct spawn_action {
+    int type;
+    int fd;
+    int srcfd;
+};
+
+/*
+ * Spawn a new process specified by executable name and argument, without
+ * copying the current process. The new process inherits the current process's
+ * open files, then the ``nactions`` file actions are applied to its file table.
+ * Return:
+ * ERR_INVAL - An action is unknown or refers to an invalid file descriptor.
+ * Errors of proc_spawn.
+ */
+err_t proc_spawn_fa(char *name, char **argv, struct spawn_action *actions, int nactions, struct proc **p);
+
 /* Fork a new process identical to current process */
 struct proc* proc_fork();
 
+/*
+ * Memory usage of a process, as reported by ps.
+ */
+#define PROC_INFO_MAX 32  // most processes listed by one procinfo call
+struct proc_info {
+    int pid;
+    int ppid;
+    char name[PROC_NAME_LEN];
+    int alive;              // 0 once the process exited
+    size_t rss;             // resident pages
+    size_t rss_shared;      // resident page cache pages
+    size_t rss_peak;        // highest number of resident pages
+    size_t pgfault;         // page faults
+    size_t cow;             // copy-on-write breaks
+};
+
+/*
+ * Fill in the memory usage of process p.
+ */
+void proc_get_info(struct proc *p, struct proc_info *info);
+
+/*
+ * Fill in the memory usage of up to n processes in info.
+ * Return the number of processes filled in.
+ */
+int proc_list_info(struct proc_info *info, int n);
+
 /* Return current thread's process. NULL if current thread is not associated with any process */
 struct proc* proc_current();
 
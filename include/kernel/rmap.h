@@ -2,15 +2,39 @@
 #define _RMAP_H_
 
 #include <kernel/list.h>
+#include <kernel/types.h>
 
 /*
  * Reverse mapping for tracking shared memory regions.
+ *
+ * A memstore's rmap tracks the memregions that map the store. A physical
+ * page's rmap tracks every (vpmap, vaddr) pair that currently maps the page,
+ * so the page can be moved or unmapped without walking every address space.
  */
 
+struct vpmap;
+struct page;
+
 struct rmap {
     List regions;
+    List mappings;      // list of struct rmap_entry
+};
+
+/*
+ * A single virtual mapping of a physical page.
+ */
+struct rmap_entry {
+    Node node;
+    struct vpmap *vpmap;
+    vaddr_t vaddr;
+    int writable;       // mapping was writable before migration protected it
 };
 
+/*
+ * Initialize the page reverse mapping subsystem.
+ */
+void rmap_init(void);
+
 /*
  * Allocate a new reverse mapping.
  */
@@ -31,9 +55,76 @@ void rmap_construct(struct rmap *rmap);
  */
 void rmap_destroy(struct rmap *rmap);
 
+/*
+ * Record/forget a memregion mapping the memstore that owns ``rmap``.
+ */
+void rmap_add_region(struct rmap *rmap, Node *region_node);
+void rmap_remove_region(Node *region_node);
+
 /*
  * Unmap all memory mappings of a physical page
  */
 err_t rmap_unmap(struct rmap *rmap, paddr_t paddr);
 
+/*
+ * Record that ``vaddr`` in ``vpmap`` maps physical page ``paddr``.
+ *
+ * Return:
+ * ERR_OK - Mapping recorded.
+ * ERR_NOMEM - Failed to allocate rmap or rmap entry.
+ */
+err_t rmap_add_mapping(paddr_t paddr, struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Forget that ``vaddr`` in ``vpmap`` maps physical page ``paddr``. Frees the
+ * page's rmap once the last mapping is gone.
+ */
+void rmap_remove_mapping(paddr_t paddr, struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Record that the mapping of physical page ``paddr`` at ``vaddr`` moved from
+ * vpmap ``from`` to vpmap ``to``.
+ */
+void rmap_move_mapping(paddr_t paddr, vaddr_t vaddr, struct vpmap *from, struct vpmap *to);
+
+/*
+ * Return the number of virtual mappings of a page.
+ *
+ * Precondition:
+ * Caller must hold the rmap lock.
+ */
+int rmap_mapcount(struct page *page);
+
+/*
+ * Return True if a mapping of the page lives in a page table shared since
+ * fork. Such mappings can't be migrated, as only one sharer is recorded.
+ *
+ * Precondition:
+ * Caller must hold the rmap lock.
+ */
+bool rmap_is_shared(struct page *page);
+
+/*
+ * Move the content and all mappings of page ``old`` to ``new``: every mapping
+ * of ``old`` is made read-only and flushed from all TLBs, the content is
+ * copied, then every entry is rewritten to map ``new`` and flushed again, and
+ * ``new`` takes over the rmap. Once this returns, ``old`` is no longer
+ * reachable from any TLB. The caller is responsible for the reference count.
+ *
+ * Return:
+ * ERR_OK - Page migrated.
+ * ERR_VPMAP_MAP - A mapping lives in a shared page table, nothing is moved.
+ *
+ * Precondition:
+ * Caller must hold the rmap lock.
+ */
+err_t rmap_migrate(struct page *old, struct page *new);
+
+/*
+ * Acquire/release the lock protecting all page reverse mappings. Lock
+ * ordering: the rmap lock must be acquired before pmem's lock.
+ */
+void rmap_lock(void);
+void rmap_unlock(void);
+
 #endif /* _RMAP_H_ */
@@ -2,20 +2,77 @@
 #define _SHMMS_H_
 
 #include <kernel/memstore.h>
+#include <kernel/list.h>
 
 /*
- * Memstore backed by shared memory.
+ * Memstore backed by shared memory. Pages of a shared memory memstore live in
+ * its page cache until the memstore is freed.
+ *
+ * Shared memory segments are named memstores that processes open by name and
+ * map. A segment stays alive while it is named, open or mapped.
  */
 
+#define SHM_NAME_LEN 32
+
+// shm_open flags
+#define SHM_CREAT   0x1 // create the segment if it does not exist
+
+struct file;
+
+/*
+ * Shared memory segment descriptor.
+ */
+struct shmms_info {
+    char name[SHM_NAME_LEN];
+    size_t size;    // page aligned size of the segment
+    int ref;        // open files and memregions of the segment
+    int linked;     // 1 if the segment can still be found by name
+    Node node;      // list of named segments
+    struct memstore *store;
+};
+
+/*
+ * Initialize the shared memory segment table.
+ */
+void shmms_init(void);
+
 /*
- * Allocate a shared memory memstore. TODO: parameters
+ * Allocate a shared memory memstore of size bytes.
  * Return NULL if failed to allocate.
  */
-struct memstore *shmms_alloc(void);
+struct memstore *shmms_alloc(size_t size);
 
 /*
  * Free a shared memory memstore.
  */
 void shmms_free(struct memstore *store);
 
+/*
+ * Open the shared memory segment named name, creating it with size bytes if
+ * create is set and it does not exist. Return a file referring to the segment
+ * in *file, to be closed with fs_close_file.
+ *
+ * Return:
+ * ERR_OK - Segment is opened.
+ * ERR_NOTEXIST - Segment does not exist and create is not set.
+ * ERR_INVAL - Segment is created with size 0.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+err_t shmms_open(const char *name, size_t size, int create, struct file **file);
+
+/*
+ * Remove the name of a shared memory segment. The segment is freed once it is
+ * neither open nor mapped.
+ *
+ * Return:
+ * ERR_OK - Name is removed.
+ * ERR_NOTEXIST - No segment has this name.
+ */
+err_t shmms_unlink(const char *name);
+
+/*
+ * Return the size of a shared memory segment.
+ */
+size_t shmms_size(struct memstore *store);
+
 #endif /* _SHMMS_H_ */
@@ -8,4 +8,14 @@
  */
 err_t timer_register_trap_handler(void);
 
+/*
+ * Return the number of timer ticks since boot.
+ */
+uint32_t timer_get_ticks(void);
+
+/*
+ * Put the current thread to sleep for at least n timer ticks.
+ */
+void timer_sleep(uint32_t n);
+
 #endif /* _TIMER_H_ */
@@ -0,0 +1,61 @@
+#ifndef _VIRTIO_BLK_H_
+#define _VIRTIO_BLK_H_
+
+/*
+ * Virtio block device driver (legacy PCI interface). Requests are placed on a
+ * single virtqueue, so many of them can be in flight at once.
+ */
+#include <kernel/synch.h>
+#include <kernel/bdev.h>
+
+/*
+ * Error codes
+ */
+#define ERR_VIRTIO_BLK_INIT_FAIL 1
+
+struct vring_desc;
+struct vring_avail;
+struct vring_used;
+struct virtio_blk_slot;
+
+/*
+ * Virtio block device descriptor
+ */
+struct virtio_blk_dev {
+    struct spinlock lock; // lock to protect this descriptor
+    port_t iobase; // legacy virtio registers
+    irq_t irq;
+    uint16_t qsize; // number of descriptors in the virtqueue
+    struct vring_desc *desc; // virtqueue descriptor table
+    struct vring_avail *avail; // ring of descriptor chains given to the device
+    struct vring_used *used; // ring of descriptor chains the device is done with
+    paddr_t ring_paddr;
+    size_t ring_pages;
+    struct virtio_blk_slot *slots; // per request data, indexed by head descriptor
+    paddr_t slots_paddr;
+    size_t slots_pages;
+    uint16_t free_head; // first free descriptor
+    uint16_t num_free; // number of free descriptors
+    uint16_t last_used; // index of the next used ring entry to process
+    struct bdev_request *stalled; // next request, waiting for free descriptors
+};
+
+/*
+ * Allocate a block device descriptor for the first virtio block device, with
+ * device number dev. Return NULL if there is no such device or failed to
+ * allocate.
+ */
+struct bdev *virtio_blk_alloc(dev_t dev);
+
+/*
+ * Free a virtio block device descriptor.
+ */
+void virtio_blk_free(struct bdev *bdev);
+
+/*
+ * Initialize a virtio block device. Return ERR_VIRTIO_BLK_INIT_FAIL if failed
+ * to initialize.
+ */
+err_t virtio_blk_init(struct bdev *bdev);
+
+#endif /* _VIRTIO_BLK_H_ */
@@ -13,6 +13,19 @@
 #include <kernel/synch.h>
 
 #define ADDR_ANYWHERE 0Xfffffff
+
+// mmap protection
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+// mmap flags
+#define MAP_SHARED  0x1 // writes go to the file and are seen by other mappings
+#define MAP_PRIVATE 0x2 // writes are copy-on-write and private to the process
+// madvise hints
+#define MADV_NORMAL     0 // default fault-around
+#define MADV_SEQUENTIAL 1 // pages are accessed in order: fault around widely
+#define MADV_RANDOM     2 // pages are accessed at random: no fault-around
+#define MADV_WILLNEED   3 // pages will be accessed soon: read them ahead
+#define MADV_DONTNEED   4 // pages will not be accessed soon: free them
 #define UHEAP_INIT_PAGES 1000
 
 // Error Codes
@@ -37,19 +50,51 @@ typedef enum {
 struct memregion {
     struct addrspace *as;
     Node as_node;           // used to connect all memregions within an addrspace
+    Node store_node;        // used to connect all memregions mapping a memstore
+    // AVL tree of an addrspace's memregions, ordered by address. Each node
+    // also tracks its subtree's address range and largest unmapped gap.
+    struct memregion *tree_left;
+    struct memregion *tree_right;
+    int tree_height;
+    vaddr_t subtree_start;  // lowest start in subtree
+    vaddr_t subtree_end;    // highest page-rounded end in subtree
+    size_t subtree_gap;     // largest gap between two memregions of subtree
     vaddr_t start;          // starting addr of memregion
     vaddr_t end;            // ending addr of memregion
     memperm_t perm;
     int shared;             // 1:shared 0:private
     struct memstore *store;
     offset_t ofs;           // offset into memstore
+    size_t filesz;          // bytes from start backed by store, the rest is zero-filled
+    // sequential fault detection for fault-around
+    vaddr_t fault_next;     // page after the last fault-around window
+    vaddr_t fault_prev;     // page before the last fault-around window
+    int fault_streak;       // number of sequential faults in a row
+    int fault_down;         // 1 if sequential faults go downward
+    int advice;             // access pattern hint: MADV_NORMAL, MADV_SEQUENTIAL or MADV_RANDOM
+};
+
+/*
+ * Resident pages of an address space. Shared pages are page cache pages (of
+ * files and shared memory segments), which other address spaces can map too;
+ * the other resident pages are anonymous and private.
+ */
+struct rss_stat {
+    size_t resident;        // resident pages
+    size_t shared;          // resident page cache pages
+    size_t peak;            // highest number of resident pages
 };
 
 struct addrspace {
-    List regions;
+    List regions;           // memregions in address order
+    struct memregion *tree; // root of the memregion tree, used for lookups
+    struct memregion *last_hit; // last memregion found by a lookup
     struct vpmap *vpmap;
     struct sleeplock as_lock;
     struct memregion *heap; // track heap memregion to ease extension
+    struct rss_stat rss;    // maintained by the vpmap
+    size_t nfaults;         // page faults handled
+    size_t ncow;            // copy-on-write breaks
 };
 
 // Kernel address space.
@@ -82,7 +127,8 @@ void as_destroy(struct addrspace *as);
 void as_dump(struct addrspace *as, vaddr_t vaddr);
 
 /*
- * Copy src address space's memregions into dst_as.
+ * Copy src address space's memregions into dst_as. Memory is shared
+ * copy-on-write with src, page tables included.
  * Return ERR_OK on success, ERR_NOMEM if fails to allocate memregion in dst.
  */
 err_t as_copy_as(struct addrspace *src_as, struct addrspace *dst_as);
@@ -94,7 +140,8 @@ err_t as_copy_as(struct addrspace *src_as, struct addrspace *dst_as);
  * addr: starting address of the region, if (addr==ADDR_ANYWHERE) { allocate within the function }
  * size: size of the region.
  * memperm: expected permission for the region.
- * store: mapped memory store. NULL if memory is anonymous.
+ * store: mapped memory store. NULL if memory is anonymous. The whole region is
+ * backed by the store, callers may shrink region->filesz afterwards.
  * ofs: offset into the memory store.
  * shared: 1:shared 0:private.
  */
@@ -126,6 +173,7 @@ void as_meminfo(struct addrspace *as);
 /*
  * Extend a region of virtual memory by size bytes.
  * End is extended size and old_bound is returned (note: size can be negative).
+ * Shrinking the region unmaps the pages past its new end.
  * Return ERR_VM_INVALID if the resulting region would have negative extent
  * (ending address before starting address).
  * Return ERR_VM_BOUND if the extended region overlaps with other regions in the
@@ -140,7 +188,27 @@ err_t memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_boun
 err_t memregion_set_perm(struct memregion *region, memperm_t perm);
 
 /*
- * Unmap and free a memory region.
+ * Write the dirty pages of a shared, store-backed region within
+ * [addr, addr+size) back to the store. Does nothing for other regions.
+ * Return ERR_MEMSTORE_IO if failed to write a page.
+ */
+err_t memregion_sync(struct memregion *region, vaddr_t addr, size_t size);
+
+/*
+ * Apply madvise hint ``advice`` to [addr, addr+size) of a region.
+ * MADV_NORMAL, MADV_SEQUENTIAL and MADV_RANDOM set the access pattern of the
+ * whole region. MADV_WILLNEED reads the pages backed by the store into its
+ * page cache. MADV_DONTNEED unmaps the pages, after writing back the dirty
+ * pages of a shared region. Private pages are freed, and later accesses map
+ * the store's pages or zero-filled pages again.
+ * Return ERR_VM_INVALID if advice is unknown, ERR_MEMSTORE_IO if failed to
+ * write a page back.
+ */
+err_t memregion_advise(struct memregion *region, vaddr_t addr, size_t size, int advice);
+
+/*
+ * Unmap and free a memory region. Dirty pages of a shared region are written
+ * back to its store first.
  */
 void memregion_unmap(struct memregion *region);
 
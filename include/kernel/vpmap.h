@@ -28,6 +28,11 @@ void vpmap_init(void);
  */
 struct vpmap *vpmap_create(void);
 
+/*
+ * Count the resident pages of a user vpmap in rss from now on.
+ */
+void vpmap_track_rss(struct vpmap *vpmap, struct rss_stat *rss);
+
 /*
  * Load ``vpmap`` into the current processor.
  */
@@ -36,12 +41,14 @@ err_t vpmap_load(struct vpmap *vpmap);
 /*
  * Map n virtual pages starting at ``vaddr`` to physical pages starting at
  * ``paddr``. Physical pages are contiguous if ``n`` greater than one.
+ * Entries that were already present are flushed from every TLB.
  * Return ERR_VPMAP_MAP if failed map any pages in range.
  */
 err_t vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t memperm);
 
 /*
- * Remove mappings starting at virtual address vaddr for n pages.
+ * Remove mappings starting at virtual address vaddr for n pages, invalidate
+ * them in the TLBs, and free the page tables left empty.
  * If free_swap is set, any mapping that resides in swap will be removed from swap.
  */
 void vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap);
@@ -65,6 +72,22 @@ err_t vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr
  */
 err_t vpmap_cow_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vaddr_t dstaddr, size_t n);
 
+/*
+ * Make sure the page table holding the entry of vaddr is private to vpmap, so
+ * that the entry can be changed without affecting other vpmaps.
+ * Return ERR_NOMEM if failed to copy a shared page table.
+ */
+err_t vpmap_unshare(struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Duplicate all user mappings of src vpmap into dst vpmap, which must not have
+ * any user mappings yet. Page tables are shared copy-on-write between the two:
+ * a table is copied on the first modification of an entry through either
+ * vpmap, and its pages are only then marked copy-on-write.
+ * Return ERR_NOMEM if failed to allocate page directories.
+ */
+err_t vpmap_fork(struct vpmap *srcvpmap, struct vpmap *dstvpmap);
+
 /*
  * Copy mapping of first level entries from kernel vpmap to dst vpmap. Permission is perserved.
  * Return ERR_VPMAP_MAP if failed to map pages in dstvpmap
@@ -99,6 +122,31 @@ vaddr_t kmap_p2v(paddr_t paddr);
  */
 vaddr_t kmap_io2v(paddr_t io_paddr);
 
+/*
+ * Return True if the entry of vaddr lives in a page table shared with other
+ * vpmaps since fork.
+ */
+bool vpmap_is_shared(struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Make the existing mapping of ``vaddr`` read-only, and invalidate it on every
+ * processor. Whether it was writable is stored in ``writable``.
+ *
+ * Return:
+ * ERR_OK - Mapping is read-only.
+ * ERR_VPMAP_NOTPRESENT - vaddr is not mapped.
+ * ERR_VPMAP_MAP - The entry lives in a shared page table.
+ */
+err_t vpmap_write_protect(struct vpmap *vpmap, vaddr_t vaddr, int *writable);
+
+/*
+ * Point the existing mapping of ``vaddr`` at physical page ``paddr``, keeping
+ * its permission bits and making it writable if ``writable`` is set, and
+ * invalidate the old translation on every processor. Reference counts and
+ * reverse mappings are left to the caller.
+ */
+void vpmap_remap(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, int writable);
+
 /*
  * Change permission of a region of memory.
  */
@@ -109,6 +157,12 @@ void vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memp
  */
 void vpmap_set_dirty(struct vpmap *vpmap, vaddr_t vaddr);
 
+/*
+ * Mark the page as clean. The caller flushes the TLB entry, so that the next
+ * write to the page sets the dirty bit again.
+ */
+void vpmap_clear_dirty(struct vpmap *vpmap, vaddr_t vaddr);
+
 /*
  * Check if the page is dirty.
  * Return ERR_VPMAP_NOTPRESET if no physical page is mapped to the address.
@@ -122,8 +176,23 @@ err_t vpmap_get_dirty(struct vpmap *vpmap, vaddr_t vaddr, int *dirty);
 err_t vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed);
 
 /*
- *  Flush tlb
+ * Invalidate the cached translations of n pages starting at vaddr in vpmap, on
+ * every processor that may hold them. Processors currently running on vpmap
+ * are interrupted to flush right away, the others flush when they load vpmap
+ * next.
+ */
+void vpmap_flush_range(struct vpmap *vpmap, vaddr_t vaddr, size_t n);
+
+/*
+ * Serve a flush request of another processor pending on the current one.
+ * Called by code that waits with interrupts disabled, such as spinlocks, so
+ * that a processor flushing while holding the lock does not wait forever.
+ */
+void vpmap_flush_pending(void);
+
+/*
+ * Invalidate all cached translations of vpmap, like vpmap_flush_range.
  */
-void vpmap_flush_tlb();
+void vpmap_flush_tlb(struct vpmap *vpmap);
 
 #endif /* _VPMAP_H_ */
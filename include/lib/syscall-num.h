@@ -22,3 +22,12 @@
 #define SYS_pipe    21
 #define SYS_info    22
 #define SYS_halt    23
+#define SYS_memstat 24
+#define SYS_spawnfa 25
+#define SYS_mmap    26
+#define SYS_munmap  27
+#define SYS_msync   28
+#define SYS_shm_open   29
+#define SYS_shm_unlink 30
+#define SYS_madvise 31
+#define SYS_procinfo 32
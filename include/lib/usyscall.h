@@ -39,10 +39,86 @@ struct dirent {
 #define KMAP_BASE           0xFFFFFFFF80000000
 #define USTACK_UPPERBOUND   0xFFFFFF7FFFFFF000
 
+// Memory usage of a process
+#define PROC_NAME_LEN 32
+#define PROC_INFO_MAX 32
+struct proc_info {
+    int pid;
+    int ppid;
+    char name[PROC_NAME_LEN];
+    int alive;              // 0 once the process exited
+    size_t rss;             // resident pages
+    size_t rss_shared;      // resident pages of files and shared memory segments
+    size_t rss_peak;        // highest number of resident pages
+    size_t pgfault;         // page faults
+    size_t cow;             // copy-on-write breaks
+};
+
 struct sys_info {
-    size_t num_pgfault;
+    size_t num_pgfault;     // page faults of all processes
+    struct proc_info proc;  // the calling process
+};
+
+// Physical memory statistics
+#define PMEM_MAX_ORDER 10
+
+// Classes of physical page allocation callers
+#define PMEM_CLASS_OTHER 0
+#define PMEM_CLASS_SLAB 1
+#define PMEM_CLASS_PGCACHE 2
+#define PMEM_CLASS_ANON 3
+#define PMEM_CLASS_PGTABLE 4
+#define PMEM_N_CLASSES 5
+
+// Bucket 0 of the allocation latency histogram counts allocations faster than
+// 2^PMEM_LAT_BASE_SHIFT cycles, each following bucket is four times wider
+#define PMEM_N_LAT_BUCKETS 8
+#define PMEM_LAT_BASE_SHIFT 8
+
+struct memstat {
+    size_t total_pages;
+    size_t free_pages;
+    size_t free_blocks[PMEM_MAX_ORDER+1];
+    size_t n_alloc;
+    size_t n_fail;
+    size_t n_free;
+    size_t class_pages[PMEM_N_CLASSES];
+    size_t latency[PMEM_N_LAT_BUCKETS];
+    size_t compact_attempts;
+    size_t compact_success;
+    size_t compact_fail;
+    size_t compact_migrated;
 };
 
+// File actions of spawnfa
+#define SPAWN_DUP2  0   // make fd refer to the open file of srcfd
+#define SPAWN_CLOSE 1   // close fd
+#define SPAWN_MAX_ACTIONS 16
+
+struct spawn_action {
+    int type;
+    int fd;
+    int srcfd;
+};
+
+// mmap protection
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+// mmap flags
+#define MAP_SHARED  0x1
+#define MAP_PRIVATE 0x2
+
+// Shared memory segments
+#define SHM_NAME_LEN 32
+#define SHM_CREAT   0x1 // create the segment if it does not exist
+
+// madvise hints
+#define MADV_NORMAL     0
+#define MADV_SEQUENTIAL 1
+#define MADV_RANDOM     2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
 /*
  * Syscalls
  */
@@ -67,6 +143,19 @@ int fork(void);
  * ERR_NOMEM - Failed to allocate memory.
  */
 int spawn(const char *args);
+/*
+ * Spawn a new process like spawn. The new process inherits the open files of
+ * the calling process, then the nactions file actions are applied to its file
+ * descriptors, in order, before it starts running.
+ *
+ * Return:
+ * PID of child - Process creation and program execution is successful.
+ * ERR_FAULT - Address of args or actions is invalid.
+ * ERR_INVAL - nactions is out of range, or an action is unknown or refers to
+ *             an invalid file descriptor.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+int spawnfa(const char *args, const struct spawn_action *actions, int nactions);
 /*
  * Wait for a process to change state. If pid is -1, wait for any child process.
  * If wstatus is not NULL, store the the exit status of the child in wstatus.
@@ -268,4 +357,99 @@ void info(struct sys_info *info);
  * Halt the computer
  */
 void halt();
+/*
+ * Fill in physical memory statistics.
+ *
+ * Return:
+ * ERR_OK on success
+ * ERR_FAULT if stat address is invalid
+ */
+int memstat(struct memstat *stat);
+/*
+ * Map length bytes of file or shared memory segment fd, starting at offset,
+ * into memory. prot must
+ * include PROT_READ, and may include PROT_WRITE. flags must include exactly
+ * one of MAP_SHARED and MAP_PRIVATE. Writes to a shared mapping reach the
+ * file on msync or munmap, writes to a private mapping are never written
+ * back. If addr is not NULL, the mapping is placed exactly at addr.
+ *
+ * Return:
+ * Address of the mapping on success (non-negative).
+ * ERR_INVAL - Invalid fd, addr, offset, length, prot or flags, fd was not
+ *             opened for the requested access, or the range goes past the
+ *             end of a shared memory segment.
+ * ERR_NOMEM - No room for the mapping.
+ */
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, offset_t offset);
+/*
+ * Remove the mapping created by mmap at addr. length must cover the whole
+ * mapping. Dirty pages of a shared mapping are written back to the file.
+ *
+ * Return:
+ * ERR_OK on success
+ * ERR_INVAL - addr and length do not match a mapping.
+ */
+int munmap(void *addr, size_t length);
+/*
+ * Write dirty pages of a shared mapping within [addr, addr+length) back to
+ * the file.
+ *
+ * Return:
+ * ERR_OK on success
+ * ERR_INVAL - The range is not within a single mapping.
+ * ERR_NORES - Failed to write a page back.
+ */
+int msync(void *addr, size_t length);
+/*
+ * Open the shared memory segment named name, and create it with size bytes
+ * of zeros if flags includes SHM_CREAT and it does not exist yet. The
+ * returned file descriptor can only be passed to mmap and close; segments
+ * mapped with MAP_SHARED are shared by every process mapping them, across
+ * fork too.
+ *
+ * Return:
+ * Non-negative file descriptor on success
+ * ERR_FAULT - Address of name is invalid.
+ * ERR_INVAL - name is too long, or size is 0 when creating the segment.
+ * ERR_NOTEXIST - Segment does not exist and SHM_CREAT is not set.
+ * ERR_NOMEM - Failed to allocate memory or a file descriptor.
+ */
+int shm_open(const char *name, size_t size, int flags);
+/*
+ * Remove the name of a shared memory segment. The segment is freed once no
+ * process has it open or mapped.
+ *
+ * Return:
+ * ERR_OK on success
+ * ERR_FAULT - Address of name is invalid.
+ * ERR_NOTEXIST - No segment has this name.
+ */
+int shm_unlink(const char *name);
+/*
+ * Tell the kernel how the pages in [addr, addr+length) will be accessed.
+ * MADV_NORMAL, MADV_SEQUENTIAL and MADV_RANDOM set the access pattern of the
+ * whole mapping containing the range, which controls how many neighboring
+ * pages a page fault maps. MADV_WILLNEED reads the file pages of the range
+ * ahead. MADV_DONTNEED frees the pages of the range: later accesses see the
+ * file content, or zeros for memory not backed by a file, and lose private
+ * writes. addr must be page aligned.
+ *
+ * Return:
+ * ERR_OK on success
+ * ERR_INVAL - addr is not page aligned, the range is not within a single
+ *             mapping, or advice is unknown.
+ * ERR_NORES - Failed to write a page of a shared mapping back.
+ */
+int madvise(void *addr, size_t length, int advice);
+/*
+ * Fill in the memory usage of up to n processes, including exited processes
+ * not yet waited for, in info.
+ *
+ * Return:
+ * Number of processes filled in on success
+ * ERR_INVAL - n is not between 1 and PROC_INFO_MAX.
+ * ERR_FAULT - Address of info is invalid.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+int procinfo(struct proc_info *info, int n);
 #endif /* _USYSCALL_H_ */
@@ -7,12 +7,17 @@
 #include <kernel/bdevms.h>
 #include <kernel/console.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/fs.h>
 #include <lib/errcode.h>
 #include <lib/bits.h>
 #include <kernel/ide.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/iosched.h>
 
 static struct kmem_cache *bdev_allocator = NULL;
 static struct kmem_cache *bio_allocator = NULL;
+static struct kmem_cache *request_allocator = NULL;
 
 // Root block device
 #define ROOT_DEV_NUM 0
@@ -25,13 +30,42 @@ static struct kmem_cache *bio_allocator = NULL;
 // belongs to.
 #define FIRST_BLK_IN_PAGE(blk) ((blk / (pg_size / BDEV_BLK_SIZE)) * (pg_size / BDEV_BLK_SIZE))
 
-// Block header allocator
+// Block header allocator, allocates the headers of a page at once
 static struct kmem_cache *blk_header_allocator = NULL;
 
 // Block header state bits
 #define BLK_HEADER_VALID 0
 #define BLK_HEADER_DIRTY 1
 
+// The writeback thread wakes up every WB_INTERVAL timer ticks, and writes back
+// pages that have been dirty for WB_DIRTY_AGE ticks
+#define WB_INTERVAL 50
+#define WB_DIRTY_AGE 300
+// Percentages of physical pages that can be dirty before the writeback thread
+// ignores the age of dirty pages, and before writers must write back
+// themselves
+#define WB_BACKGROUND_RATIO 10
+#define WB_LIMIT_RATIO 20
+// Number of pages written back per batch
+#define WB_BATCH 32
+
+/*
+ * A dirty page taken by writeback: whether its block headers are held, the
+ * blocks whose writes were submitted (bit i for block i), and the dirty_gen of
+ * each block at submission.
+ */
+struct wb_page {
+    struct page *page;
+    bool held;
+    uint32_t submitted;
+    unsigned int *gens;
+};
+
+// Number of dirty bdev pages, and the thresholds above
+static volatile size_t n_dirty_pages = 0;
+static size_t dirty_background_pages;
+static size_t dirty_limit_pages;
+
 /*
  * Initialize block headers for a page (if not initialized before). first_blk is
  * the block number of the first block in the page.
@@ -45,58 +79,248 @@ static struct kmem_cache *blk_header_allocator = NULL;
 static err_t init_blk_headers(struct page *page, struct bdev *bdev, blk_t first_blk);
 
 /*
- * Check if all blocks in a page have zero reference.
+ * Check if no block in a page is dirty.
  *
  * Precondition:
  * Caller must hold page->lock.
  */
-static int blocks_zero_ref(struct page *page);
+static int blocks_clean(struct page *page);
 
 /*
  * Free all block headers in a page if the page is clean. If the page is dirty,
- * a kernel thread will write the page to bdev and free the headers.
+ * the headers are freed once the writeback thread has written it back.
  *
  * Precondition:
  * Caller must hold page->lock.
  */
 static void free_blk_headers(struct page *page);
 
+/*
+ * Drop one pending completion of a bio: its own transfer or one of its
+ * children. The last one completes the bio, then its parent.
+ */
+static void bio_put_remaining(struct bio *bio, err_t err);
+
+/*
+ * Completion callback of bios submitted by bdev_submit_child.
+ */
+static void end_child_bio(struct bio *bio);
+
+/*
+ * Submit writes of the dirty blocks of wb's page as children of parent, one
+ * per run of adjacent dirty blocks. Hold the page's block headers, and record
+ * the submitted blocks in wb.
+ *
+ * Precondition:
+ * Caller holds a reference on the page.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory. Some runs may not be submitted.
+ */
+static err_t write_dirty_blks(struct wb_page *wb, struct bio *parent);
+
+/*
+ * Mark the submitted blocks of a written back page clean, if they were not
+ * dirtied again since. Skipped if the writes failed. Then drop the page and its
+ * block headers.
+ */
+static void clean_page(struct wb_page *wb, bool written);
+
+/*
+ * Body of the writeback thread: periodically write back old dirty pages of the
+ * root block device, and evict cached pages when memory is short.
+ */
+static int writeback_thread(void *aux);
+
+static void
+bio_put_remaining(struct bio *bio, err_t err)
+{
+    struct bio *parent;
+    bio_end_io_t end_io;
+
+    // Walk up the chain instead of recursing, a parent may have many levels
+    for (; bio != NULL; bio = parent) {
+        spinlock_acquire(&bio->lock);
+        kassert(bio->remaining > 0);
+        if (bio->err == ERR_OK) {
+            bio->err = err;
+        }
+        if (--bio->remaining > 0) {
+            spinlock_release(&bio->lock);
+            return;
+        }
+        // Read everything needed before the bio is handed back: its owner may
+        // free it as soon as it completes
+        parent = bio->parent;
+        end_io = bio->end_io;
+        err = bio->err;
+        bio->parent = NULL;
+        bio->remaining = 1;
+        bio->status = BIO_COMPLETE;
+        if (end_io == NULL) {
+            condvar_broadcast(&bio->cv);
+        }
+        spinlock_release(&bio->lock);
+        if (end_io != NULL) {
+            end_io(bio);
+        }
+    }
+}
+
+static void
+end_child_bio(struct bio *bio)
+{
+    bio_free(bio);
+}
+
+static err_t
+write_dirty_blks(struct wb_page *wb, struct bio *parent)
+{
+    struct page *page = wb->page;
+    struct blk_header *bh, *first = NULL;
+    size_t index, start = 0, size = 0;
+    err_t err = ERR_OK;
+
+    sleeplock_acquire(&page->lock);
+    // The page may have been cleaned and its headers freed since it was taken
+    // off the dirty list
+    if (page->blk_headers == NULL) {
+        sleeplock_release(&page->lock);
+        return ERR_OK;
+    }
+    // Keep the headers until the writes are done
+    page->blk_refs++;
+    wb->held = True;
+    for (index = 0; index <= N_BLKS_PER_PAGE; index++) {
+        bh = index < N_BLKS_PER_PAGE ? &page->blk_headers[index] : NULL;
+        if (bh != NULL && bdev_is_blk_dirty(bh)) {
+            if (size++ == 0) {
+                first = bh;
+                start = index;
+            }
+            wb->gens[index] = bh->dirty_gen;
+            continue;
+        }
+        // A run of dirty blocks ends here
+        if (size > 0) {
+            if ((err = bdev_submit_child(parent, first->bdev, BIO_WRITE, first->blk,
+                                         size, first->data)) != ERR_OK) {
+                break;
+            }
+            for (; size > 0; size--, start++) {
+                wb->submitted |= 1u << start;
+            }
+        }
+    }
+    sleeplock_release(&page->lock);
+    return err;
+}
+
+static void
+clean_page(struct wb_page *wb, bool written)
+{
+    struct page *page = wb->page;
+    struct blk_header *bh;
+    size_t index;
+
+    if (wb->held) {
+        for (index = 0; written && index < N_BLKS_PER_PAGE; index++) {
+            if ((wb->submitted & (1u << index)) == 0) {
+                continue;
+            }
+            bh = &page->blk_headers[index];
+            // A block dirtied again after its write was submitted may hold
+            // data that did not make it to the device
+            sleeplock_acquire(&bh->lock);
+            sleeplock_acquire(&page->lock);
+            if (bh->dirty_gen != wb->gens[index]) {
+                sleeplock_release(&page->lock);
+                sleeplock_release(&bh->lock);
+                continue;
+            }
+            sleeplock_release(&page->lock);
+            bdev_set_blk_dirty(bh, False);
+            sleeplock_release(&bh->lock);
+        }
+        // Headers are freed once no block of the page is referenced
+        sleeplock_acquire(&page->lock);
+        if (--page->blk_refs == 0) {
+            free_blk_headers(page);
+        }
+        sleeplock_release(&page->lock);
+    }
+    pmem_dec_refcnt(page_to_paddr(page));
+}
+
+static int
+writeback_thread(void *aux)
+{
+    struct super_block *sb;
+    uint32_t age;
+    bool reclaim;
+    err_t err, last_err = ERR_OK;
+
+    for (;;) {
+        timer_sleep(WB_INTERVAL);
+        // Past the background threshold, or when memory is short, write back
+        // dirty pages of any age. Only clean pages can be evicted.
+        reclaim = pgcache_need_reclaim();
+        age = reclaim || n_dirty_pages > dirty_background_pages ? 0 : WB_DIRTY_AGE;
+        // The file system decides when its blocks can be written back
+        sb = root_bdev->sb;
+        if (sb != NULL && sb->s_ops->writeback != NULL) {
+            err = sb->s_ops->writeback(sb, age);
+        } else {
+            err = bdev_writeback(root_bdev, age);
+        }
+        // Failed pages stay dirty and are retried next time, report once that
+        // writeback is failing. Writers past the dirty limit get the error
+        // from their own writeback.
+        if (err != ERR_OK && last_err == ERR_OK) {
+            kprintf("writeback: failed to write back dirty blocks (error %d)\n", err);
+        }
+        last_err = err;
+        if (reclaim) {
+            pgcache_reclaim();
+        }
+    }
+    return 0;
+}
+
 static err_t
 init_blk_headers(struct page *page, struct bdev *bdev, blk_t first_blk)
 {
     struct blk_header *bh;
     blk_t index;
 
-    if (list_empty(&page->blk_headers)) {
+    if (page->blk_headers == NULL) {
+        if ((page->blk_headers = kmem_cache_alloc(blk_header_allocator)) == NULL) {
+            return ERR_NOMEM;
+        }
+        page->blk_refs = 0;
         for (index = 0; index < N_BLKS_PER_PAGE; index++) {
-            if ((bh = kmem_cache_alloc(blk_header_allocator)) == NULL) {
-                return ERR_NOMEM;
-            }
+            bh = &page->blk_headers[index];
             sleeplock_init(&bh->lock);
-            list_append(&page->blk_headers, &bh->node);
             bh->bdev = bdev;
             bh->blk = first_blk + index;
             bh->page = page;
             bh->data = (void*)(kmap_p2v(page_to_paddr(page)) + BDEV_BLK_SIZE * index);
+            bh->state = 0;
             bdev_set_blk_valid(bh, True);
-            bdev_set_blk_dirty(bh, False);
             bh->ref = 0;
+            bh->dirty_gen = 0;
         }
     }
     return ERR_OK;
 }
 
 static int
-blocks_zero_ref(struct page *page)
+blocks_clean(struct page *page)
 {
-    Node *n;
-    struct blk_header *bh;
+    blk_t index;
 
-    for (n = list_begin(&page->blk_headers);
-         n != list_end(&page->blk_headers);
-         n = list_next(n)) {
-        bh = list_entry(n, struct blk_header, node);
-        if (bh->ref > 0) {
+    for (index = 0; index < N_BLKS_PER_PAGE; index++) {
+        if (bdev_is_blk_dirty(&page->blk_headers[index])) {
             return False;
         }
     }
@@ -106,26 +330,23 @@ blocks_zero_ref(struct page *page)
 static void
 free_blk_headers(struct page *page)
 {
-    Node *curr, *next;
-    struct blk_header *bh;
-
-    // If page is dirty, do not free headers -- a kernel thread will write the
-    // dirty page back to bdev, and free the headers.
+    // If page is dirty, do not free headers -- the writeback thread will write
+    // the dirty page back to bdev, and free the headers.
     if (pmem_is_page_dirty(page)) {
         return;
     }
-    for (curr = list_begin(&page->blk_headers); !list_empty(&page->blk_headers); curr = next) {
-        bh = list_entry(curr, struct blk_header, node);
-        // Page must be clean
-        kassert(!bdev_is_blk_dirty(bh));
-        next = list_remove(curr); // we are going to free the curr node
-        kmem_cache_free(blk_header_allocator, bh);
-    }
+    // Page must be clean
+    kassert(blocks_clean(page));
+    kmem_cache_free(blk_header_allocator, page->blk_headers);
+    page->blk_headers = NULL;
 }
 
 void
 bdev_init(void)
 {
+    struct memstat stat;
+    struct thread *t;
+
     // Create object allocators
     if ((bdev_allocator = kmem_cache_create(sizeof(struct bdev))) == NULL) {
         panic("Failed to create bdev_allocator");
@@ -133,16 +354,34 @@ bdev_init(void)
     if ((bio_allocator = kmem_cache_create(sizeof(struct bio))) == NULL) {
         panic("Failed to create bio_allocator");
     }
-    if ((blk_header_allocator = kmem_cache_create(sizeof(struct blk_header))) == NULL) {
+    if ((request_allocator = kmem_cache_create(sizeof(struct bdev_request))) == NULL) {
+        panic("Failed to create request_allocator");
+    }
+    if ((blk_header_allocator = kmem_cache_create(sizeof(struct blk_header) * N_BLKS_PER_PAGE)) == NULL) {
         panic("Failed to create blk_header_allocator");
     }
-    // Initialize root block device: currently using IDE
+    pmem_get_stat(&stat);
+    dirty_background_pages = stat.total_pages * WB_BACKGROUND_RATIO / 100;
+    dirty_limit_pages = stat.total_pages * WB_LIMIT_RATIO / 100;
+    if ((t = thread_create("writeback thread", NULL, DEFAULT_PRI)) == NULL) {
+        panic("Failed to create writeback thread");
+    }
+    // Initialize root block device: a virtio disk if one is present, IDE
+    // otherwise
+    if ((root_bdev = virtio_blk_alloc(ROOT_DEV_NUM)) != NULL) {
+        if (virtio_blk_init(root_bdev) == ERR_OK) {
+            thread_start_context(t, writeback_thread, NULL);
+            return;
+        }
+        virtio_blk_free(root_bdev);
+    }
     if ((root_bdev = ide_alloc(ROOT_DEV_NUM, ROOT_IDE_INDEX)) == NULL) {
         panic("Failed to allocate root block device");
     }
     if (ide_init(root_bdev) != ERR_OK) {
         panic("Failed to initialized root block device");
     }
+    thread_start_context(t, writeback_thread, NULL);
 }
 
 struct bdev*
@@ -154,8 +393,15 @@ bdev_alloc(dev_t dev)
         bdev->dev = dev;
         list_init(&bdev->request_queue);
         spinlock_init(&bdev->queue_lock);
+        bdev->iosched = &iosched_elevator;
+        bdev->iosched_pos = 0;
+        // Drivers that take larger transfers raise this
+        bdev->max_blks = N_BLKS_PER_PAGE;
         bdev->request_handler = NULL;
         bdev->data = NULL;
+        bdev->sb = NULL;
+        list_init(&bdev->dirty_pages);
+        spinlock_init(&bdev->dirty_lock);
         if ((bdev->store = bdevms_alloc(bdev)) == NULL) {
             kmem_cache_free(bdev_allocator, bdev);
             bdev = NULL;
@@ -183,8 +429,13 @@ bio_alloc(void)
         bio->size = 0;
         bio->buffer = NULL;
         bio->status = BIO_PENDING;
+        bio->err = ERR_OK;
         spinlock_init(&bio->lock);
         condvar_init(&bio->cv);
+        bio->end_io = NULL;
+        bio->private = NULL;
+        bio->parent = NULL;
+        bio->remaining = 1;
     }
     return bio;
 }
@@ -195,25 +446,125 @@ bio_free(struct bio *bio)
     kmem_cache_free(bio_allocator, bio);
 }
 
-void
-bdev_make_request(struct bio *bio)
+err_t
+bdev_submit_bio(struct bio *bio)
 {
-    struct bdev_request request;
+    struct bdev_request *request;
+    bool queued;
 
-    // Add request to block device's request queue
+    kassert(bio);
     bio->status = BIO_PENDING;
-    request.bio = bio;
+    // Nothing to transfer, the bio only waits for its children
+    if (bio->bdev == NULL) {
+        bio_put_remaining(bio, ERR_OK);
+        return ERR_OK;
+    }
+    kassert(bio->size > 0 && bio->size <= bio->bdev->max_blks);
+    // Allocate outside the queue lock, the request is freed again if the bio
+    // is merged into a queued one
+    if ((request = kmem_cache_alloc(request_allocator)) == NULL) {
+        return ERR_NOMEM;
+    }
+    // Add bio to block device's request queue
     spinlock_acquire(&bio->bdev->queue_lock);
-    list_append(&bio->bdev->request_queue, &request.node);
+    queued = bio->bdev->iosched->add_bio(bio->bdev, bio, request);
     spinlock_release(&bio->bdev->queue_lock);
+    if (!queued) {
+        kmem_cache_free(request_allocator, request);
+    }
     // Call the device driver to handle the request
     bio->bdev->request_handler(bio->bdev);
+    return ERR_OK;
+}
+
+err_t
+bdev_make_request(struct bio *bio)
+{
+    err_t err;
+
+    kassert(bio->end_io == NULL);
+    if ((err = bdev_submit_bio(bio)) != ERR_OK) {
+        return err;
+    }
+    return bio_wait(bio);
+}
+
+void
+bio_chain(struct bio *child, struct bio *parent)
+{
+    kassert(child->parent == NULL);
+    child->parent = parent;
+    spinlock_acquire(&parent->lock);
+    parent->remaining++;
+    spinlock_release(&parent->lock);
+}
+
+err_t
+bdev_submit_child(struct bio *parent, struct bdev *bdev, bio_op_t op,
+                  blk_t blk, size_t size, void *buffer)
+{
+    struct bio *bio;
+
+    if ((bio = bio_alloc()) == NULL) {
+        return ERR_NOMEM;
+    }
+    bio->bdev = bdev;
+    bio->blk = blk;
+    bio->size = size;
+    bio->buffer = buffer;
+    bio->op = op;
+    bio->end_io = end_child_bio;
+    bio_chain(bio, parent);
+    if (bdev_submit_bio(bio) != ERR_OK) {
+        // Completing the bio frees it, and drops it from the parent
+        bio_endio(bio, ERR_OK);
+        return ERR_NOMEM;
+    }
+    return ERR_OK;
+}
+
+err_t
+bio_wait(struct bio *bio)
+{
     // Wait for block operation to complete
     spinlock_acquire(&bio->lock);
     while (bio->status != BIO_COMPLETE) {
         condvar_wait(&bio->cv, &bio->lock);
     }
     spinlock_release(&bio->lock);
+    return bio->err;
+}
+
+void
+bio_endio(struct bio *bio, err_t err)
+{
+    bio_put_remaining(bio, err);
+}
+
+struct bdev_request*
+bdev_next_request(struct bdev *bdev)
+{
+    struct bdev_request *request;
+
+    spinlock_acquire(&bdev->queue_lock);
+    request = bdev->iosched->next_request(bdev);
+    spinlock_release(&bdev->queue_lock);
+    return request;
+}
+
+void
+bdev_end_request(struct bdev_request *request, err_t err)
+{
+    Node *n;
+    struct bio *bio;
+
+    // Unlink each bio first, its owner may free it once it completes
+    for (n = list_begin(&request->bios); n != list_end(&request->bios); ) {
+        bio = list_entry(n, struct bio, req_node);
+        n = list_remove(n);
+        bio_endio(bio, err);
+    }
+    kmem_cache_free(request_allocator, request);
 }
 
 int
@@ -233,14 +584,36 @@ bdev_is_blk_dirty(struct blk_header *bh) {
 
 void
 bdev_set_blk_dirty(struct blk_header *bh, int dirty) {
-    bh->state = set_state_bit(bh->state, BLK_HEADER_DIRTY, dirty);
+    struct page *page = bh->page;
+
+    sleeplock_acquire(&page->lock);
+    // Every change is newer than the writes submitted so far
     if (dirty) {
-        sleeplock_acquire(&bh->page->lock);
-        pmem_set_page_dirty(bh->page, True);
-        sleeplock_release(&bh->page->lock);
+        bh->dirty_gen++;
     }
-    // Code that writes dirty pages back to bdev is responsible for clearing the
-    // page's dirty bit
+    if (!bdev_is_blk_dirty(bh) == !dirty) {
+        sleeplock_release(&page->lock);
+        return;
+    }
+    bh->state = set_state_bit(bh->state, BLK_HEADER_DIRTY, dirty);
+    // A page is dirty while any of its blocks is, and stays on the bdev's list
+    // of dirty pages meanwhile
+    if (dirty && !pmem_is_page_dirty(page)) {
+        pmem_set_page_dirty(page, True);
+        page->dirtied_at = timer_get_ticks();
+        spinlock_acquire(&bh->bdev->dirty_lock);
+        list_append(&bh->bdev->dirty_pages, &page->dirty_node);
+        spinlock_release(&bh->bdev->dirty_lock);
+        __sync_fetch_and_add(&n_dirty_pages, 1);
+    } else if (!dirty && blocks_clean(page)) {
+        kassert(pmem_is_page_dirty(page));
+        pmem_set_page_dirty(page, False);
+        spinlock_acquire(&bh->bdev->dirty_lock);
+        list_remove(&page->dirty_node);
+        spinlock_release(&bh->bdev->dirty_lock);
+        __sync_fetch_and_sub(&n_dirty_pages, 1);
+    }
+    sleeplock_release(&page->lock);
 }
 
 struct blk_header*
@@ -258,36 +631,33 @@ struct blk_header*
 bdev_get_blk_unlocked(struct bdev *bdev, blk_t blk)
 {
     struct page *page;
-    Node *n;
     struct blk_header *bh;
 
+    // Each block reference holds a reference on the page, taken before the
+    // page can be evicted
     sleeplock_acquire(&bdev->store->pgcache_lock);
     if ((page = pgcache_get_page(bdev->store, blk * BDEV_BLK_SIZE)) == NULL) {
         sleeplock_release(&bdev->store->pgcache_lock);
         return NULL;
     }
+    pmem_inc_refcnt(page_to_paddr(page), 1);
     sleeplock_release(&bdev->store->pgcache_lock);
 
     sleeplock_acquire(&page->lock);
     if (init_blk_headers(page, bdev, FIRST_BLK_IN_PAGE(blk)) != ERR_OK) {
         sleeplock_release(&page->lock);
-        // XXX dec reference count on the page
+        pmem_dec_refcnt(page_to_paddr(page));
         return NULL;
     }
 
-    // Iterate through block headers in the page to find the requested block
-    for (n = list_begin(&page->blk_headers);
-         n != list_end(&page->blk_headers);
-         n = list_next(n)) {
-        bh = list_entry(n, struct blk_header, node);
-        kassert(bh);
-        if (bh->blk == blk) {
-            bh->ref++;
-            sleeplock_release(&page->lock);
-            return bh;
-        }
+    // Headers are indexed by the block's position in the page
+    bh = &page->blk_headers[blk % N_BLKS_PER_PAGE];
+    kassert(bh->blk == blk);
+    if (bh->ref++ == 0) {
+        page->blk_refs++;
     }
-    panic("bdev block not found in page");
+    sleeplock_release(&page->lock);
+    return bh;
 }
 
 void
@@ -303,19 +673,29 @@ bdev_release_blk_unlocked(struct blk_header *bh)
     struct page *page = bh->page;
     sleeplock_acquire(&page->lock);
     kassert(bh->ref > 0);
-    bh->ref--;
-    // if bh still has references, no need to test blocks_zero_ref
-    if (bh->ref == 0 && blocks_zero_ref(page)) {
+    // Headers are freed once no block of the page is referenced
+    if (--bh->ref == 0 && --page->blk_refs == 0) {
         free_blk_headers(page);
     }
     sleeplock_release(&page->lock);
-    // XXX dec reference count on the page
+    pmem_dec_refcnt(page_to_paddr(page));
+}
+
+void
+bdev_hold_blk(struct blk_header *bh)
+{
+    sleeplock_acquire(&bh->page->lock);
+    kassert(bh->ref > 0);
+    bh->ref++;
+    sleeplock_release(&bh->page->lock);
+    pmem_inc_refcnt(page_to_paddr(bh->page), 1);
 }
 
 err_t
 bdev_write_blk(struct blk_header *bh)
 {
     struct bio *bio;
+    err_t err;
 
     kassert(bdev_is_blk_valid(bh));
 
@@ -328,10 +708,96 @@ bdev_write_blk(struct blk_header *bh)
     bio->size = 1;
     bio->buffer = bh->data;
     bio->op = BIO_WRITE;
-    bdev_make_request(bio);
+    if ((err = bdev_make_request(bio)) != ERR_OK) {
+        bio_free(bio);
+        return err;
+    }
     bio_free(bio);
     // Now the block buffer is clean
     bdev_set_blk_dirty(bh, False);
 
     return ERR_OK;
 }
+
+err_t
+bdev_writeback(struct bdev *bdev, uint32_t age)
+{
+    struct wb_page *batch;
+    unsigned int *gens;
+    struct page *page;
+    struct bio *parent;
+    Node *n;
+    uint32_t now;
+    int i, npages;
+    bool written;
+    err_t err = ERR_OK;
+
+    // Too large for the kernel stack
+    if ((batch = kmalloc(WB_BATCH * (sizeof(struct wb_page) + N_BLKS_PER_PAGE * sizeof(unsigned int)))) == NULL) {
+        return ERR_NOMEM;
+    }
+    gens = (unsigned int*)&batch[WB_BATCH];
+    for (i = 0; i < WB_BATCH; i++) {
+        batch[i].gens = &gens[i * N_BLKS_PER_PAGE];
+    }
+    while (err == ERR_OK) {
+        // Take the oldest dirty pages. They are clean after this round unless
+        // dirtied again meanwhile, so the next round continues with younger
+        // ones.
+        now = timer_get_ticks();
+        npages = 0;
+        spinlock_acquire(&bdev->dirty_lock);
+        for (n = list_begin(&bdev->dirty_pages);
+             n != list_end(&bdev->dirty_pages) && npages < WB_BATCH;
+             n = list_next(n)) {
+            page = list_entry(n, struct page, dirty_node);
+            if (now - page->dirtied_at < age) {
+                break;
+            }
+            // Keep the page until its writes are done, it may be cleaned and
+            // evicted meanwhile
+            pmem_inc_refcnt(page_to_paddr(page), 1);
+            batch[npages].page = page;
+            batch[npages].held = False;
+            batch[npages].submitted = 0;
+            npages++;
+        }
+        spinlock_release(&bdev->dirty_lock);
+        if (npages == 0) {
+            break;
+        }
+        if ((parent = bio_alloc()) == NULL) {
+            for (i = 0; i < npages; i++) {
+                clean_page(&batch[i], False);
+            }
+            err = ERR_NOMEM;
+            break;
+        }
+        // Submit all writes before waiting, so that the I/O scheduler merges
+        // the ones of adjacent pages into large requests
+        for (i = 0; i < npages; i++) {
+            if ((err = write_dirty_blks(&batch[i], parent)) != ERR_OK) {
+                break;
+            }
+        }
+        bdev_submit_bio(parent);
+        // Some block did not make it to the device if the parent failed: keep
+        // all dirty
+        written = bio_wait(parent) == ERR_OK;
+        if (!written) {
+            err = ERR_BDEV_IO;
+        }
+        bio_free(parent);
+        for (i = 0; i < npages; i++) {
+            clean_page(&batch[i], written);
+        }
+    }
+    kfree(batch);
+    return err;
+}
+
+bool
+bdev_dirty_exceeded(void)
+{
+    return n_dirty_pages > dirty_limit_pages;
+}
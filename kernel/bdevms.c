@@ -16,6 +16,13 @@ static struct kmem_cache *bdevms_allocator = NULL;
  */
 static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
 
+/*
+ * Bdev memstore asynchronous fillpage function, and the completion of its
+ * bios.
+ */
+static err_t fillpage_async(struct memstore *store, offset_t ofs, struct page *page);
+static void fillpage_end_io(struct bio *bio);
+
 /*
  * Bdev memstore write function.
  */
@@ -26,6 +33,7 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
     struct bdevms_info *info;
     struct bio *bio;
+    err_t err;
 
     kassert(store);
     kassert(store->info);
@@ -40,11 +48,48 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
     bio->size = pg_size / BDEV_BLK_SIZE;
     bio->buffer = (void*)kmap_p2v(page_to_paddr(page));
     bio->op = BIO_READ;
-    bdev_make_request(bio);
+    if ((err = bdev_make_request(bio)) != ERR_OK) {
+        bio_free(bio);
+        return err == ERR_BDEV_IO ? ERR_MEMSTORE_IO : ERR_MEMSTORE_NOMEM;
+    }
     bio_free(bio);
     return ERR_OK;
 }
 
+static err_t
+fillpage_async(struct memstore *store, offset_t ofs, struct page *page)
+{
+    struct bdevms_info *info;
+    struct bio *bio;
+
+    kassert(store);
+    kassert(store->info);
+    kassert(page);
+    info = (struct bdevms_info*)store->info;
+    if ((bio = bio_alloc()) == NULL) {
+        return ERR_MEMSTORE_NOMEM;
+    }
+    bio->bdev = info->bdev;
+    bio->blk = pg_round_down(ofs) / BDEV_BLK_SIZE;
+    bio->size = pg_size / BDEV_BLK_SIZE;
+    bio->buffer = (void*)kmap_p2v(page_to_paddr(page));
+    bio->op = BIO_READ;
+    bio->end_io = fillpage_end_io;
+    bio->private = page;
+    if (bdev_submit_bio(bio) != ERR_OK) {
+        bio_free(bio);
+        return ERR_MEMSTORE_NOMEM;
+    }
+    return ERR_OK;
+}
+
+static void
+fillpage_end_io(struct bio *bio)
+{
+    pgcache_fill_done((struct page*)bio->private, bio->err);
+    bio_free(bio);
+}
+
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
@@ -68,6 +113,8 @@ bdevms_alloc(struct bdev *bdev)
         if ((store->info = kmem_cache_alloc(bdevms_allocator)) != NULL) {
             info = (struct bdevms_info*)store->info;
             store->fillpage = fillpage;
+            store->fillpage_async = fillpage_async;
+            store->evictable = True;
             store->write = write;
             info->bdev = bdev;
         } else {
@@ -4,8 +4,14 @@
 #include <kernel/trap.h>
 #include <lib/errcode.h>
 #include <kernel/ide.h>
+#include <kernel/pci.h>
+#include <kernel/pmem.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
 // T_IRQ_IDE is defined in arch-specific trap header
 #include <arch/trap.h>
+// KMAP_BASE is defined in arch-specific mmu header
+#include <arch/mmu.h>
 
 #define IDE_SECTOR_SIZE     512 // sector size
 // IDE registers
@@ -27,15 +33,50 @@
 #define IDE_CMD_WRITE       0x30
 #define IDE_CMD_RDMUL       0xC4
 #define IDE_CMD_WRMUL       0xC5
+#define IDE_CMD_SETMUL      0xC6
+#define IDE_CMD_READ_DMA    0xC8
+#define IDE_CMD_WRITE_DMA   0xCA
+// Largest transfer of a single command (a sector count of 0 means 256)
+#define IDE_MAX_SECTORS     256
+// Sectors moved per interrupt by multiple commands
+#define IDE_MULT_SECTORS    16
+
+// Bus master registers of the primary channel, relative to the PCI BAR4 base
+#define IDE_BM_CMD          0x0
+#define IDE_BM_STATUS       0x2
+#define IDE_BM_PRDT         0x4
+// Bus master command bits
+#define IDE_BM_CMD_START    0x01
+#define IDE_BM_CMD_READ     0x08 // device to memory
+// Bus master status bits (write 1 to clear)
+#define IDE_BM_STATUS_ERR   0x02
+#define IDE_BM_STATUS_IRQ   0x04
+// Programming interface bit of controllers capable of bus mastering
+#define IDE_PROGIF_BUSMASTER 0x80
+
+/*
+ * Physical region descriptor: one memory region of a DMA transfer. A region
+ * must not cross a 64KiB boundary, and a size of 0 means 64KiB.
+ */
+struct ide_prd {
+    uint32_t addr;
+    uint16_t size;
+    uint16_t flags;
+} __attribute__((packed));
+
+#define IDE_PRD_EOT         0x8000 // last descriptor of the table
+#define IDE_PRD_MAX_SIZE    0x10000
+#define IDE_PRDT_LEN        (pg_size / sizeof(struct ide_prd))
 
 static struct kmem_cache *ide_allocator = NULL;
 
 /*
- * Retrieve the first operation in the device's request queue. Set pop to True
- * to also remove the first request in the queue. Return NULL if request queue
- * is empty.
+ * Issue the next request in the device's request queue, if the device is idle.
+ *
+ * Precondition:
+ * Caller must hold the ide descriptor lock.
  */
-static struct bio *bdev_front_bio(struct bdev *bdev, int pop);
+static void ide_start(struct bdev *bdev);
 
 /*
  * IDE request handling function
@@ -58,51 +99,57 @@ static err_t ide_wait(struct bdev *bdev);
  * Issue a command to the IDE controller. Must hold the ide descriptor lock when
  * calling this function.
  */
-static void ide_issue_cmd(struct bdev *bdev, struct bio *bio);
+static void ide_issue_cmd(struct bdev *bdev, struct bdev_request *request);
+
+/*
+ * Move the next nsect sectors of the active request between the data register
+ * and the request's bio buffers.
+ *
+ * Precondition:
+ * Caller must hold the ide descriptor lock.
+ */
+static void ide_transfer(struct ide_dev *ide, size_t nsect);
 
-static struct bio*
-bdev_front_bio(struct bdev *bdev, int pop)
+/*
+ * Fill the DMA descriptor table with the bio buffers of request. Return False
+ * if a buffer cannot be reached by DMA, and the request must use PIO.
+ *
+ * Precondition:
+ * Caller must hold the ide descriptor lock.
+ */
+static bool ide_build_prdt(struct ide_dev *ide, struct bdev_request *request);
+
+/*
+ * Set up bus master DMA if the disk sits on a PCI IDE controller capable of
+ * it. Otherwise ide->prdt stays NULL, and all requests use PIO.
+ */
+static void ide_init_dma(struct ide_dev *ide);
+
+static void
+ide_start(struct bdev *bdev)
 {
-    struct bio *bio;
+    struct ide_dev *ide = (struct ide_dev*)bdev->data;
     struct bdev_request *request;
-    Node *node;
-    bio = NULL;
 
-    kassert(bdev);
-    spinlock_acquire(&bdev->queue_lock);
-    if (!list_empty(&bdev->request_queue)) {
-        node = list_begin(&bdev->request_queue);
-        request = list_entry(node, struct bdev_request, node);
-        bio = request->bio;
-        if (pop) {
-            list_remove(node);
+    // Only issue command if there is no ongoing commands
+    if (ide->status == IDE_IDLE) {
+        if ((request = bdev_next_request(bdev)) != NULL) {
+            ide_issue_cmd(bdev, request);
         }
     }
-    spinlock_release(&bdev->queue_lock);
-    return bio;
 }
 
 static void
 ide_request_handler(struct bdev *bdev)
 {
     struct ide_dev *ide;
-    struct bio *bio;
 
     kassert(bdev);
     kassert(bdev->data);
     ide = (struct ide_dev*)bdev->data;
 
     spinlock_acquire(&ide->lock);
-    // Only issue command if there is no ongoing commands
-    if (ide->status == IDE_IDLE) {
-        // Issue the first request in the request queue. Do not remove the
-        // request here -- interrupt handler requires access to the bio, and the
-        // interrupt handler will remove the request
-        if ((bio = bdev_front_bio(bdev, False)) != NULL) {
-            kassert(bio->status == BIO_PENDING);
-            ide_issue_cmd(bdev, bio);
-        }
-    }
+    ide_start(bdev);
     spinlock_release(&ide->lock);
 }
 
@@ -111,40 +158,66 @@ ide_trap_handler(irq_t irq, void *dev, void *regs)
 {
     struct bdev *bdev;
     struct ide_dev *ide;
-    struct bio *bio;
+    struct bdev_request *done;
+    err_t err;
+    size_t nsect;
+    uint8_t bm_status;
     kassert(dev);
 
     bdev = (struct bdev*)dev;
     ide = (struct ide_dev*)bdev->data;
-    bio = NULL;
+    done = NULL;
+    err = ERR_OK;
 
     spinlock_acquire(&ide->lock);
     // Nothing to do if no command was previously issued
     if (ide->status == IDE_BUSY) {
-        // First request in the queue is the active request. Can safely remove
-        // the request in the queue now.
-        bio = bdev_front_bio(bdev, True);
-        kassert(bio);
-        kassert(bio->status == BIO_PENDING);
-        if (bio->op == BIO_READ) {
-            readn(IDE_REG_DATA, bio->buffer, bio->size * BDEV_BLK_SIZE);
-        }
-        // Complete the request, and wake up the thread waiting for
-        // completion
-        spinlock_acquire(&bio->lock);
-        bio->status = BIO_COMPLETE;
-        condvar_signal(&bio->cv);
-        spinlock_release(&bio->lock);
-        // Issue the next command in the queue (if present)
-        if ((bio = bdev_front_bio(bdev, False)) != NULL) {
-            kassert(bio->status == BIO_PENDING);
-            ide_issue_cmd(bdev, bio);
+        kassert(ide->active);
+        if (ide->dma) {
+            // The interrupt may be raised before the controller is done
+            // moving data, wait for it to report the interrupt too
+            bm_status = readb(ide->bmide + IDE_BM_STATUS);
+            if (bm_status & IDE_BM_STATUS_IRQ) {
+                writeb(ide->bmide + IDE_BM_CMD, 0);
+                if (ide_wait(bdev) != ERR_OK || (bm_status & IDE_BM_STATUS_ERR)) {
+                    err = ERR_BDEV_IO;
+                }
+                writeb(ide->bmide + IDE_BM_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+                ide->left = 0;
+                done = ide->active;
+            }
         } else {
-            // We have completed all the requests
+            // Reading the status also acknowledges the interrupt
+            if (ide_wait(bdev) != ERR_OK) {
+                // The disk aborted the command, there is no more data to move
+                err = ERR_BDEV_IO;
+                done = ide->active;
+            } else if (ide->active->op == BIO_WRITE && ide->left == 0) {
+                // A read interrupts once data is ready, a write once the disk
+                // took the data and wants more, or after the last sectors
+                done = ide->active;
+            } else {
+                nsect = ide->left < ide->mult ? ide->left : ide->mult;
+                ide_transfer(ide, nsect);
+                ide->left -= nsect;
+                if (ide->active->op == BIO_READ && ide->left == 0) {
+                    done = ide->active;
+                }
+            }
+        }
+        if (done != NULL) {
+            ide->active = NULL;
             ide->status = IDE_IDLE;
+            // Issue the next command in the queue (if present)
+            ide_start(bdev);
         }
     }
     spinlock_release(&ide->lock);
+    // Complete the request outside the device lock, the completion may wake
+    // up or call back into the bios' owners
+    if (done != NULL) {
+        bdev_end_request(done, err);
+    }
     trap_notify_irq_completion();
 }
 
@@ -163,41 +236,168 @@ ide_wait(struct bdev *bdev)
 }
 
 static void
-ide_issue_cmd(struct bdev *bdev, struct bio *bio)
+ide_issue_cmd(struct bdev *bdev, struct bdev_request *request)
 {
     struct ide_dev *ide;
     int sector, num_sectors, cmd = 0;
 
     kassert(bdev);
     kassert(bdev->data);
-    kassert(bio);
+    kassert(request);
     ide = (struct ide_dev*)bdev->data;
     // Determine the command
-    sector = bio->blk * (BDEV_BLK_SIZE / IDE_SECTOR_SIZE);
-    num_sectors = bio->size * (BDEV_BLK_SIZE / IDE_SECTOR_SIZE);
-    // Currently can write a maximum of 8 sectors at once
-    kassert(num_sectors > 0 && num_sectors <= 8);
-    if (bio->op == BIO_READ) {
-        cmd = num_sectors > 1 ? IDE_CMD_RDMUL : IDE_CMD_READ;
-    } else if (bio->op == BIO_WRITE) {
-        cmd = num_sectors > 1 ? IDE_CMD_WRMUL : IDE_CMD_WRITE;
+    sector = request->blk * (BDEV_BLK_SIZE / IDE_SECTOR_SIZE);
+    num_sectors = request->size * (BDEV_BLK_SIZE / IDE_SECTOR_SIZE);
+    kassert(num_sectors > 0 && num_sectors <= IDE_MAX_SECTORS);
+    ide->active = request;
+    ide->seg = list_begin(&request->bios);
+    ide->seg_ofs = 0;
+    ide->left = num_sectors;
+    ide->dma = ide->prdt != NULL && ide_build_prdt(ide, request);
+    if (ide->dma) {
+        cmd = request->op == BIO_READ ? IDE_CMD_READ_DMA : IDE_CMD_WRITE_DMA;
+    } else if (request->op == BIO_READ) {
+        cmd = ide->mult > 1 ? IDE_CMD_RDMUL : IDE_CMD_READ;
+    } else if (request->op == BIO_WRITE) {
+        cmd = ide->mult > 1 ? IDE_CMD_WRMUL : IDE_CMD_WRITE;
     }
     // Issue the command
     ide_wait(bdev);
+    if (ide->dma) {
+        writel(ide->bmide + IDE_BM_PRDT, (uint32_t)ide->prdt_paddr);
+        writeb(ide->bmide + IDE_BM_CMD, request->op == BIO_READ ? IDE_BM_CMD_READ : 0);
+        writeb(ide->bmide + IDE_BM_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+    }
     writeb(IDE_REG_CTRL, 0);
-    writeb(IDE_REG_COUNT, num_sectors);
+    writeb(IDE_REG_COUNT, num_sectors & 0xFF);
     writeb(IDE_REG_SECTOR, sector & 0xFF);
     writeb(IDE_REG_CYL_L, (sector >> 8) & 0xFF);
     writeb(IDE_REG_CYL_H, (sector >> 16) & 0xFF);
     writeb(IDE_REG_DRIVE, 0xE0 | (ide->ide_index << 4) | ((sector >> 24) & 0x0F));
     writeb(IDE_REG_STATUS_CMD, cmd);
-    if (bio->op == BIO_WRITE) {
-        writen(IDE_REG_DATA, bio->buffer, bio->size * BDEV_BLK_SIZE);
+    if (ide->dma) {
+        // The controller moves all data, and interrupts once done
+        writeb(ide->bmide + IDE_BM_CMD, readb(ide->bmide + IDE_BM_CMD) | IDE_BM_CMD_START);
+    } else if (request->op == BIO_WRITE) {
+        // A write sends its first sectors right away, the rest as the disk
+        // interrupts for them
+        ide_wait(bdev);
+        num_sectors = ide->left < ide->mult ? ide->left : ide->mult;
+        ide_transfer(ide, num_sectors);
+        ide->left -= num_sectors;
     }
     // Change status to busy
     ide->status = IDE_BUSY;
 }
 
+static void
+ide_transfer(struct ide_dev *ide, size_t nsect)
+{
+    struct bio *bio;
+    size_t n, nbytes = nsect * IDE_SECTOR_SIZE;
+
+    // A transfer may span several bios of the request
+    while (nbytes > 0) {
+        kassert(ide->seg != list_end(&ide->active->bios));
+        bio = list_entry(ide->seg, struct bio, req_node);
+        n = bio->size * BDEV_BLK_SIZE - ide->seg_ofs;
+        if (n > nbytes) {
+            n = nbytes;
+        }
+        if (ide->active->op == BIO_READ) {
+            readn(IDE_REG_DATA, (char*)bio->buffer + ide->seg_ofs, n);
+        } else {
+            writen(IDE_REG_DATA, (char*)bio->buffer + ide->seg_ofs, n);
+        }
+        nbytes -= n;
+        ide->seg_ofs += n;
+        if (ide->seg_ofs == bio->size * BDEV_BLK_SIZE) {
+            ide->seg = list_next(ide->seg);
+            ide->seg_ofs = 0;
+        }
+    }
+}
+
+static bool
+ide_build_prdt(struct ide_dev *ide, struct bdev_request *request)
+{
+    Node *n;
+    struct bio *bio;
+    struct ide_prd *prd;
+    vaddr_t vaddr;
+    paddr_t paddr;
+    size_t left, len, i = 0;
+
+    for (n = list_begin(&request->bios); n != list_end(&request->bios); n = list_next(n)) {
+        bio = list_entry(n, struct bio, req_node);
+        vaddr = (vaddr_t)bio->buffer;
+        // Only the kernel's direct map has known physical addresses
+        if (vaddr < KMAP_BASE) {
+            return False;
+        }
+        // Split buffers at page boundaries, which never cross 64KiB ones
+        for (left = bio->size * BDEV_BLK_SIZE; left > 0; left -= len, vaddr += len) {
+            len = pg_size - (vaddr & (pg_size - 1));
+            if (len > left) {
+                len = left;
+            }
+            paddr = kmap_v2p(vaddr);
+            // Descriptors only hold 32-bit addresses
+            if (paddr + len > 0xFFFFFFFF) {
+                return False;
+            }
+            prd = i > 0 ? &ide->prdt[i - 1] : NULL;
+            // Extend the last region if the memory is contiguous
+            if (prd != NULL && prd->addr + prd->size == paddr &&
+                prd->size + len < IDE_PRD_MAX_SIZE &&
+                (prd->addr / IDE_PRD_MAX_SIZE) == ((paddr + len - 1) / IDE_PRD_MAX_SIZE)) {
+                prd->size += len;
+                continue;
+            }
+            if (i == IDE_PRDT_LEN) {
+                return False;
+            }
+            ide->prdt[i].addr = (uint32_t)paddr;
+            ide->prdt[i].size = len;
+            ide->prdt[i].flags = 0;
+            i++;
+        }
+    }
+    kassert(i > 0);
+    ide->prdt[i - 1].flags = IDE_PRD_EOT;
+    return True;
+}
+
+static void
+ide_init_dma(struct ide_dev *ide)
+{
+    struct pci_dev pci;
+    uint32_t bar, command;
+    paddr_t paddr;
+
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &pci) != ERR_OK) {
+        return;
+    }
+    if (!((pci_read(&pci, PCI_REG_CLASS) >> 8) & IDE_PROGIF_BUSMASTER)) {
+        return;
+    }
+    bar = pci_read(&pci, PCI_REG_BAR(4));
+    if (!(bar & PCI_BAR_IO) || (bar & PCI_BAR_IO_MASK) == 0) {
+        return;
+    }
+    // The descriptor table must be 4 byte aligned and not cross 64KiB, a page
+    // is both
+    if (pmem_alloc(&paddr) != ERR_OK) {
+        return;
+    }
+    // Keep the status half of the register as is, its bits clear on write
+    command = pci_read(&pci, PCI_REG_COMMAND) & 0xFFFF;
+    pci_write(&pci, PCI_REG_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    ide->bmide = bar & PCI_BAR_IO_MASK;
+    ide->prdt = (struct ide_prd*)kmap_p2v(paddr);
+    ide->prdt_paddr = paddr;
+}
+
 struct bdev*
 ide_alloc(dev_t dev, uint8_t ide_index)
 {
@@ -219,8 +419,14 @@ ide_alloc(dev_t dev, uint8_t ide_index)
     spinlock_init(&ide->lock);
     ide->status = IDE_IDLE;
     ide->ide_index = ide_index;
+    ide->mult = 1;
+    ide->active = NULL;
+    ide->bmide = 0;
+    ide->prdt = NULL;
+    ide->dma = False;
     bdev->data = (void*)ide;
     bdev->request_handler = ide_request_handler;
+    bdev->max_blks = IDE_MAX_SECTORS / (BDEV_BLK_SIZE / IDE_SECTOR_SIZE);
     return bdev;
 }
 
@@ -233,6 +439,9 @@ ide_free(struct bdev *bdev)
     kassert(bdev->data);
     ide = (struct ide_dev*)bdev->data;
     // XXX wait for device to become idle?
+    if (ide->prdt != NULL) {
+        pmem_free(ide->prdt_paddr);
+    }
     kmem_cache_free(ide_allocator, ide);
     bdev_free(bdev);
 }
@@ -240,7 +449,11 @@ ide_free(struct bdev *bdev)
 err_t
 ide_init(struct bdev *bdev)
 {
+    struct ide_dev *ide;
+
     kassert(bdev);
+    kassert(bdev->data);
+    ide = (struct ide_dev*)bdev->data;
     // register trap handler
     if (trap_register_handler(T_IRQ_IDE, bdev, ide_trap_handler) != ERR_OK) {
         return ERR_IDE_INIT_FAIL;
@@ -251,5 +464,13 @@ ide_init(struct bdev *bdev)
     }
     // Wait for the disk to become ready
     ide_wait(bdev);
+    // Move several sectors per interrupt if the disk supports it, otherwise
+    // fall back to one sector per interrupt. The device is idle, so the trap
+    // handler ignores the command's interrupt.
+    writeb(IDE_REG_COUNT, IDE_MULT_SECTORS);
+    writeb(IDE_REG_DRIVE, 0xE0 | (ide->ide_index << 4));
+    writeb(IDE_REG_STATUS_CMD, IDE_CMD_SETMUL);
+    ide->mult = ide_wait(bdev) == ERR_OK ? IDE_MULT_SECTORS : 1;
+    ide_init_dma(ide);
     return ERR_OK;
 }
@@ -0,0 +1,122 @@
+#include <kernel/pci.h>
+#include <kernel/io.h>
+#include <lib/errcode.h>
+
+// Configuration space access mechanism #1
+#define PCI_CONFIG_ADDR     0x0CF8
+#define PCI_CONFIG_DATA     0x0CFC
+#define PCI_CONFIG_ENABLE   0x80000000
+
+#define PCI_MAX_BUS         256
+#define PCI_MAX_SLOT        32
+#define PCI_MAX_FUNC        8
+// Vendor id read from a slot without a device
+#define PCI_VENDOR_NONE     0xFFFF
+// Header type bit set by multi-function devices
+#define PCI_HEADER_MULTIFUNC 0x80
+
+/*
+ * Select a configuration register for the next access to PCI_CONFIG_DATA.
+ */
+static void pci_select(struct pci_dev *dev, uint8_t reg);
+
+/*
+ * Find the first function for which match returns True, and store its
+ * location in *dev. Return ERR_NOTEXIST if there is none.
+ */
+static err_t pci_find(bool (*match)(struct pci_dev*, void*), void *aux, struct pci_dev *dev);
+
+/*
+ * Matching functions for pci_find. aux points to the class and subclass, or
+ * to the vendor and device id to look for.
+ */
+static bool match_class(struct pci_dev *dev, void *aux);
+static bool match_device(struct pci_dev *dev, void *aux);
+
+static void
+pci_select(struct pci_dev *dev, uint8_t reg)
+{
+    writel(PCI_CONFIG_ADDR, PCI_CONFIG_ENABLE | ((uint32_t)dev->bus << 16) |
+           ((uint32_t)dev->slot << 11) | ((uint32_t)dev->func << 8) | (reg & 0xFC));
+}
+
+uint32_t
+pci_read(struct pci_dev *dev, uint8_t reg)
+{
+    pci_select(dev, reg);
+    return readl(PCI_CONFIG_DATA);
+}
+
+void
+pci_write(struct pci_dev *dev, uint8_t reg, uint32_t val)
+{
+    pci_select(dev, reg);
+    writel(PCI_CONFIG_DATA, val);
+}
+
+static err_t
+pci_find(bool (*match)(struct pci_dev*, void*), void *aux, struct pci_dev *dev)
+{
+    struct pci_dev d;
+    uint32_t id;
+    int bus, slot, func, nfunc;
+
+    for (bus = 0; bus < PCI_MAX_BUS; bus++) {
+        for (slot = 0; slot < PCI_MAX_SLOT; slot++) {
+            d.bus = bus;
+            d.slot = slot;
+            nfunc = 1;
+            for (func = 0; func < nfunc; func++) {
+                d.func = func;
+                id = pci_read(&d, PCI_REG_ID);
+                if ((id & 0xFFFF) == PCI_VENDOR_NONE) {
+                    continue;
+                }
+                // Only look past function 0 of multi-function devices
+                if (func == 0 && (pci_read(&d, PCI_REG_HEADER) >> 16) & PCI_HEADER_MULTIFUNC) {
+                    nfunc = PCI_MAX_FUNC;
+                }
+                d.vendor = id & 0xFFFF;
+                d.device = id >> 16;
+                if (match(&d, aux)) {
+                    *dev = d;
+                    return ERR_OK;
+                }
+            }
+        }
+    }
+    return ERR_NOTEXIST;
+}
+
+static bool
+match_class(struct pci_dev *dev, void *aux)
+{
+    uint8_t *cls = aux;
+    uint32_t reg = pci_read(dev, PCI_REG_CLASS);
+
+    return (reg >> 24) == cls[0] && ((reg >> 16) & 0xFF) == cls[1];
+}
+
+static bool
+match_device(struct pci_dev *dev, void *aux)
+{
+    uint16_t *id = aux;
+
+    return dev->vendor == id[0] && dev->device == id[1];
+}
+
+err_t
+pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *dev)
+{
+    uint8_t cls[2] = {class, subclass};
+
+    return pci_find(match_class, cls, dev);
+}
+
+err_t
+pci_find_device(uint16_t vendor, uint16_t device, struct pci_dev *dev)
+{
+    uint16_t id[2] = {vendor, device};
+
+    return pci_find(match_device, id, dev);
+}
@@ -0,0 +1,468 @@
+#include <kernel/kmalloc.h>
+#include <kernel/io.h>
+#include <kernel/console.h>
+#include <kernel/trap.h>
+#include <kernel/pci.h>
+#include <kernel/pmem.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
+#include <kernel/virtio_blk.h>
+#include <lib/errcode.h>
+#include <lib/string.h>
+// T_IRQ0 is defined in arch-specific trap header
+#include <arch/trap.h>
+// KMAP_BASE is defined in arch-specific mmu header
+#include <arch/mmu.h>
+
+#define VIRTIO_VENDOR           0x1AF4
+#define VIRTIO_DEVICE_BLK       0x1001 // transitional block device
+
+// Legacy virtio registers, relative to the PCI BAR0 base
+#define VIRTIO_REG_DEV_FEATURES 0x00
+#define VIRTIO_REG_DRV_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN    0x08
+#define VIRTIO_REG_QUEUE_SIZE   0x0C
+#define VIRTIO_REG_QUEUE_SEL    0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY 0x10
+#define VIRTIO_REG_STATUS       0x12
+#define VIRTIO_REG_ISR          0x13
+// Device status bits
+#define VIRTIO_STATUS_ACK       0x1
+#define VIRTIO_STATUS_DRIVER    0x2
+#define VIRTIO_STATUS_DRIVER_OK 0x4
+#define VIRTIO_STATUS_FAILED    0x80
+// Legacy queues are page aligned, and given to the device by page number
+#define VIRTIO_QUEUE_ALIGN      4096
+#define VIRTIO_QUEUE_PFN_SHIFT  12
+
+#define VIRTIO_BLK_SECTOR_SIZE  512
+// Request types
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_S_OK         0
+// Largest request, in blocks
+#define VIRTIO_BLK_MAX_BLKS     256
+
+/*
+ * Virtqueue layout, shared with the device.
+ */
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+#define VRING_DESC_F_NEXT       0x1 // chain continues in next
+#define VRING_DESC_F_WRITE      0x2 // device writes the buffer
+
+struct vring_avail {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id; // head descriptor of the chain
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    volatile uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+/*
+ * Request header read by the device.
+ */
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+};
+
+/*
+ * Per request data. The header and status are read and written by the device.
+ */
+struct virtio_blk_slot {
+    struct virtio_blk_outhdr hdr;
+    volatile uint8_t status;
+    struct bdev_request *request;
+};
+
+static struct kmem_cache *virtio_blk_allocator = NULL;
+
+/*
+ * Virtio block request handling function
+ */
+static void virtio_blk_request_handler(struct bdev *bdev);
+
+/*
+ * Virtio block trap handler function
+ */
+static void virtio_blk_trap_handler(irq_t irq, void *dev, void *regs);
+
+/*
+ * Place queued requests on the virtqueue until the queue is empty or the
+ * virtqueue is full, and notify the device if any were placed.
+ *
+ * Precondition:
+ * Caller must hold the virtio block descriptor lock.
+ */
+static void virtio_blk_start(struct bdev *bdev);
+
+/*
+ * Return the number of data descriptors request needs: one per run of
+ * physically contiguous bio buffers.
+ */
+static size_t virtio_blk_count_segs(struct bdev_request *request);
+
+/*
+ * Place request on the virtqueue.
+ *
+ * Precondition:
+ * Caller must hold the virtio block descriptor lock, and the virtqueue must
+ * have enough free descriptors for the request.
+ */
+static void virtio_blk_queue(struct virtio_blk_dev *vblk, struct bdev_request *request);
+
+/*
+ * Take a descriptor off / put a descriptor chain back on the free list.
+ *
+ * Precondition:
+ * Caller must hold the virtio block descriptor lock.
+ */
+static uint16_t desc_alloc(struct virtio_blk_dev *vblk);
+static void desc_free_chain(struct virtio_blk_dev *vblk, uint16_t head);
+
+static void
+virtio_blk_request_handler(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    vblk = (struct virtio_blk_dev*)bdev->data;
+
+    spinlock_acquire(&vblk->lock);
+    virtio_blk_start(bdev);
+    spinlock_release(&vblk->lock);
+}
+
+static void
+virtio_blk_trap_handler(irq_t irq, void *dev, void *regs)
+{
+    struct bdev *bdev;
+    struct virtio_blk_dev *vblk;
+    struct virtio_blk_slot *slot;
+    struct bdev_request *request;
+    uint16_t head;
+    List done, failed;
+    Node *n;
+    kassert(dev);
+
+    bdev = (struct bdev*)dev;
+    vblk = (struct virtio_blk_dev*)bdev->data;
+    list_init(&done);
+    list_init(&failed);
+
+    // Reading the ISR status acknowledges the interrupt
+    readb(vblk->iobase + VIRTIO_REG_ISR);
+    spinlock_acquire(&vblk->lock);
+    // Collect every request the device finished since the last interrupt
+    while (vblk->last_used != vblk->used->idx) {
+        __sync_synchronize();
+        head = vblk->used->ring[vblk->last_used % vblk->qsize].id;
+        slot = &vblk->slots[head];
+        request = slot->request;
+        kassert(request);
+        slot->request = NULL;
+        desc_free_chain(vblk, head);
+        list_append(slot->status == VIRTIO_BLK_S_OK ? &done : &failed, &request->node);
+        vblk->last_used++;
+    }
+    // Freed descriptors make room for more requests
+    virtio_blk_start(bdev);
+    spinlock_release(&vblk->lock);
+    // Complete the requests outside the device lock, the completion may wake
+    // up or call back into the bios' owners
+    while (!list_empty(&done)) {
+        n = list_begin(&done);
+        list_remove(n);
+        bdev_end_request(list_entry(n, struct bdev_request, node), ERR_OK);
+    }
+    while (!list_empty(&failed)) {
+        n = list_begin(&failed);
+        list_remove(n);
+        bdev_end_request(list_entry(n, struct bdev_request, node), ERR_BDEV_IO);
+    }
+    trap_notify_irq_completion();
+}
+
+static void
+virtio_blk_start(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk = (struct virtio_blk_dev*)bdev->data;
+    struct bdev_request *request;
+    int queued = False;
+
+    for (;;) {
+        if ((request = vblk->stalled) == NULL && (request = bdev_next_request(bdev)) == NULL) {
+            break;
+        }
+        // Header and status take a descriptor each
+        if (virtio_blk_count_segs(request) + 2 > vblk->num_free) {
+            vblk->stalled = request;
+            break;
+        }
+        vblk->stalled = NULL;
+        virtio_blk_queue(vblk, request);
+        queued = True;
+    }
+    if (queued) {
+        // Make the ring updates visible before the device looks at them
+        __sync_synchronize();
+        writew(vblk->iobase + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    }
+}
+
+static size_t
+virtio_blk_count_segs(struct bdev_request *request)
+{
+    Node *n;
+    struct bio *bio;
+    vaddr_t end = 0;
+    size_t nsegs = 0;
+
+    for (n = list_begin(&request->bios); n != list_end(&request->bios); n = list_next(n)) {
+        bio = list_entry(n, struct bio, req_node);
+        // The direct map is physically contiguous, so are its contiguous
+        // buffers
+        if ((vaddr_t)bio->buffer != end) {
+            nsegs++;
+        }
+        end = (vaddr_t)bio->buffer + bio->size * BDEV_BLK_SIZE;
+    }
+    return nsegs;
+}
+
+static void
+virtio_blk_queue(struct virtio_blk_dev *vblk, struct bdev_request *request)
+{
+    Node *n;
+    struct bio *bio;
+    struct virtio_blk_slot *slot;
+    struct vring_desc *d;
+    uint16_t head, i;
+    vaddr_t end = 0;
+
+    head = desc_alloc(vblk);
+    slot = &vblk->slots[head];
+    slot->hdr.type = request->op == BIO_READ ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+    slot->hdr.ioprio = 0;
+    slot->hdr.sector = request->blk * (BDEV_BLK_SIZE / VIRTIO_BLK_SECTOR_SIZE);
+    slot->status = 0xFF;
+    slot->request = request;
+
+    d = &vblk->desc[head];
+    d->addr = vblk->slots_paddr + (vaddr_t)&slot->hdr - (vaddr_t)vblk->slots;
+    d->len = sizeof(slot->hdr);
+    d->flags = 0;
+    for (n = list_begin(&request->bios); n != list_end(&request->bios); n = list_next(n)) {
+        bio = list_entry(n, struct bio, req_node);
+        // Only the kernel's direct map has known physical addresses
+        kassert((vaddr_t)bio->buffer >= KMAP_BASE);
+        if ((vaddr_t)bio->buffer == end) {
+            d->len += bio->size * BDEV_BLK_SIZE;
+        } else {
+            i = desc_alloc(vblk);
+            d->flags |= VRING_DESC_F_NEXT;
+            d->next = i;
+            d = &vblk->desc[i];
+            d->addr = kmap_v2p((vaddr_t)bio->buffer);
+            d->len = bio->size * BDEV_BLK_SIZE;
+            d->flags = request->op == BIO_READ ? VRING_DESC_F_WRITE : 0;
+        }
+        end = (vaddr_t)bio->buffer + bio->size * BDEV_BLK_SIZE;
+    }
+    i = desc_alloc(vblk);
+    d->flags |= VRING_DESC_F_NEXT;
+    d->next = i;
+    d = &vblk->desc[i];
+    d->addr = vblk->slots_paddr + (vaddr_t)&slot->status - (vaddr_t)vblk->slots;
+    d->len = sizeof(slot->status);
+    d->flags = VRING_DESC_F_WRITE;
+
+    vblk->avail->ring[vblk->avail->idx % vblk->qsize] = head;
+    // The entry must be in the ring before the device sees the new index
+    __sync_synchronize();
+    vblk->avail->idx++;
+}
+
+static uint16_t
+desc_alloc(struct virtio_blk_dev *vblk)
+{
+    uint16_t i;
+
+    kassert(vblk->num_free > 0);
+    i = vblk->free_head;
+    vblk->free_head = vblk->desc[i].next;
+    vblk->num_free--;
+    return i;
+}
+
+static void
+desc_free_chain(struct virtio_blk_dev *vblk, uint16_t head)
+{
+    uint16_t i = head;
+
+    for (;;) {
+        vblk->num_free++;
+        if (!(vblk->desc[i].flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = vblk->desc[i].next;
+    }
+    // The chain's descriptors stay linked, put them in front of the free list
+    vblk->desc[i].next = vblk->free_head;
+    vblk->free_head = head;
+}
+
+struct bdev*
+virtio_blk_alloc(dev_t dev)
+{
+    struct bdev *bdev;
+    struct virtio_blk_dev *vblk;
+    struct pci_dev pci;
+    uint32_t bar, command;
+
+    if (pci_find_device(VIRTIO_VENDOR, VIRTIO_DEVICE_BLK, &pci) != ERR_OK) {
+        return NULL;
+    }
+    bar = pci_read(&pci, PCI_REG_BAR(0));
+    if (!(bar & PCI_BAR_IO)) {
+        return NULL;
+    }
+    if (virtio_blk_allocator == NULL) {
+        if ((virtio_blk_allocator = kmem_cache_create(sizeof(struct virtio_blk_dev))) == NULL) {
+            return NULL;
+        }
+    }
+    if ((bdev = bdev_alloc(dev)) == NULL) {
+        return NULL;
+    }
+    if ((vblk = kmem_cache_alloc(virtio_blk_allocator)) == NULL) {
+        bdev_free(bdev);
+        return NULL;
+    }
+    // Keep the status half of the register as is, its bits clear on write
+    command = pci_read(&pci, PCI_REG_COMMAND) & 0xFFFF;
+    pci_write(&pci, PCI_REG_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    spinlock_init(&vblk->lock);
+    vblk->iobase = bar & PCI_BAR_IO_MASK;
+    vblk->irq = T_IRQ0 + (pci_read(&pci, PCI_REG_IRQ) & 0xFF);
+    vblk->qsize = 0;
+    vblk->desc = NULL;
+    vblk->slots = NULL;
+    vblk->stalled = NULL;
+    bdev->data = (void*)vblk;
+    bdev->request_handler = virtio_blk_request_handler;
+    return bdev;
+}
+
+void
+virtio_blk_free(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    vblk = (struct virtio_blk_dev*)bdev->data;
+    // XXX wait for device to become idle?
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, 0);
+    if (vblk->desc != NULL) {
+        for (size_t i = 0; i < vblk->ring_pages; i++) {
+            pmem_free(vblk->ring_paddr + i * pg_size);
+        }
+    }
+    if (vblk->slots != NULL) {
+        for (size_t i = 0; i < vblk->slots_pages; i++) {
+            pmem_free(vblk->slots_paddr + i * pg_size);
+        }
+    }
+    kmem_cache_free(virtio_blk_allocator, vblk);
+    bdev_free(bdev);
+}
+
+err_t
+virtio_blk_init(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk;
+    size_t avail_size, used_size;
+    uint16_t i;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    vblk = (struct virtio_blk_dev*)bdev->data;
+
+    // Reset the device, then tell it we found it and can drive it
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, 0);
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+    // No optional features are needed
+    writel(vblk->iobase + VIRTIO_REG_DRV_FEATURES, 0);
+
+    writew(vblk->iobase + VIRTIO_REG_QUEUE_SEL, 0);
+    if ((vblk->qsize = readw(vblk->iobase + VIRTIO_REG_QUEUE_SIZE)) == 0) {
+        goto fail;
+    }
+    // Descriptors and the available ring share the first pages, the used ring
+    // starts on the next aligned page
+    avail_size = sizeof(struct vring_desc) * vblk->qsize + sizeof(struct vring_avail) +
+                 sizeof(uint16_t) * (vblk->qsize + 1);
+    used_size = sizeof(struct vring_used) + sizeof(struct vring_used_elem) * vblk->qsize +
+                sizeof(uint16_t);
+    avail_size = (avail_size + VIRTIO_QUEUE_ALIGN - 1) & ~(VIRTIO_QUEUE_ALIGN - 1);
+    vblk->ring_pages = pg_round_up(avail_size + used_size) / pg_size;
+    if (pmem_nalloc(&vblk->ring_paddr, vblk->ring_pages) != ERR_OK) {
+        goto fail;
+    }
+    vblk->desc = (struct vring_desc*)kmap_p2v(vblk->ring_paddr);
+    memset(vblk->desc, 0, vblk->ring_pages * pg_size);
+    vblk->avail = (struct vring_avail*)(vblk->desc + vblk->qsize);
+    vblk->used = (struct vring_used*)((vaddr_t)vblk->desc + avail_size);
+
+    vblk->slots_pages = pg_round_up(sizeof(struct virtio_blk_slot) * vblk->qsize) / pg_size;
+    if (pmem_nalloc(&vblk->slots_paddr, vblk->slots_pages) != ERR_OK) {
+        goto fail;
+    }
+    vblk->slots = (struct virtio_blk_slot*)kmap_p2v(vblk->slots_paddr);
+    memset(vblk->slots, 0, vblk->slots_pages * pg_size);
+
+    for (i = 0; i < vblk->qsize; i++) {
+        vblk->desc[i].next = i + 1;
+    }
+    vblk->free_head = 0;
+    vblk->num_free = vblk->qsize;
+    vblk->last_used = 0;
+    // A request takes a descriptor per bio at most, plus header and status
+    bdev->max_blks = vblk->qsize - 2 < VIRTIO_BLK_MAX_BLKS ? vblk->qsize - 2 : VIRTIO_BLK_MAX_BLKS;
+    writel(vblk->iobase + VIRTIO_REG_QUEUE_PFN, vblk->ring_paddr >> VIRTIO_QUEUE_PFN_SHIFT);
+
+    // register trap handler
+    if (trap_register_handler(vblk->irq, bdev, virtio_blk_trap_handler) != ERR_OK) {
+        goto fail;
+    }
+    // Enable IRQ
+    if (trap_enable_irq(vblk->irq) != ERR_OK) {
+        goto fail;
+    }
+    writeb(vblk->iobase + VIRTIO_REG_STATUS,
+           VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return ERR_OK;
+
+fail:
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+    return ERR_VIRTIO_BLK_INIT_FAIL;
+}
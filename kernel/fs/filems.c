@@ -20,26 +20,64 @@ static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
  */
 static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
 
+/*
+ * Take and drop a reference on the file inode.
+ */
+static void get(struct memstore *store);
+static void put(struct memstore *store);
+
 static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
     struct filems_info *info;
+    err_t err;
 
     kassert(store);
     kassert(store->info);
     kassert(page);
     info = (struct filems_info*)store->info;
-    if (info->inode->i_ops->fillpage(info->inode, pg_round_down(ofs), page) != ERR_OK) {
-        return ERR_MEMSTORE_IO;
-    }
-    return ERR_OK;
+    // Faults can land here from a syscall, which never touches user memory
+    // while holding the inode lock (see fs_read_file)
+    sleeplock_acquire(&info->inode->i_lock);
+    err = info->inode->i_ops->fillpage(info->inode, pg_round_down(ofs), page);
+    sleeplock_release(&info->inode->i_lock);
+    return err == ERR_OK ? ERR_OK : ERR_MEMSTORE_IO;
 }
 
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
-    return ERR_OK;
+    struct filems_info *info;
+    struct super_block *sb;
+    err_t err, commit_err;
+
+    kassert(store);
+    kassert(store->info);
+    info = (struct filems_info*)store->info;
+    sb = info->inode->sb;
+    if (sb->s_ops->journal_begin_txn(sb) != ERR_OK) {
+        sb->s_ops->journal_end_txn(sb);
+        return ERR_MEMSTORE_IO;
+    }
+    sleeplock_acquire(&info->inode->i_lock);
+    err = info->inode->i_ops->writepage(info->inode, pg_round_down(ofs), paddr_to_page(paddr));
+    sleeplock_release(&info->inode->i_lock);
+    commit_err = sb->s_ops->journal_end_txn(sb);
+    return err == ERR_OK && commit_err == ERR_OK ? ERR_OK : ERR_MEMSTORE_IO;
+}
+
+static void
+get(struct memstore *store)
+{
+    kassert(store && store->info);
+    fs_ref_inode(((struct filems_info*)store->info)->inode);
+}
+
+static void
+put(struct memstore *store)
+{
+    kassert(store && store->info);
+    fs_release_inode(((struct filems_info*)store->info)->inode);
 }
 
 struct memstore*
@@ -59,7 +97,10 @@ filems_alloc(struct inode *inode)
         if ((store->info = kmem_cache_alloc(filems_allocator)) != NULL) {
             info = (struct filems_info*)store->info;
             store->fillpage = fillpage;
+            store->evictable = True;
             store->write = write;
+            store->get = get;
+            store->put = put;
             info->inode = inode;
         } else {
             memstore_free(store);
@@ -74,6 +115,7 @@ filems_free(struct memstore *store)
 {
     kassert(store);
     kassert(store->info);
+    pgcache_release(store);
     kmem_cache_free(filems_allocator, store->info);
     memstore_free(store);
 }
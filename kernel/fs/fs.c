@@ -4,8 +4,11 @@
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
 #include <kernel/filems.h>
+#include <kernel/pgcache.h>
+#include <kernel/shmms.h>
 #include <kernel/proc.h>
 #include <kernel/jbd.h>
+#include <kernel/pgfault.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 #include <lib/string.h>
@@ -208,6 +211,9 @@ fs_init(void)
     // Initialize JBD
     jbd_init();
 
+    // Shared memory segments
+    shmms_init();
+
     // Root file system: currently use SFS
     if (sfs_init() != ERR_OK) {
         panic("Failed to initialize root file system");
@@ -429,6 +435,16 @@ fs_get_inode(struct super_block *sb, inum_t inum, struct inode **inode)
     return ERR_OK;
 }
 
+void
+fs_ref_inode(struct inode *inode)
+{
+    kassert(inode);
+    sleeplock_acquire(&inode->sb->s_lock);
+    kassert(inode->i_ref > 0);
+    inode->i_ref++;
+    sleeplock_release(&inode->sb->s_lock);
+}
+
 void
 fs_release_inode(struct inode *inode)
 {
@@ -776,10 +792,40 @@ fs_close_file(struct file *file)
 ssize_t
 fs_read_file(struct file *file, void *buf, size_t count, offset_t *ofs)
 {
-    ssize_t rs = 0;
-    if (file->oflag != FS_WRONLY) {
-        rs = file->f_ops->read(file, buf, count, ofs);
+    void *bounce;
+    ssize_t rs = 0, n;
+    size_t len;
+
+    if (file->oflag == FS_WRONLY) {
+        return 0;
+    }
+    // Pipes and the console hold no file system lock while copying
+    if (file->f_inode == NULL) {
+        return file->f_ops->read(file, buf, count, ofs);
+    }
+    // File data goes through a kernel buffer: a fault on buf may need a lock
+    // the read holds, e.g. the inode lock to fill a mapped page of the file
+    if ((bounce = kmalloc(pg_size)) == NULL) {
+        return ERR_NOMEM;
+    }
+    while (rs < count) {
+        len = min(count - rs, pg_size);
+        if ((n = file->f_ops->read(file, bounce, len, ofs)) <= 0) {
+            rs = rs > 0 ? rs : n;
+            break;
+        }
+        if (copy_user((uint8_t*)buf + rs, bounce, n) != ERR_OK) {
+            // The data was not read after all
+            *ofs -= n;
+            rs = rs > 0 ? rs : ERR_FAULT;
+            break;
+        }
+        rs += n;
+        if (n < len) {
+            break;
+        }
     }
+    kfree(bounce);
     return rs;
 }
 
@@ -787,24 +833,63 @@ ssize_t
 fs_write_file(struct file *file, const void *buf, size_t count, offset_t *ofs)
 {
     struct super_block *sb;
-    ssize_t ws = 0;
+    void *bounce;
+    ssize_t ws = 0, n;
+    size_t len;
+    err_t err;
 
-    if (file->f_inode) {
-        sb = file->f_inode->sb;
-        sb->s_ops->journal_begin_txn(sb);
+    if (file->oflag == FS_RDONLY) {
+        return 0;
     }
-    if (file->oflag != FS_RDONLY) {
-        ws = file->f_ops->write(file, buf, count, ofs);
+    if (file->f_inode == NULL) {
+        return file->f_ops->write(file, buf, count, ofs);
     }
-    if (file->f_inode) {
-        sb->s_ops->journal_end_txn(sb);
+    // Like reads, copy buf before taking the journal and the inode lock, one
+    // transaction per chunk
+    if ((bounce = kmalloc(pg_size)) == NULL) {
+        return ERR_NOMEM;
     }
+    sb = file->f_inode->sb;
+    while (ws < count) {
+        len = min(count - ws, pg_size);
+        if (copy_user(bounce, (const uint8_t*)buf + ws, len) != ERR_OK) {
+            ws = ws > 0 ? ws : ERR_FAULT;
+            break;
+        }
+        // Past the dirty limit with writeback failing, dirty no more blocks
+        if ((err = sb->s_ops->journal_begin_txn(sb)) != ERR_OK) {
+            sb->s_ops->journal_end_txn(sb);
+            ws = ws > 0 ? ws : err;
+            break;
+        }
+        n = file->f_ops->write(file, bounce, len, ofs);
+        // The data is cached but may never reach the disk if the commit failed
+        if ((err = sb->s_ops->journal_end_txn(sb)) != ERR_OK && n > 0) {
+            n = err;
+        }
+        if (n <= 0) {
+            ws = ws > 0 ? ws : n;
+            break;
+        }
+        // Keep cached pages, which may be mapped, up to date
+        if (file->f_inode->store) {
+            sleeplock_acquire(&file->f_inode->store->pgcache_lock);
+            pgcache_update(file->f_inode->store, *ofs - n, bounce, n);
+            sleeplock_release(&file->f_inode->store->pgcache_lock);
+        }
+        ws += n;
+        if (n < len) {
+            break;
+        }
+    }
+    kfree(bounce);
     return ws;
 }
 
 err_t
 fs_readdir(struct file *dir, struct dirent *dirent)
 {
+    struct dirent buf;
     err_t err;
 
     // Not holding dir->f_inode->i_lock here. We don't allow modifying inode's
@@ -812,7 +897,10 @@ fs_readdir(struct file *dir, struct dirent *dirent)
     if (dir->f_inode->i_ftype != FTYPE_DIR) {
         return ERR_FTYPE;
     }
-    err = dir->f_ops->readdir(dir, dirent);
+    // dirent may be user memory, which is not touched under the inode lock
+    if ((err = dir->f_ops->readdir(dir, &buf)) == ERR_OK) {
+        err = copy_user(dirent, &buf, sizeof(struct dirent));
+    }
     return err;
 }
 
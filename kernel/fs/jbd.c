@@ -2,6 +2,7 @@
 #include <kernel/bdev.h>
 #include <kernel/fs.h>
 #include <kernel/console.h>
+#include <kernel/timer.h>
 #include <lib/errcode.h>
 #include <lib/string.h>
 
@@ -18,32 +19,42 @@ static struct kmem_cache *journal_allocator;
  *
  * Return:
  * ERR_NOMEM - Failed to allocate memory.
+ * ERR_BDEV_IO - The device failed a write.
  */
 static err_t commit_journal(struct journal *journal);
 
 /*
- * Write all journal data blocks to the block device.
+ * Write all journal data blocks to the block device. The journal keeps a
+ * reference on the journal blocks in journal->ckpt_bhs.
  *
  * Return:
- * ERR_NOMEM - Failed to allocate memory
+ * ERR_NOMEM - Failed to allocate memory. No journal block is kept.
  */
 static err_t write_journal_blks(struct journal *journal);
 
 /*
- * Write journal header to the block device.
+ * Write journal header to the block device, with n_blks committed blocks.
  *
  * Return:
  * ERR_NOMEM - Failed to allocate memory.
  */
-static err_t write_journal_header(struct journal *journal);
+static err_t write_journal_header(struct journal *journal, uint32_t n_blks);
 
 /*
- * Apply journal data blocks to the file system.
+ * Write the blocks of the last committed transaction that are still dirty back
+ * to the file system, then erase the journal.
  *
  * Return:
- * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NOMEM - Failed to allocate memory. The transaction stays in the journal.
+ * ERR_BDEV_IO - The device failed a write. The transaction stays in the
+ *               journal.
+ */
+static err_t checkpoint_journal(struct journal *journal);
+
+/*
+ * Drop the references on the first n kept journal blocks.
  */
-static err_t apply_journal(struct journal *journal);
+static void release_journal_blks(struct journal *journal, int n);
 
 /*
  * Erase the journal.
@@ -53,91 +64,128 @@ static err_t apply_journal(struct journal *journal);
  */
 static err_t erase_journal(struct journal *journal);
 
+/*
+ * Wait until no transaction is running and take the journal.
+ */
+static void acquire_journal(struct journal *journal);
+
+/*
+ * Give the journal back, and wake up waiters.
+ */
+static void release_journal(struct journal *journal);
+
 static err_t
 commit_journal(struct journal *journal)
 {
     // Commit the journal in the following steps:
-    // 1. Write all journal data blocks to bdev
-    // 2. Write header to bdev (journal is now committed)
-    // 3. Apply journal data blocks to the file system
-    // 4. Erase the journal
-    // 5. Change journal to ACTIVE state, and wake up waiters
+    // 1. Checkpoint the previous transaction, its journal blocks are reused
+    // 2. Write all journal data blocks to bdev
+    // 3. Write header to bdev (journal is now committed)
+    // 4. Keep the journal blocks for the next checkpoint, and leave the data
+    //    blocks dirty for the writeback thread
     err_t err;
+    int i;
 
-    if ((err = write_journal_blks(journal)) != ERR_OK) {
+    if ((err = checkpoint_journal(journal)) != ERR_OK) {
         return err;
     }
-    if ((err = write_journal_header(journal)) != ERR_OK) {
+    if ((err = write_journal_blks(journal)) != ERR_OK) {
         return err;
     }
-    if ((err = apply_journal(journal)) != ERR_OK) {
+    if ((err = write_journal_header(journal, journal->next_index)) != ERR_OK) {
+        release_journal_blks(journal, journal->next_index);
         return err;
     }
-    if ((err = erase_journal(journal)) != ERR_OK) {
-        return err;
+    for (i = 0; i < journal->next_index; i++) {
+        journal->ckpt_blks[i] = journal->datablks[i]->blk;
+        bdev_release_blk_unlocked(journal->datablks[i]);
     }
-
+    journal->n_ckpt = journal->next_index;
+    journal->commit_time = timer_get_ticks();
+    journal->next_index = 0;
     return ERR_OK;
 }
 
 static err_t
 write_journal_blks(struct journal *journal)
 {
-    int i, bi;
+    int i, bi, njbhs = 0, nbmap = 0;
     size_t n;
     blk_t pb, bmap[JOURNAL_SIZE];
-    struct blk_header *jbh;
-    err_t err;
+    struct blk_header *jbh, *bmap_bhs[BMAP_BLKS];
+    struct bdev *bdev = journal->sb->bdev;
+    struct bio *parent;
+    err_t err = ERR_OK;
 
     kassert(journal->next_index < JOURNAL_SIZE);
+    kassert(journal->n_ckpt == 0);
+    if ((parent = bio_alloc()) == NULL) {
+        return ERR_NOMEM;
+    }
+    // Submit all writes before waiting for them: journal blocks are adjacent,
+    // and the I/O scheduler merges them into large requests
     for (i = 0; i < journal->next_index; i++) {
         // Write journal data block to the mapped physical block (using jbd_bmap
         // to get the block number) on bdev. Log the data block number in the
         // bmap block.
         pb = journal->sb->s_ops->journal_bmap(journal->sb, JDATA_START_BLK + i);
         bmap[i] = journal->datablks[i]->blk;
-        if ((jbh = bdev_get_blk(journal->sb->bdev, pb)) == NULL) {
-            return ERR_NOMEM;
+        if ((jbh = bdev_get_blk(bdev, pb)) == NULL) {
+            err = ERR_NOMEM;
+            break;
         }
         sleeplock_acquire(&journal->datablks[i]->lock);
         memmove(jbh->data, journal->datablks[i]->data, BDEV_BLK_SIZE);
         sleeplock_release(&journal->datablks[i]->lock);
-        if ((err = bdev_write_blk(jbh)) != ERR_OK) {
-            return err;
+        sleeplock_release(&jbh->lock);
+        journal->ckpt_bhs[njbhs++] = jbh;
+        if ((err = bdev_submit_child(parent, bdev, BIO_WRITE, pb, 1, jbh->data)) != ERR_OK) {
+            break;
         }
-        bdev_release_blk(jbh);
     }
     // Write bmap blocks
-    for (i = 0, bi = 0; i < journal->next_index && bi < BMAP_BLKS; bi++, i += n) {
+    for (i = 0, bi = 0; err == ERR_OK && i < journal->next_index && bi < BMAP_BLKS; bi++, i += n) {
         pb = journal->sb->s_ops->journal_bmap(journal->sb, BMAP_START_BLK + bi);
-        if ((jbh = bdev_get_blk(journal->sb->bdev, pb)) == NULL) {
-            return ERR_NOMEM;
+        if ((jbh = bdev_get_blk(bdev, pb)) == NULL) {
+            err = ERR_NOMEM;
+            break;
         }
         n = min(BDEV_BLK_SIZE / sizeof(blk_t) , journal->next_index - i);
         memmove(jbh->data, &bmap[i], n * sizeof(blk_t));
-        if ((err = bdev_write_blk(jbh)) != ERR_OK) {
-            return err;
-        }
-        bdev_release_blk(jbh);
+        sleeplock_release(&jbh->lock);
+        bmap_bhs[nbmap++] = jbh;
+        err = bdev_submit_child(parent, bdev, BIO_WRITE, pb, 1, jbh->data);
     }
-    return ERR_OK;
+    bdev_submit_bio(parent);
+    if (bio_wait(parent) != ERR_OK && err == ERR_OK) {
+        err = ERR_BDEV_IO;
+    }
+    bio_free(parent);
+    for (bi = 0; bi < nbmap; bi++) {
+        bdev_release_blk_unlocked(bmap_bhs[bi]);
+    }
+    if (err != ERR_OK) {
+        release_journal_blks(journal, njbhs);
+    }
+    return err;
 }
 
 static err_t
-write_journal_header(struct journal *journal)
+write_journal_header(struct journal *journal, uint32_t n_blks)
 {
     struct journal_header header;
     struct blk_header *bh;
     blk_t pb;
     err_t err;
 
-    header.n_blks = journal->next_index;
+    header.n_blks = n_blks;
     pb = journal->sb->s_ops->journal_bmap(journal->sb, HEADER_BLK);
     if ((bh = bdev_get_blk(journal->sb->bdev, pb)) == NULL) {
         return ERR_NOMEM;
     }
     memmove(bh->data, &header, sizeof(header));
     if ((err = bdev_write_blk(bh)) != ERR_OK) {
+        bdev_release_blk(bh);
         return err;
     }
     bdev_release_blk(bh);
@@ -145,30 +193,98 @@ write_journal_header(struct journal *journal)
 }
 
 static err_t
-apply_journal(struct journal *journal)
+checkpoint_journal(struct journal *journal)
 {
+    struct bdev *bdev = journal->sb->bdev;
+    struct blk_header *bh;
+    struct bio *parent;
     int i;
-    err_t err;
+    err_t err = ERR_OK;
 
-    for (i = 0; i < journal->next_index; i++) {
-        // Write journal data block to file system block
-        sleeplock_acquire(&journal->datablks[i]->lock);
-        if ((err = bdev_write_blk(journal->datablks[i])) != ERR_OK) {
-            return err;
+    if (journal->n_ckpt == 0) {
+        return ERR_OK;
+    }
+    if ((parent = bio_alloc()) == NULL) {
+        return ERR_NOMEM;
+    }
+    // Write back the blocks that are still dirty from the journal blocks: the
+    // cached blocks may already hold changes of the running transaction
+    for (i = 0; i < journal->n_ckpt; i++) {
+        if ((bh = bdev_get_blk(bdev, journal->ckpt_blks[i])) == NULL) {
+            err = ERR_NOMEM;
+            break;
         }
-        // Block is now clean
-        bdev_set_blk_dirty(journal->datablks[i], False);
-        // Now we can release the block
-        bdev_release_blk(journal->datablks[i]);
+        if (bdev_is_blk_dirty(bh)) {
+            err = bdev_submit_child(parent, bdev, BIO_WRITE, journal->ckpt_blks[i], 1,
+                                    journal->ckpt_bhs[i]->data);
+        }
+        bdev_release_blk(bh);
+        if (err != ERR_OK) {
+            break;
+        }
+    }
+    bdev_submit_bio(parent);
+    if (bio_wait(parent) != ERR_OK && err == ERR_OK) {
+        err = ERR_BDEV_IO;
     }
+    bio_free(parent);
+    if (err != ERR_OK) {
+        return err;
+    }
+    // Blocks not changed since the commit are now clean
+    for (i = 0; i < journal->n_ckpt; i++) {
+        if ((bh = bdev_get_blk(bdev, journal->ckpt_blks[i])) == NULL) {
+            return ERR_NOMEM;
+        }
+        if (bdev_is_blk_dirty(bh) && memcmp(bh->data, journal->ckpt_bhs[i]->data, BDEV_BLK_SIZE) == 0) {
+            bdev_set_blk_dirty(bh, False);
+        }
+        bdev_release_blk(bh);
+    }
+    // Journal blocks can be reused once the header no longer refers to them
+    if ((err = erase_journal(journal)) != ERR_OK) {
+        return err;
+    }
+    release_journal_blks(journal, journal->n_ckpt);
+    journal->n_ckpt = 0;
     return ERR_OK;
 }
 
+static void
+release_journal_blks(struct journal *journal, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        bdev_release_blk_unlocked(journal->ckpt_bhs[i]);
+    }
+}
+
 static err_t
 erase_journal(struct journal *journal)
 {
-    journal->next_index = 0;
-    return write_journal_header(journal);
+    return write_journal_header(journal, 0);
+}
+
+static void
+acquire_journal(struct journal *journal)
+{
+    spinlock_acquire(&journal->lock);
+    // Wait if there is an ongoing transaction.
+    while (journal->state != IDLE) {
+        condvar_wait(&journal->cv, &journal->lock);
+    }
+    journal->state = BUSY;
+    spinlock_release(&journal->lock);
+}
+
+static void
+release_journal(struct journal *journal)
+{
+    spinlock_acquire(&journal->lock);
+    journal->state = IDLE;
+    condvar_broadcast(&journal->cv);
+    spinlock_release(&journal->lock);
 }
 
 void
@@ -192,6 +308,7 @@ jbd_alloc_journal(struct super_block *sb)
         journal->enabled = True;
         journal->state = IDLE;
         journal->next_index = 0;
+        journal->n_ckpt = 0;
     }
     return journal;
 }
@@ -202,39 +319,66 @@ jbd_free_journal(struct journal *journal)
     kmem_cache_free(journal_allocator, journal);
 }
 
-void
+err_t
 jbd_begin_txn(struct journal *journal)
 {
-    if (!journal->enabled) {
-        return;
+    err_t err = ERR_OK;
+
+    // Too much dirty data: write it back before dirtying more
+    if (bdev_dirty_exceeded()) {
+        err = jbd_writeback(journal, 0);
     }
-    spinlock_acquire(&journal->lock);
-    // Wait if there is an ongoing transaction.
-    while (journal->state != IDLE) {
-        condvar_wait(&journal->cv, &journal->lock);
+    if (journal->enabled) {
+        acquire_journal(journal);
     }
-    journal->state = BUSY;
-    spinlock_release(&journal->lock);
+    return err;
 }
 
-void
+err_t
 jbd_end_txn(struct journal *journal)
 {
+    err_t err = ERR_OK;
+    int i, tries;
+
     if (!journal->enabled) {
-        return;
+        return ERR_OK;
     }
     kassert(journal->state == BUSY);
     if (journal->next_index > 0) {
         // jbd uses a synchronous interface -- only return when commit is
-        // successful.
-        while (commit_journal(journal) != ERR_OK) {
-            ;
+        // done. A failing disk fails every try, give up on it after a few.
+        for (tries = 0; tries < JOURNAL_COMMIT_RETRIES; tries++) {
+            if ((err = commit_journal(journal)) == ERR_OK) {
+                break;
+            }
+        }
+        if (err != ERR_OK) {
+            for (i = 0; i < journal->next_index; i++) {
+                bdev_release_blk_unlocked(journal->datablks[i]);
+            }
+            journal->next_index = 0;
         }
     }
-    spinlock_acquire(&journal->lock);
-    journal->state = IDLE;
-    condvar_broadcast(&journal->cv);
-    spinlock_release(&journal->lock);
+    release_journal(journal);
+    return err;
+}
+
+err_t
+jbd_writeback(struct journal *journal, uint32_t age)
+{
+    err_t err;
+
+    if (!journal->enabled) {
+        return bdev_writeback(journal->sb->bdev, age);
+    }
+    // With no transaction running, dirty blocks only hold committed changes
+    acquire_journal(journal);
+    err = bdev_writeback(journal->sb->bdev, age);
+    if (err == ERR_OK && journal->n_ckpt > 0 && timer_get_ticks() - journal->commit_time >= age) {
+        err = checkpoint_journal(journal);
+    }
+    release_journal(journal);
+    return err;
 }
 
 void
@@ -257,9 +401,7 @@ jbd_write_blk(struct journal *journal, struct blk_header *bh)
         panic("JBD: journal is filled up");
     }
     // The journal now holds a reference to the block (and the page).
-    sleeplock_acquire(&bh->page->lock);
-    bh->ref++;
-    sleeplock_release(&bh->page->lock);
+    bdev_hold_blk(bh);
     journal->datablks[journal->next_index++] = bh;
 }
 
@@ -5,6 +5,8 @@
 #include <kernel/kmalloc.h>
 #include <kernel/vpmap.h>
 #include <kernel/jbd.h>
+#include <kernel/memstore.h>
+#include <kernel/pgcache.h>
 #include <lib/string.h>
 
 /*
@@ -51,8 +53,9 @@ static struct fs_type sfs_fs_type = {
 
 // Superblock operations
 static blk_t sfs_journal_bmap(struct super_block *sb, blk_t lb);
-static void sfs_journal_begin_txn(struct super_block *sb);
-static void sfs_journal_end_txn(struct super_block *sb);
+static err_t sfs_journal_begin_txn(struct super_block *sb);
+static err_t sfs_journal_end_txn(struct super_block *sb);
+static err_t sfs_writeback(struct super_block *sb, uint32_t age);
 static struct inode *sfs_alloc_inode(struct super_block *sb);
 static void sfs_free_inode(struct inode *inode);
 static err_t sfs_read_inode(struct inode *inode);
@@ -62,6 +65,7 @@ static struct super_operations sfs_super_operations = {
     .journal_bmap = sfs_journal_bmap,
     .journal_begin_txn = sfs_journal_begin_txn,
     .journal_end_txn = sfs_journal_end_txn,
+    .writeback = sfs_writeback,
     .alloc_inode = sfs_alloc_inode,
     .free_inode = sfs_free_inode,
     .read_inode = sfs_read_inode,
@@ -74,6 +78,7 @@ static err_t sfs_mkdir(struct inode *dir, const char *name, fmode_t mode);
 static err_t sfs_rmdir(struct inode *dir, const char *name);
 static err_t sfs_lookup(struct inode *dir, const char *name, struct inode **inode);
 static err_t sfs_fillpage(struct inode *inode, offset_t ofs, struct page *page);
+static err_t sfs_writepage(struct inode *inode, offset_t ofs, struct page *page);
 static err_t sfs_link(struct inode *dir, struct inode *src, const char *name);
 static err_t sfs_unlink(struct inode *dir, const char *name);
 static struct inode_operations sfs_inode_operations = {
@@ -82,6 +87,7 @@ static struct inode_operations sfs_inode_operations = {
     .rmdir = sfs_rmdir,
     .lookup = sfs_lookup,
     .fillpage = sfs_fillpage,
+    .writepage = sfs_writepage,
     .link = sfs_link,
     .unlink = sfs_unlink
 };
@@ -104,6 +110,11 @@ static struct kmem_cache *sfs_inode_allocator = NULL;
 // Return the minimum of the two numbers
 #define min(a, b) ((a < b) ? a : b)
 
+// Readahead window of sequential reads: starts small, doubles with each
+// sequential read up to the maximum
+#define SFS_RA_MIN_WINDOW (4 * pg_size)
+#define SFS_RA_MAX_WINDOW (32 * pg_size)
+
 // Convert inode number to block number
 static inline blk_t inum_to_blk(const struct super_block *sb, inum_t inum);
 
@@ -263,6 +274,29 @@ static inum_t search_dir(struct inode *dir, const char *name);
  */
 static err_t get_data_block(struct inode *inode, offset_t ofs, struct blk_header **bh, int alloc);
 
+/*
+ * Look up the data block of an inode that contains inode offset ofs, without
+ * reading or allocating it. Write the block number into *blk, or 0 if the block
+ * has not been allocated yet.
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static err_t lookup_data_block(struct inode *inode, offset_t ofs, blk_t *blk);
+
+/*
+ * Update the readahead state of file for a read of count bytes at offset ofs.
+ * For a sequential read, start reading the blocks of the file up to the end of
+ * the readahead window into the page cache, without waiting for them.
+ *
+ * Precondition:
+ * Caller must hold file->f_inode->i_lock.
+ */
+static void readahead(struct file *file, offset_t ofs, size_t count);
+
 /*
  * Read count number of bytes at inode offset ofs into buffer buf.
  *
@@ -810,6 +844,80 @@ fail:
     return err;
 }
 
+static err_t
+lookup_data_block(struct inode *inode, offset_t ofs, blk_t *blk)
+{
+    int blk_index, indir_blk_index;
+    blk_t indir_blk;
+    struct blk_header *indir_bh;
+
+    kassert(ofs < SFS_MAX_FILE_SIZE);
+    blk_index = ofs / BDEV_BLK_SIZE;
+    if (blk_index < SFS_NDIRECT) {
+        *blk = INODE_INFO(inode)->i_addrs[blk_index];
+        return ERR_OK;
+    }
+    indir_blk_index = SFS_NDIRECT + (blk_index - SFS_NDIRECT) / (BDEV_BLK_SIZE / sizeof(uint32_t));
+    kassert(indir_blk_index < SFS_NDIRECT + SFS_NINDIRECT);
+    if ((indir_blk = INODE_INFO(inode)->i_addrs[indir_blk_index]) == 0) {
+        *blk = 0;
+        return ERR_OK;
+    }
+    if ((indir_bh = bdev_get_blk(inode->sb->bdev, indir_blk)) == NULL) {
+        return ERR_NOMEM;
+    }
+    *blk = ((blk_t*)indir_bh->data)[(blk_index - SFS_NDIRECT) % (BDEV_BLK_SIZE / sizeof(uint32_t))];
+    bdev_release_blk(indir_bh);
+    return ERR_OK;
+}
+
+static void
+readahead(struct file *file, offset_t ofs, size_t count)
+{
+    struct inode *inode = file->f_inode;
+    struct file_ra *ra = &file->f_ra;
+    struct memstore *store = inode->sb->bdev->store;
+    offset_t start, end, a, page_ofs, last_page_ofs;
+    blk_t blk;
+
+    if (ofs == ra->prev_end) {
+        ra->window = ra->window == 0 ? SFS_RA_MIN_WINDOW : min(2 * ra->window, SFS_RA_MAX_WINDOW);
+    } else {
+        ra->window = 0;
+        ra->ra_end = 0;
+    }
+    ra->prev_end = ofs + count;
+    if (ra->window == 0) {
+        return;
+    }
+    // Top the window up once half of it is consumed, so that the blocks go out
+    // in large batches the I/O scheduler can merge
+    start = ra->ra_end > ofs ? ra->ra_end : ofs;
+    end = min(ofs + count + ra->window, inode->i_size);
+    if (start >= end || start > ofs + count + ra->window / 2) {
+        return;
+    }
+    last_page_ofs = (offset_t)-1;
+    for (a = start - start % BDEV_BLK_SIZE; a < end; a += BDEV_BLK_SIZE) {
+        if (lookup_data_block(inode, a, &blk) != ERR_OK) {
+            break;
+        }
+        // Holes read as zeros, and blocks of a page are read together
+        page_ofs = pg_round_down(blk * BDEV_BLK_SIZE);
+        if (blk == 0 || page_ofs == last_page_ofs) {
+            continue;
+        }
+        last_page_ofs = page_ofs;
+        sleeplock_acquire(&store->pgcache_lock);
+        if (pgcache_readahead(store, page_ofs) != ERR_OK) {
+            sleeplock_release(&store->pgcache_lock);
+            break;
+        }
+        sleeplock_release(&store->pgcache_lock);
+    }
+    ra->ra_end = a;
+}
+
 static ssize_t
 read_data(struct inode *inode, void *buf, size_t count, offset_t ofs)
 {
@@ -947,16 +1055,22 @@ sfs_journal_bmap(struct super_block *sb, blk_t lb)
     return SB_INFO(sb)->s_journal_start + lb;
 }
 
-static void
+static err_t
 sfs_journal_begin_txn(struct super_block *sb)
 {
-    jbd_begin_txn(SB_INFO(sb)->journal);
+    return jbd_begin_txn(SB_INFO(sb)->journal);
 }
 
-static void
+static err_t
 sfs_journal_end_txn(struct super_block *sb)
 {
-    jbd_end_txn(SB_INFO(sb)->journal);
+    return jbd_end_txn(SB_INFO(sb)->journal);
+}
+
+static err_t
+sfs_writeback(struct super_block *sb, uint32_t age)
+{
+    return jbd_writeback(SB_INFO(sb)->journal, age);
 }
 
 static struct inode*
@@ -1142,10 +1256,31 @@ static err_t
 sfs_fillpage(struct inode *inode, offset_t ofs, struct page *page)
 {
     void *buf;
+    ssize_t n;
 
     kassert(inode);
     buf = (void*)kmap_p2v(page_to_paddr(page));
-    if (read_data(inode, buf, pg_size, ofs) < pg_size) {
+    n = read_data(inode, buf, pg_size, ofs);
+    // Only a page that extends past the end of file may be short, and the
+    // rest of it reads as zeros
+    if (n < pg_size && ofs + n < inode->i_size) {
+        return ERR_INCOMP;
+    }
+    memset((uint8_t*)buf + n, 0, pg_size - n);
+    return ERR_OK;
+}
+
+static err_t
+sfs_writepage(struct inode *inode, offset_t ofs, struct page *page)
+{
+    size_t n;
+
+    kassert(inode);
+    if (ofs >= inode->i_size) {
+        return ERR_OK;
+    }
+    n = min(pg_size, inode->i_size - ofs);
+    if (write_data(inode, (void*)kmap_p2v(page_to_paddr(page)), n, ofs) != (ssize_t)n) {
         return ERR_INCOMP;
     }
     return ERR_OK;
@@ -1193,6 +1328,7 @@ sfs_read(struct file *file, void *buf, size_t count, offset_t *ofs)
     ssize_t rs;
 
     sleeplock_acquire(&file->f_inode->i_lock);
+    readahead(file, *ofs, count);
     if ((rs = read_data(file->f_inode, buf, count, *ofs)) > 0) {
         *ofs += rs;
     }
@@ -4,10 +4,19 @@
 #include <kernel/shmms.h>
 #include <kernel/pgcache.h>
 #include <kernel/console.h>
+#include <kernel/kmalloc.h>
+#include <kernel/fs.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 #include <lib/string.h>
 
+static struct kmem_cache *shmms_allocator = NULL;
+
+// Named shared memory segments, and lock protecting the list and the
+// reference count of every segment
+static List shmms_list;
+static struct sleeplock shmms_lock;
+
 /*
  * shared memory memstore fillpage function.
  */
@@ -18,6 +27,34 @@ static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
  */
 static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
 
+/*
+ * Take and drop a reference on the segment. The segment is freed when the
+ * last reference of an unlinked segment is dropped.
+ */
+static void get(struct memstore *store);
+static void put(struct memstore *store);
+
+/*
+ * Find a named segment. Return NULL if not found.
+ *
+ * Precondition:
+ * Caller must hold shmms_lock.
+ */
+static struct memstore *shmms_find(const char *name);
+
+/*
+ * File operations of an open segment. Segments can only be mapped, reads and
+ * writes fail with ERR_FTYPE.
+ */
+static ssize_t shmms_file_read(struct file *file, void *buf, size_t count, offset_t *ofs);
+static ssize_t shmms_file_write(struct file *file, const void *buf, size_t count, offset_t *ofs);
+static void shmms_file_close(struct file *file);
+
+static struct file_operations shmms_file_ops = {
+    .read = shmms_file_read,
+    .write = shmms_file_write,
+    .close = shmms_file_close,
+};
 
 static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
@@ -33,19 +70,99 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
+    // Nothing backs shared memory, the page cache holds the only copy
     return ERR_OK;
 }
 
+static void
+get(struct memstore *store)
+{
+    kassert(store && store->info);
+    sleeplock_acquire(&shmms_lock);
+    ((struct shmms_info*)store->info)->ref++;
+    sleeplock_release(&shmms_lock);
+}
+
+static void
+put(struct memstore *store)
+{
+    struct shmms_info *info;
+    int free;
+
+    kassert(store && store->info);
+    info = (struct shmms_info*)store->info;
+    sleeplock_acquire(&shmms_lock);
+    kassert(info->ref > 0);
+    free = --info->ref == 0 && !info->linked;
+    sleeplock_release(&shmms_lock);
+    if (free) {
+        shmms_free(store);
+    }
+}
+
+static struct memstore*
+shmms_find(const char *name)
+{
+    struct shmms_info *info;
+
+    for (Node *n = list_begin(&shmms_list); n != list_end(&shmms_list); n = list_next(n)) {
+        info = list_entry(n, struct shmms_info, node);
+        if (strcmp(info->name, name) == 0) {
+            return info->store;
+        }
+    }
+    return NULL;
+}
+
+static ssize_t
+shmms_file_read(struct file *file, void *buf, size_t count, offset_t *ofs)
+{
+    return ERR_FTYPE;
+}
+
+static ssize_t
+shmms_file_write(struct file *file, const void *buf, size_t count, offset_t *ofs)
+{
+    return ERR_FTYPE;
+}
+
+static void
+shmms_file_close(struct file *file)
+{
+    kassert(file->shm);
+    put(file->shm);
+}
+
+void
+shmms_init(void)
+{
+    list_init(&shmms_list);
+    sleeplock_init(&shmms_lock);
+    if ((shmms_allocator = kmem_cache_create(sizeof(struct shmms_info))) == NULL) {
+        panic("Failed to create shmms_allocator");
+    }
+}
+
 struct memstore*
-shmms_alloc(void)
+shmms_alloc(size_t size)
 {
     struct memstore *store;
+    struct shmms_info *info;
 
     if ((store = memstore_alloc()) != NULL) {
-        // TODO: initialize shared memory specific metadata
-        store->fillpage = fillpage;
-        store->write = write;
+        if ((store->info = kmem_cache_alloc(shmms_allocator)) != NULL) {
+            info = (struct shmms_info*)store->info;
+            memset(info, 0, sizeof(struct shmms_info));
+            info->size = pg_round_up(size);
+            info->store = store;
+            store->fillpage = fillpage;
+            store->write = write;
+            store->get = get;
+            store->put = put;
+        } else {
+            memstore_free(store);
+            store = NULL;
+        }
     }
     return store;
 }
@@ -54,5 +171,77 @@ void
 shmms_free(struct memstore *store)
 {
     kassert(store);
+    kassert(store->info);
+    pgcache_release(store);
+    kmem_cache_free(shmms_allocator, store->info);
     memstore_free(store);
 }
+
+err_t
+shmms_open(const char *name, size_t size, int create, struct file **file)
+{
+    struct memstore *store;
+    struct shmms_info *info;
+
+    kassert(name && file);
+    if ((*file = fs_alloc_file()) == NULL) {
+        return ERR_NOMEM;
+    }
+
+    sleeplock_acquire(&shmms_lock);
+    if ((store = shmms_find(name)) == NULL) {
+        if (!create || size == 0) {
+            sleeplock_release(&shmms_lock);
+            fs_free_file(*file);
+            return create ? ERR_INVAL : ERR_NOTEXIST;
+        }
+        if ((store = shmms_alloc(size)) == NULL) {
+            sleeplock_release(&shmms_lock);
+            fs_free_file(*file);
+            return ERR_NOMEM;
+        }
+        info = (struct shmms_info*)store->info;
+        strncpy(info->name, name, SHM_NAME_LEN - 1);
+        info->linked = 1;
+        list_append(&shmms_list, &info->node);
+    }
+    // The open file holds a reference until closed
+    ((struct shmms_info*)store->info)->ref++;
+    sleeplock_release(&shmms_lock);
+
+    (*file)->f_ops = &shmms_file_ops;
+    (*file)->oflag = FS_RDWR;
+    (*file)->shm = store;
+    return ERR_OK;
+}
+
+err_t
+shmms_unlink(const char *name)
+{
+    struct memstore *store;
+    struct shmms_info *info;
+    int free;
+
+    kassert(name);
+    sleeplock_acquire(&shmms_lock);
+    if ((store = shmms_find(name)) == NULL) {
+        sleeplock_release(&shmms_lock);
+        return ERR_NOTEXIST;
+    }
+    info = (struct shmms_info*)store->info;
+    list_remove(&info->node);
+    info->linked = 0;
+    free = info->ref == 0;
+    sleeplock_release(&shmms_lock);
+    if (free) {
+        shmms_free(store);
+    }
+    return ERR_OK;
+}
+
+size_t
+shmms_size(struct memstore *store)
+{
+    kassert(store && store->info);
+    return ((struct shmms_info*)store->info)->size;
+}
@@ -0,0 +1,156 @@
+#include <kernel/iosched.h>
+#include <kernel/bdev.h>
+#include <kernel/console.h>
+#include <lib/stddef.h>
+
+/*
+ * Initialize request to hold bio alone.
+ */
+static void init_request(struct bdev_request *request, struct bio *bio);
+
+/*
+ * Merge bio into request if bio directly follows or precedes the request's
+ * blocks and the merged request is not too large for the device. Return True
+ * if merged.
+ */
+static bool try_merge(struct bdev *bdev, struct bdev_request *request, struct bio *bio);
+
+/*
+ * Order requests by starting block.
+ */
+static int request_cmp(const Node *a, const Node *b, void *aux);
+
+static bool fifo_add_bio(struct bdev *bdev, struct bio *bio, struct bdev_request *request);
+static struct bdev_request *fifo_next_request(struct bdev *bdev);
+static bool elevator_add_bio(struct bdev *bdev, struct bio *bio, struct bdev_request *request);
+static struct bdev_request *elevator_next_request(struct bdev *bdev);
+
+const struct iosched iosched_fifo = {
+    .name = "fifo",
+    .add_bio = fifo_add_bio,
+    .next_request = fifo_next_request,
+};
+
+const struct iosched iosched_elevator = {
+    .name = "elevator",
+    .add_bio = elevator_add_bio,
+    .next_request = elevator_next_request,
+};
+
+static void
+init_request(struct bdev_request *request, struct bio *bio)
+{
+    list_init(&request->bios);
+    list_append(&request->bios, &bio->req_node);
+    request->blk = bio->blk;
+    request->size = bio->size;
+    request->op = bio->op;
+}
+
+static bool
+try_merge(struct bdev *bdev, struct bdev_request *request, struct bio *bio)
+{
+    if (request->op != bio->op || request->size + bio->size > bdev->max_blks) {
+        return False;
+    }
+    if (request->blk + request->size == bio->blk) {
+        list_append(&request->bios, &bio->req_node);
+    } else if (bio->blk + bio->size == request->blk) {
+        list_insert_after(&request->bios.header, &bio->req_node);
+        request->blk = bio->blk;
+    } else {
+        return False;
+    }
+    request->size += bio->size;
+    return True;
+}
+
+static int
+request_cmp(const Node *a, const Node *b, void *aux)
+{
+    struct bdev_request *ra = list_entry(a, struct bdev_request, node);
+    struct bdev_request *rb = list_entry(b, struct bdev_request, node);
+
+    if (ra->blk == rb->blk) {
+        return 0;
+    }
+    return ra->blk > rb->blk ? 1 : -1;
+}
+
+static bool
+fifo_add_bio(struct bdev *bdev, struct bio *bio, struct bdev_request *request)
+{
+    Node *last;
+
+    if (!list_empty(&bdev->request_queue)) {
+        last = list_prev(list_end(&bdev->request_queue));
+        if (try_merge(bdev, list_entry(last, struct bdev_request, node), bio)) {
+            return False;
+        }
+    }
+    init_request(request, bio);
+    list_append(&bdev->request_queue, &request->node);
+    return True;
+}
+
+static struct bdev_request*
+fifo_next_request(struct bdev *bdev)
+{
+    Node *n;
+
+    if (list_empty(&bdev->request_queue)) {
+        return NULL;
+    }
+    n = list_begin(&bdev->request_queue);
+    list_remove(n);
+    return list_entry(n, struct bdev_request, node);
+}
+
+static bool
+elevator_add_bio(struct bdev *bdev, struct bio *bio, struct bdev_request *request)
+{
+    Node *n;
+    struct bdev_request *r;
+
+    for (n = list_begin(&bdev->request_queue);
+         n != list_end(&bdev->request_queue);
+         n = list_next(n)) {
+        r = list_entry(n, struct bdev_request, node);
+        if (try_merge(bdev, r, bio)) {
+            // A front merge moves the request's start, keep the queue sorted
+            list_remove(n);
+            list_append_ordered(&bdev->request_queue, n, request_cmp, NULL);
+            return False;
+        }
+    }
+    init_request(request, bio);
+    list_append_ordered(&bdev->request_queue, &request->node, request_cmp, NULL);
+    return True;
+}
+
+static struct bdev_request*
+elevator_next_request(struct bdev *bdev)
+{
+    Node *n;
+    struct bdev_request *r;
+
+    if (list_empty(&bdev->request_queue)) {
+        return NULL;
+    }
+    // Continue the sweep from where the last request ended, and start over
+    // from the lowest block once no request is left ahead of it
+    for (n = list_begin(&bdev->request_queue);
+         n != list_end(&bdev->request_queue);
+         n = list_next(n)) {
+        if (list_entry(n, struct bdev_request, node)->blk >= bdev->iosched_pos) {
+            break;
+        }
+    }
+    if (n == list_end(&bdev->request_queue)) {
+        n = list_begin(&bdev->request_queue);
+    }
+    list_remove(n);
+    r = list_entry(n, struct bdev_request, node);
+    bdev->iosched_pos = r->blk + r->size;
+    return r;
+}
@@ -52,6 +52,16 @@ list_append_ordered(List *list, Node *node, comparator *compare, void *aux)
     list_append(list, node);
 }
 
+void
+list_insert_after(Node *prev, Node *node)
+{
+    kassert(prev && node);
+    node->prev = prev;
+    node->next = prev->next;
+    prev->next->prev = node;
+    prev->next = node;
+}
+
 Node*
 list_remove(Node* node)
 {   
@@ -74,7 +74,7 @@ slab_create(struct kmem_cache *kmem_cache)
     // We store at least MIN_OBJS_PER_SLAB objects, the slab structure, and the
     // free list (MIN_OBJS_PER_SLAB indices) in the slab
     n_pages = pg_round_up(sizeof(struct slab) + (kmem_cache->obj_size + sizeof(int)) * MIN_OBJS_PER_SLAB) / pg_size;
-    if (pmem_nalloc(&paddr, n_pages) != ERR_OK) {
+    if (pmem_nalloc_class(&paddr, n_pages, PMEM_CLASS_SLAB) != ERR_OK) {
         return NULL;
     }
 
@@ -20,6 +20,11 @@ memstore_alloc(void)
         rmap_construct(&store->rmap);
         sleeplock_init(&store->pgcache_lock);
         radix_tree_construct(&store->cached_pages);
+        list_init(&store->pages);
+        store->evictable = False;
+        store->fillpage_async = NULL;
+        store->get = NULL;
+        store->put = NULL;
     }
     return store;
 }
@@ -5,43 +5,414 @@
 #include <kernel/radix_tree.h>
 #include <kernel/memstore.h>
 #include <kernel/pmem.h>
+#include <kernel/vpmap.h>
 #include <lib/errcode.h>
+#include <lib/string.h>
+#include <lib/stddef.h>
+
+// Threads waiting for a page being filled sleep on the wait queue its
+// address hashes to, and recheck their page whenever a fill of that queue
+// completes. io_lock protects all queues.
+#define PAGE_WAIT_QUEUES 64
+static struct spinlock io_lock;
+static struct condvar page_wait_queues[PAGE_WAIT_QUEUES];
+
+// Percentage of physical pages the page cache may hold
+#define PGCACHE_MAX_RATIO 50
+// Reclaim starts when free pages fall below the low percentage of physical
+// pages, and goes on until they are back above the high one
+#define PGCACHE_FREE_LOW_RATIO 5
+#define PGCACHE_FREE_HIGH_RATIO 10
+
+// Pages cached by all memstores, in clock order: the head of the list is the
+// page under the clock hand. lru_lock also protects n_cached_pages.
+static List lru;
+static struct sleeplock lru_lock;
+static size_t n_cached_pages;
+// Budget and watermarks above, in pages
+static size_t max_cached_pages;
+static size_t free_low_pages;
+static size_t free_high_pages;
+
+/*
+ * Return the wait queue of a page.
+ */
+static struct condvar *page_wait_queue(struct page *page);
+
+/*
+ * Wait until page is no longer being filled.
+ */
+static void wait_page(struct page *page);
+
+/*
+ * Wait until a page of store is no longer being filled, with
+ * store->pgcache_lock dropped meanwhile. The page may have left the cache when
+ * this returns.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+static void wait_page_unlocked(struct memstore *store, struct page *page);
+
+/*
+ * Insert a page into the cache at offset ofs.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate radix tree nodes.
+ */
+static err_t insert_page(struct memstore *store, offset_t ofs, struct page *page);
+
+/*
+ * Remove a page from the cache.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock and lru_lock.
+ */
+static void remove_page(struct memstore *store, struct page *page);
+
+/*
+ * Allocate a page for the cache, evicting cached pages first if memory is
+ * short. locked is the store whose pgcache_lock the caller holds.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate a page.
+ */
+static err_t alloc_page(struct memstore *locked, paddr_t *paddr);
+
+/*
+ * Return True if the cache is over its budget, or if free pages are below
+ * free_pages.
+ */
+static bool over_budget(size_t free_pages);
+
+/*
+ * Run the clock over cached pages, and evict the unused ones until the cache
+ * is within its budget and free memory is above the high watermark. locked is
+ * the store whose pgcache_lock the caller holds, or NULL; pages of other
+ * stores whose lock is busy are skipped.
+ */
+static void reclaim(struct memstore *locked);
+
+/*
+ * Check if a cached page can be evicted: only the cache uses it, and it holds
+ * no data that is not in the store.
+ *
+ * Precondition:
+ * Caller must hold page->store->pgcache_lock.
+ */
+static bool page_evictable(struct page *page);
+
+static struct condvar*
+page_wait_queue(struct page *page)
+{
+    return &page_wait_queues[(page_to_paddr(page) / pg_size) % PAGE_WAIT_QUEUES];
+}
+
+static void
+wait_page(struct page *page)
+{
+    struct condvar *queue;
+
+    if (!page->inflight) {
+        return;
+    }
+    queue = page_wait_queue(page);
+    spinlock_acquire(&io_lock);
+    while (page->inflight) {
+        condvar_wait(queue, &io_lock);
+    }
+    spinlock_release(&io_lock);
+}
+
+static void
+wait_page_unlocked(struct memstore *store, struct page *page)
+{
+    // Keep the page allocated while the lock is dropped, its fill may fail and
+    // drop it from the cache
+    pmem_inc_refcnt(page_to_paddr(page), 1);
+    sleeplock_release(&store->pgcache_lock);
+    wait_page(page);
+    sleeplock_acquire(&store->pgcache_lock);
+    pmem_dec_refcnt(page_to_paddr(page));
+}
+
+static err_t
+insert_page(struct memstore *store, offset_t ofs, struct page *page)
+{
+    switch (radix_tree_insert(&store->cached_pages, ofs / pg_size, page)) {
+        case ERR_RADIX_TREE_ALLOC:
+            return ERR_NOMEM;
+        case ERR_RADIX_TREE_NODE_EXIST:
+            panic("node should not exist");
+    }
+    page->store = store;
+    page->ofs = pg_round_down(ofs);
+    list_append(&store->pages, &page->cache_node);
+    // New pages go right behind the clock hand, the last to be visited
+    page->referenced = False;
+    sleeplock_acquire(&lru_lock);
+    list_append(&lru, &page->lru_node);
+    n_cached_pages++;
+    sleeplock_release(&lru_lock);
+    return ERR_OK;
+}
+
+static void
+remove_page(struct memstore *store, struct page *page)
+{
+    radix_tree_remove(&store->cached_pages, page->ofs / pg_size);
+    list_remove(&page->cache_node);
+    list_remove(&page->lru_node);
+    n_cached_pages--;
+    page->store = NULL;
+}
+
+static err_t
+alloc_page(struct memstore *locked, paddr_t *paddr)
+{
+    if (over_budget(free_low_pages)) {
+        reclaim(locked);
+    }
+    if (pmem_alloc_class(paddr, PMEM_CLASS_PGCACHE) == ERR_OK) {
+        return ERR_OK;
+    }
+    // Memory ran out before the watermarks were reached
+    reclaim(locked);
+    return pmem_alloc_class(paddr, PMEM_CLASS_PGCACHE);
+}
+
+static bool
+over_budget(size_t free_pages)
+{
+    return n_cached_pages > max_cached_pages || pmem_get_free_pages() < free_pages;
+}
+
+static void
+reclaim(struct memstore *locked)
+{
+    struct page *page;
+    struct memstore *store;
+    size_t scan;
+
+    sleeplock_acquire(&lru_lock);
+    // A page is evicted the second time the hand passes it unused, so two
+    // turns visit every page that can be evicted
+    for (scan = 2 * n_cached_pages;
+         scan > 0 && !list_empty(&lru) && over_budget(free_high_pages);
+         scan--) {
+        page = list_entry(list_begin(&lru), struct page, lru_node);
+        list_remove(&page->lru_node);
+        list_append(&lru, &page->lru_node);
+        if (page->referenced) {
+            page->referenced = False;
+            continue;
+        }
+        // A page on the list keeps its store alive: pgcache_remove_page takes
+        // lru_lock to unlink it
+        store = page->store;
+        if (!store->evictable ||
+            (store != locked && sleeplock_try_acquire(&store->pgcache_lock) != ERR_OK)) {
+            continue;
+        }
+        if (page_evictable(page)) {
+            remove_page(store, page);
+            // Drop the cache's reference, which frees the page
+            pmem_dec_refcnt(page_to_paddr(page));
+        }
+        if (store != locked) {
+            sleeplock_release(&store->pgcache_lock);
+        }
+    }
+    sleeplock_release(&lru_lock);
+}
+
+static bool
+page_evictable(struct page *page)
+{
+    // References are only taken under the store's pgcache_lock, and an unused
+    // page can't be dirtied meanwhile. Block headers of bdev pages point into
+    // the page.
+    return pmem_get_refcnt(page_to_paddr(page)) == 1 && !page->inflight &&
+           !pmem_is_page_dirty(page) && page->blk_headers == NULL;
+}
+
+void
+pgcache_init(void)
+{
+    struct memstat stat;
+    int i;
+
+    spinlock_init(&io_lock);
+    for (i = 0; i < PAGE_WAIT_QUEUES; i++) {
+        condvar_init(&page_wait_queues[i]);
+    }
+    list_init(&lru);
+    sleeplock_init(&lru_lock);
+    n_cached_pages = 0;
+    pmem_get_stat(&stat);
+    max_cached_pages = stat.total_pages * PGCACHE_MAX_RATIO / 100;
+    free_low_pages = stat.total_pages * PGCACHE_FREE_LOW_RATIO / 100;
+    free_high_pages = stat.total_pages * PGCACHE_FREE_HIGH_RATIO / 100;
+}
 
 struct page*
 pgcache_get_page(struct memstore *store, offset_t ofs)
 {
     struct page *page;
     paddr_t paddr;
+    err_t err;
 
     kassert(store);
-    paddr = PADDR_NONE;
-
-    if ((page = radix_tree_lookup(&store->cached_pages, ofs / pg_size)) == NULL) {
-        // Page not found in cache -- allocate a new page, and update the page
-        // with data read from the backing store
-        if (pmem_alloc(&paddr) != ERR_OK) {
-            return NULL;
-        }
-        page = paddr_to_page(paddr);
-        if (store->fillpage(store, ofs, page) != ERR_OK) {
-            pmem_free(paddr);
-            return NULL;
-        }
-        switch (radix_tree_insert(&store->cached_pages, ofs / pg_size, page)) {
-            case ERR_RADIX_TREE_ALLOC:
-                pmem_free(paddr);
-                return NULL;
-            case ERR_RADIX_TREE_NODE_EXIST:
-                panic("node should not exist");
+    // A page being filled is cached already, wait for it without holding up
+    // other lookups of the store. Its fill may fail, look it up again after.
+    while ((page = radix_tree_lookup(&store->cached_pages, ofs / pg_size)) != NULL) {
+        page->referenced = True;
+        if (page->inflight) {
+            wait_page_unlocked(store, page);
+        } else if (page->fill_failed) {
+            // Readahead failed to fill the page, drop it and read it below
+            pgcache_remove_page(store, ofs);
+            pmem_dec_refcnt(page_to_paddr(page));
+        } else {
+            return page;
         }
     }
 
+    // Page not found in cache -- allocate a new page, and update the page
+    // with data read from the backing store
+    if (alloc_page(store, &paddr) != ERR_OK) {
+        return NULL;
+    }
+    page = paddr_to_page(paddr);
+    // Cache the page before reading it, so that other lookups of the page wait
+    // for this read instead of starting their own
+    page->inflight = True;
+    page->fill_failed = False;
+    if (insert_page(store, ofs, page) != ERR_OK) {
+        pmem_free(paddr);
+        return NULL;
+    }
+    // Read without the store lock, and hold a reference meanwhile: the page is
+    // evictable as soon as it is filled
+    pmem_inc_refcnt(paddr, 1);
+    sleeplock_release(&store->pgcache_lock);
+    err = store->fillpage(store, pg_round_down(ofs), page);
+    if (err == ERR_OK) {
+        pgcache_fill_done(page, ERR_OK);
+    }
+    sleeplock_acquire(&store->pgcache_lock);
+    pmem_dec_refcnt(paddr);
+    if (err != ERR_OK) {
+        // Drop the page before waking up waiters, so that they read it again
+        sleeplock_acquire(&lru_lock);
+        remove_page(store, page);
+        sleeplock_release(&lru_lock);
+        pgcache_fill_done(page, err);
+        pmem_dec_refcnt(paddr);
+        return NULL;
+    }
     return page;
 }
 
+err_t
+pgcache_readahead(struct memstore *store, offset_t ofs)
+{
+    struct page *page;
+    paddr_t paddr;
+
+    kassert(store);
+    if (store->fillpage_async == NULL ||
+        radix_tree_lookup(&store->cached_pages, ofs / pg_size) != NULL) {
+        return ERR_OK;
+    }
+    if (alloc_page(store, &paddr) != ERR_OK) {
+        return ERR_NOMEM;
+    }
+    page = paddr_to_page(paddr);
+    // Cache the page before starting the fill, so that readers find it and
+    // wait instead of reading it again
+    page->inflight = True;
+    page->fill_failed = False;
+    if (insert_page(store, ofs, page) != ERR_OK) {
+        pmem_free(paddr);
+        return ERR_NOMEM;
+    }
+    if (store->fillpage_async(store, pg_round_down(ofs), page) != ERR_OK) {
+        page->inflight = False;
+        pgcache_remove_page(store, ofs);
+        pmem_free(paddr);
+        return ERR_NOMEM;
+    }
+    return ERR_OK;
+}
+
+void
+pgcache_fill_done(struct page *page, err_t err)
+{
+    spinlock_acquire(&io_lock);
+    page->fill_failed = err != ERR_OK;
+    page->inflight = False;
+    condvar_broadcast(page_wait_queue(page));
+    spinlock_release(&io_lock);
+}
+
 void
 pgcache_remove_page(struct memstore *store, offset_t ofs)
 {
+    struct page *page;
+
+    kassert(store);
+    if ((page = radix_tree_lookup(&store->cached_pages, ofs / pg_size)) != NULL) {
+        kassert(!page->inflight);
+        sleeplock_acquire(&lru_lock);
+        remove_page(store, page);
+        sleeplock_release(&lru_lock);
+    }
+}
+
+void
+pgcache_update(struct memstore *store, offset_t ofs, const void *buf, size_t count)
+{
+    struct page *page;
+    size_t n;
+
     kassert(store);
-    radix_tree_remove(&store->cached_pages, ofs / pg_size);
+    for (; count > 0; ofs += n, buf = (const uint8_t*)buf + n, count -= n) {
+        n = min(pg_size - pg_ofs(ofs), count);
+        if ((page = radix_tree_lookup(&store->cached_pages, ofs / pg_size)) != NULL) {
+            memcpy((void*)(kmap_p2v(page_to_paddr(page)) + pg_ofs(ofs)), buf, n);
+        }
+    }
+}
+
+void
+pgcache_release(struct memstore *store)
+{
+    struct page *page;
+
+    kassert(store);
+    sleeplock_acquire(&store->pgcache_lock);
+    while (!list_empty(&store->pages)) {
+        page = list_entry(list_begin(&store->pages), struct page, cache_node);
+        if (page->inflight) {
+            wait_page_unlocked(store, page);
+            continue;
+        }
+        pgcache_remove_page(store, page->ofs);
+        // Only the cache holds a reference now
+        pmem_dec_refcnt(page_to_paddr(page));
+    }
+    sleeplock_release(&store->pgcache_lock);
+}
+
+bool
+pgcache_need_reclaim(void)
+{
+    return over_budget(free_low_pages);
+}
+
+void
+pgcache_reclaim(void)
+{
+    reclaim(NULL);
 }
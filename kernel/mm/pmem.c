@@ -2,10 +2,12 @@
 #include <kernel/vm.h>
 #include <kernel/console.h>
 #include <kernel/vpmap.h>
+#include <kernel/rmap.h>
 #include <lib/errcode.h>
 #include <lib/string.h>
 #include <lib/stddef.h>
 #include <lib/bits.h>
+#include <arch/asm.h>
 
 /*
  * pmem contains two memory allocators:
@@ -23,6 +25,17 @@
  * them in the current free list and returns the other one. The two blocks are
  * called "buddies". When two buddy blocks are both freed, they merge into a
  * bigger block and is moved to the next free list.
+ *
+ * Allocations are not rounded up to a power of two: pmem splits off the
+ * smallest block that fits, and returns the unused tail of the block to the
+ * free lists. Each allocated page is tracked on its own, so any subrange of an
+ * allocation can be freed.
+ *
+ * When a multi-page allocation fails because free memory is too fragmented,
+ * pmem compacts memory: it picks the aligned block that contains the fewest
+ * allocated pages, and migrates those pages elsewhere. Only anonymous user
+ * pages are movable -- pages whose every reference is a user page table entry
+ * recorded in the page's reverse mapping.
  */
 
 struct pmemconfig pmemconfig;
@@ -53,8 +66,31 @@ static bool pagemap_initialized;
  * freeblocks keeps a linked list of free blocks for each order n, up to
  * MAX_ORDER.
  */
-#define MAX_ORDER 10
+#define MAX_ORDER PMEM_MAX_ORDER
 static List freeblocks[MAX_ORDER+1];
+// Number of pages in the free blocks
+static size_t n_free_pages;
+
+/*
+ * Allocation statistics. Counters are updated atomically outside of pmem_lock.
+ */
+static struct {
+    size_t n_alloc;
+    size_t n_fail;
+    size_t n_free;
+    size_t class_pages[PMEM_N_CLASSES];
+    size_t latency[PMEM_N_LAT_BUCKETS];
+} alloc_stats;
+
+/*
+ * Compaction statistics.
+ */
+static struct {
+    size_t attempts;    // high order allocations that fell back to compaction
+    size_t success;     // compactions that produced a free block
+    size_t fail;        // compactions that found no suitable block
+    size_t migrated;    // pages migrated
+} compact_stats;
 
 /*
  * Initialize bitmap for the boot memory allocator.
@@ -198,6 +234,80 @@ static void freeblocks_insert_range(paddr_t start, paddr_t end);
  */
 static void freeblocks_remove(struct page *page);
 
+/*
+ * Initialize the struct page of a newly allocated page.
+ *
+ * Precondition:
+ * Caller must hold pmem_lock.
+ */
+static void page_init_alloc(struct page *page);
+
+/*
+ * Allocate the first n pages of a block that has been taken off the free
+ * lists, and return the unused tail of the block to the free lists. Allocated
+ * pages are tracked individually (as order 0 pages), so that any subrange of
+ * an allocation can later be freed.
+ *
+ * Precondition:
+ * Caller must hold pmem_lock.
+ */
+static void alloc_extent(struct page *block, size_t n);
+
+/*
+ * Check if an allocated page can be migrated: it is a single page, and each of
+ * its references is a user mapping recorded in its reverse mapping, outside of
+ * page tables shared since fork.
+ *
+ * Precondition:
+ * Caller must hold the rmap lock and pmem_lock.
+ */
+static bool page_is_movable(struct page *page);
+
+/*
+ * Find the aligned block of 2^order pages that needs the fewest migrations to
+ * become free. Return the first page of the block, or NULL if every block
+ * contains unmovable pages.
+ *
+ * Precondition:
+ * Caller must hold the rmap lock and pmem_lock.
+ */
+static struct page *compact_find_block(int order);
+
+/*
+ * Take all free blocks within the 2^order block starting at ``block`` off the
+ * free lists, and pin their pages, so that migration never picks a page inside
+ * the block as its target. Pinned pages have no reverse mapping.
+ *
+ * Precondition:
+ * Caller must hold pmem_lock.
+ */
+static void compact_isolate_block(struct page *block, int order);
+
+/*
+ * Return all pinned pages within the 2^order block starting at ``block`` to
+ * the free lists. Used when migration fails halfway.
+ *
+ * Precondition:
+ * Caller must hold pmem_lock.
+ */
+static void compact_release_block(struct page *block, int order);
+
+/*
+ * Create a free block of at least n pages by migrating movable pages out of
+ * the least occupied block. On success, n pages of the block are allocated and
+ * the address of the first one is stored in paddr.
+ *
+ * Return:
+ * ERR_OK - Block allocated.
+ * ERR_NOMEM - No block can be freed by compaction.
+ */
+static err_t pmem_compact(paddr_t *paddr, size_t n);
+
+/*
+ * Record an allocation that took ``cycles`` cycles in the latency histogram.
+ */
+static void record_latency(uint64_t cycles);
+
 /*
  * Implementation of pmem_nalloc. Argument lock indicates if the function should
  * acquire/release pmem_lock.
@@ -510,6 +620,7 @@ freeblocks_insert(struct page *page)
 
     page->refcnt = 0;
     list_append(&freeblocks[page->order], &page->node);
+    n_free_pages += 1 << page->order;
 }
 
 static void
@@ -537,6 +648,7 @@ freeblocks_remove(struct page *page)
     kassert(page->order >= 0 && page->order <= MAX_ORDER);
 
     list_remove(&page->node);
+    n_free_pages -= 1 << page->order;
 }
 
 static err_t
@@ -562,14 +674,8 @@ pmem_nalloc_internal(paddr_t *paddr, size_t n, bool lock)
         if ((page = find_freeblock(order, False)) == NULL) {
             goto fail;
         }
-        sleeplock_init(&page->lock);
-        page->kmem_cache = NULL;
-        page->slab = NULL;
-        page->rmap = NULL;
-        pmem_set_page_dirty(page, False);
         kassert(page->refcnt == 0);
-        page->refcnt = 1;
-        list_init(&page->blk_headers);
+        alloc_extent(page, n);
         *paddr = page_to_paddr(page);
         kassert(*paddr != NULL);
     }
@@ -598,24 +704,230 @@ pmem_nfree_internal(paddr_t paddr, size_t n, bool lock)
         // Boot memory allocator
         bitmap_free(BITMAP_PTOI(paddr), n);
     } else {
-        // Buddy allocator
-        page = paddr_to_page(paddr);
-        if (1 << page->order != n) {
-            // Buddy allocator requires freeing the same number of pages as
-            // allocated.
-            // TODO: how do we handle this case? for now, just free all
-            // allocated pages
+        // Buddy allocator: allocated pages are tracked individually, so free
+        // them one at a time and let the buddy blocks merge back up
+        for (; n > 0; n--, paddr += pg_size) {
+            page = paddr_to_page(paddr);
+            kassert(page->refcnt > 0);
+            kassert(page->order == 0);
+            page->refcnt = 0;
+            page = merge_block(page);
+            kassert(page != NULL);
+            freeblocks_insert(page);
+            __sync_add_and_fetch(&alloc_stats.n_free, 1);
         }
-        page->refcnt = 0;
-        page = merge_block(page);
-        kassert(page != NULL);
-        freeblocks_insert(page);
     }
     if (lock) {
         spinlock_release(&pmem_lock);
     }
 }
 
+static void
+page_init_alloc(struct page *page)
+{
+    sleeplock_init(&page->lock);
+    page->kmem_cache = NULL;
+    page->slab = NULL;
+    page->rmap = NULL;
+    pmem_set_page_dirty(page, False);
+    page->refcnt = 1;
+    page->blk_headers = NULL;
+    page->blk_refs = 0;
+    page->store = NULL;
+    page->ofs = 0;
+    list_init(&page->pt_sharers);
+}
+
+static void
+alloc_extent(struct page *block, size_t n)
+{
+    struct page *page;
+    size_t block_size;
+
+    block_size = 1 << block->order;
+    kassert(n > 0 && n <= block_size);
+    for (page = block; page < block + n; page++) {
+        page->order = 0;
+        page_init_alloc(page);
+    }
+    // Tail pieces are aligned within the block and their buddies are not free,
+    // so they can go straight back to the free lists
+    if (n < block_size) {
+        freeblocks_insert_range(page_to_paddr(block + n), page_to_paddr(block + block_size));
+    }
+}
+
+static bool
+page_is_movable(struct page *page)
+{
+    return page->refcnt > 0 && page->order == 0 && page->kmem_cache == NULL &&
+        page->rmap != NULL && list_empty(&page->rmap->regions) &&
+        rmap_mapcount(page) == page->refcnt && !rmap_is_shared(page);
+}
+
+static struct page*
+compact_find_block(int order)
+{
+    struct page *page, *block, *best;
+    size_t block_size;
+    int movable, best_movable;
+    bool usable;
+
+    block_size = 1 << order;
+    best = NULL;
+    best_movable = 0;
+    // Every page belongs to exactly one block (free or allocated), and the
+    // first page of a block records the block's order. Walk the blocks in
+    // physical order, looking at one aligned 2^order window at a time.
+    page = pagemap;
+    for (block = pagemap; block + block_size <= pagemap_end; block += block_size) {
+        // A block that started before this window spans into it
+        usable = page == block;
+        movable = 0;
+        for (; page < block + block_size; page += 1 << page->order) {
+            if (page->order > order) {
+                usable = False;
+            } else if (page->refcnt == 0) {
+                continue;
+            } else if (page_is_movable(page)) {
+                movable++;
+            } else {
+                usable = False;
+            }
+        }
+        if (usable && movable > 0 && (best == NULL || movable < best_movable)) {
+            best = block;
+            best_movable = movable;
+        }
+    }
+    return best;
+}
+
+static void
+compact_isolate_block(struct page *block, int order)
+{
+    struct page *page, *p;
+
+    for (page = block; page < block + (1 << order); page += 1 << page->order) {
+        if (page->refcnt == 0) {
+            freeblocks_remove(page);
+            for (p = page + (1 << page->order) - 1; p >= page; p--) {
+                p->order = 0;
+                p->refcnt = 1;
+                p->kmem_cache = NULL;
+                p->rmap = NULL;
+            }
+        }
+    }
+}
+
+static void
+compact_release_block(struct page *block, int order)
+{
+    struct page *page;
+
+    for (page = block; page < block + (1 << order); page++) {
+        if (page->rmap == NULL) {
+            kassert(page->order == 0 && page->refcnt == 1);
+            pmem_nfree_internal(page_to_paddr(page), 1, False);
+        }
+    }
+}
+
+static err_t
+pmem_compact(paddr_t *paddr, size_t n)
+{
+    struct page *block, *page, *new;
+    paddr_t new_paddr;
+    int order = get_min_page_order(n);
+
+    rmap_lock();
+    spinlock_acquire(&pmem_lock);
+    compact_stats.attempts++;
+    // Memory may have been freed since the allocation failed
+    if ((block = find_freeblock(order, False)) != NULL) {
+        goto done;
+    }
+    if ((block = compact_find_block(order)) == NULL) {
+        compact_stats.fail++;
+        spinlock_release(&pmem_lock);
+        rmap_unlock();
+        return ERR_NOMEM;
+    }
+    compact_isolate_block(block, order);
+    spinlock_release(&pmem_lock);
+
+    // Holding the rmap lock keeps the movable pages' mappings stable while
+    // they are copied and remapped
+    for (page = block; page < block + (1 << order); page++) {
+        if (page->rmap == NULL) {
+            continue;
+        }
+        if (pmem_alloc_class(&new_paddr, PMEM_CLASS_ANON) != ERR_OK) {
+            goto fail;
+        }
+        new = paddr_to_page(new_paddr);
+        // The table of a mapping may have been shared since the block was
+        // picked
+        if (rmap_migrate(page, new) != ERR_OK) {
+            pmem_free(new_paddr);
+            goto fail;
+        }
+
+        spinlock_acquire(&pmem_lock);
+        new->refcnt = page->refcnt;
+        new->state = page->state;
+        page->refcnt = 1;
+        compact_stats.migrated++;
+        spinlock_release(&pmem_lock);
+    }
+
+    // Every page of the block is now pinned: hand out the first n of them and
+    // free the rest
+    spinlock_acquire(&pmem_lock);
+    for (page = block; page < block + (1 << order); page++) {
+        if (page < block + n) {
+            page_init_alloc(page);
+        } else {
+            pmem_nfree_internal(page_to_paddr(page), 1, False);
+        }
+    }
+    compact_stats.success++;
+    spinlock_release(&pmem_lock);
+    rmap_unlock();
+    *paddr = page_to_paddr(block);
+    return ERR_OK;
+
+done:
+    alloc_extent(block, n);
+    compact_stats.success++;
+    spinlock_release(&pmem_lock);
+    rmap_unlock();
+    *paddr = page_to_paddr(block);
+    return ERR_OK;
+
+fail:
+    spinlock_acquire(&pmem_lock);
+    compact_release_block(block, order);
+    compact_stats.fail++;
+    spinlock_release(&pmem_lock);
+    rmap_unlock();
+    return ERR_NOMEM;
+}
+
+static void
+record_latency(uint64_t cycles)
+{
+    int bucket;
+    uint64_t bound;
+
+    for (bucket = 0, bound = 1 << PMEM_LAT_BASE_SHIFT;
+         bucket < PMEM_N_LAT_BUCKETS - 1 && cycles >= bound; bucket++, bound <<= 2) {
+        ;
+    }
+    __sync_add_and_fetch(&alloc_stats.latency[bucket], 1);
+}
+
 struct page*
 paddr_to_page(paddr_t paddr)
 {
@@ -650,13 +962,41 @@ pmem_init(void)
 err_t
 pmem_alloc(paddr_t *paddr)
 {
-    return pmem_nalloc(paddr, 1);
+    return pmem_nalloc_class(paddr, 1, PMEM_CLASS_OTHER);
 }
 
 err_t
 pmem_nalloc(paddr_t *paddr, size_t n)
 {
-    return pmem_nalloc_internal(paddr, n, True);
+    return pmem_nalloc_class(paddr, n, PMEM_CLASS_OTHER);
+}
+
+err_t
+pmem_alloc_class(paddr_t *paddr, pmem_class_t class)
+{
+    return pmem_nalloc_class(paddr, 1, class);
+}
+
+err_t
+pmem_nalloc_class(paddr_t *paddr, size_t n, pmem_class_t class)
+{
+    err_t err;
+    uint64_t start;
+
+    kassert(class >= 0 && class < PMEM_N_CLASSES);
+    start = rdtsc();
+    if ((err = pmem_nalloc_internal(paddr, n, True)) == ERR_NOMEM && n > 1 && pagemap_initialized) {
+        err = pmem_compact(paddr, n);
+    }
+    record_latency(rdtsc() - start);
+
+    if (err == ERR_OK) {
+        __sync_add_and_fetch(&alloc_stats.n_alloc, 1);
+        __sync_add_and_fetch(&alloc_stats.class_pages[class], n);
+    } else {
+        __sync_add_and_fetch(&alloc_stats.n_fail, 1);
+    }
+    return err;
 }
 
 void
@@ -683,6 +1023,12 @@ pmem_set_page_dirty(struct page *page, int dirty)
     page->state = set_state_bit(page->state, PAGE_DIRTY_BIT, dirty);
 }
 
+size_t
+pmem_get_free_pages(void)
+{
+    return n_free_pages;
+}
+
 int
 pmem_get_refcnt(paddr_t paddr)
 {
@@ -727,3 +1073,57 @@ pmem_dec_refcnt(paddr_t paddr)
     }
     spinlock_release(&pmem_lock);
 }
+
+void
+pmem_frag_info(void)
+{
+    int order, i;
+    size_t small_pages;
+    struct memstat stat;
+
+    pmem_get_stat(&stat);
+    kprintf("Free memory: %u pages\n", stat.free_pages);
+    for (order = 0; order <= MAX_ORDER; order++) {
+        // Fraction of free memory that cannot serve an allocation of this order
+        for (i = 0, small_pages = 0; i < order; i++) {
+            small_pages += stat.free_blocks[i] << i;
+        }
+        kprintf("    Order %d: %u free blocks, %u%% unusable\n", order, stat.free_blocks[order],
+                stat.free_pages ? small_pages * 100 / stat.free_pages : 0);
+    }
+    kprintf("compaction: %u attempts, %u succeeded, %u failed, %u pages migrated\n",
+            stat.compact_attempts, stat.compact_success, stat.compact_fail, stat.compact_migrated);
+}
+
+void
+pmem_get_stat(struct memstat *stat)
+{
+    int i;
+
+    kassert(stat);
+    memset(stat, 0, sizeof(*stat));
+    stat->total_pages = (pmemconfig.pmem_end - pmemconfig.pmem_start) / pg_size;
+
+    spinlock_acquire(&pmem_lock);
+    for (i = 0; i <= MAX_ORDER; i++) {
+        for (Node *n = list_begin(&freeblocks[i]); n != list_end(&freeblocks[i]); n = list_next(n)) {
+            stat->free_blocks[i]++;
+        }
+        stat->free_pages += stat->free_blocks[i] << i;
+    }
+    stat->compact_attempts = compact_stats.attempts;
+    stat->compact_success = compact_stats.success;
+    stat->compact_fail = compact_stats.fail;
+    stat->compact_migrated = compact_stats.migrated;
+    spinlock_release(&pmem_lock);
+
+    stat->n_alloc = alloc_stats.n_alloc;
+    stat->n_fail = alloc_stats.n_fail;
+    stat->n_free = alloc_stats.n_free;
+    for (i = 0; i < PMEM_N_CLASSES; i++) {
+        stat->class_pages[i] = alloc_stats.class_pages[i];
+    }
+    for (i = 0; i < PMEM_N_LAT_BUCKETS; i++) {
+        stat->latency[i] = alloc_stats.latency[i];
+    }
+}
@@ -1,10 +1,50 @@
 #include <kernel/rmap.h>
+#include <kernel/pmem.h>
+#include <kernel/vpmap.h>
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
+#include <kernel/synch.h>
 #include <lib/errcode.h>
+#include <lib/string.h>
 #include <lib/stddef.h>
 
 struct kmem_cache *rmap_allocator = NULL;
+static struct kmem_cache *rmap_entry_allocator = NULL;
+
+// Lock protecting the mappings list of every page's rmap
+static struct spinlock rmap_spinlock;
+
+/*
+ * Find the entry recording vaddr in vpmap. Return NULL if not found.
+ *
+ * Precondition:
+ * Caller must hold rmap_spinlock.
+ */
+static struct rmap_entry *rmap_find_entry(struct rmap *rmap, struct vpmap *vpmap, vaddr_t vaddr);
+
+static struct rmap_entry*
+rmap_find_entry(struct rmap *rmap, struct vpmap *vpmap, vaddr_t vaddr)
+{
+    for (Node *n = list_begin(&rmap->mappings); n != list_end(&rmap->mappings); n = list_next(n)) {
+        struct rmap_entry *entry = list_entry(n, struct rmap_entry, node);
+        if (entry->vpmap == vpmap && entry->vaddr == vaddr) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void
+rmap_init(void)
+{
+    spinlock_init(&rmap_spinlock);
+    if (rmap_allocator == NULL && (rmap_allocator = kmem_cache_create(sizeof(struct rmap))) == NULL) {
+        panic("rmap init: failed to create rmap allocator");
+    }
+    if ((rmap_entry_allocator = kmem_cache_create(sizeof(struct rmap_entry))) == NULL) {
+        panic("rmap init: failed to create rmap entry allocator");
+    }
+}
 
 struct rmap*
 rmap_alloc(void)
@@ -34,6 +74,7 @@ rmap_construct(struct rmap *rmap)
 {
     kassert(rmap);
     list_init(&rmap->regions);
+    list_init(&rmap->mappings);
 }
 
 void
@@ -41,12 +82,189 @@ rmap_destroy(struct rmap *rmap)
 {
     kassert(rmap);
     kassert(list_empty(&rmap->regions));
+    kassert(list_empty(&rmap->mappings));
     // nothing to do
 }
 
+void
+rmap_add_region(struct rmap *rmap, Node *region_node)
+{
+    kassert(rmap && region_node);
+    rmap_lock();
+    list_append(&rmap->regions, region_node);
+    rmap_unlock();
+}
+
+void
+rmap_remove_region(Node *region_node)
+{
+    kassert(region_node);
+    rmap_lock();
+    list_remove(region_node);
+    rmap_unlock();
+}
+
 err_t
 rmap_unmap(struct rmap *rmap, paddr_t paddr)
 {
     // TODO
     return ERR_OK;
 }
+
+err_t
+rmap_add_mapping(paddr_t paddr, struct vpmap *vpmap, vaddr_t vaddr)
+{
+    struct page *page;
+    struct rmap *rmap = NULL;
+    struct rmap_entry *entry;
+
+    kassert(vpmap);
+    if ((entry = kmem_cache_alloc(rmap_entry_allocator)) == NULL) {
+        return ERR_NOMEM;
+    }
+    entry->vpmap = vpmap;
+    entry->vaddr = pg_round_down(vaddr);
+
+    page = paddr_to_page(paddr);
+    rmap_lock();
+    if (page->rmap == NULL) {
+        // Allocate the rmap without the lock: growing the slab may compact
+        // memory, which takes the rmap lock
+        rmap_unlock();
+        if ((rmap = rmap_alloc()) == NULL) {
+            kmem_cache_free(rmap_entry_allocator, entry);
+            return ERR_NOMEM;
+        }
+        rmap_lock();
+        // Another thread may have installed one meanwhile
+        if (page->rmap == NULL) {
+            page->rmap = rmap;
+            rmap = NULL;
+        }
+    }
+    list_append(&page->rmap->mappings, &entry->node);
+    rmap_unlock();
+
+    if (rmap) {
+        rmap_free(rmap);
+    }
+    return ERR_OK;
+}
+
+void
+rmap_remove_mapping(paddr_t paddr, struct vpmap *vpmap, vaddr_t vaddr)
+{
+    struct page *page;
+    struct rmap *rmap = NULL;
+    struct rmap_entry *entry = NULL;
+
+    page = paddr_to_page(paddr);
+    rmap_lock();
+    if (page->rmap && (entry = rmap_find_entry(page->rmap, vpmap, pg_round_down(vaddr))) != NULL) {
+        list_remove(&entry->node);
+        if (list_empty(&page->rmap->mappings) && list_empty(&page->rmap->regions)) {
+            rmap = page->rmap;
+            page->rmap = NULL;
+        }
+    }
+    rmap_unlock();
+
+    if (entry) {
+        kmem_cache_free(rmap_entry_allocator, entry);
+    }
+    if (rmap) {
+        rmap_free(rmap);
+    }
+}
+
+void
+rmap_move_mapping(paddr_t paddr, vaddr_t vaddr, struct vpmap *from, struct vpmap *to)
+{
+    struct page *page;
+    struct rmap_entry *entry;
+
+    page = paddr_to_page(paddr);
+    rmap_lock();
+    if (page->rmap && (entry = rmap_find_entry(page->rmap, from, pg_round_down(vaddr))) != NULL) {
+        entry->vpmap = to;
+    }
+    rmap_unlock();
+}
+
+int
+rmap_mapcount(struct page *page)
+{
+    int count = 0;
+
+    kassert(page);
+    if (page->rmap == NULL) {
+        return 0;
+    }
+    for (Node *n = list_begin(&page->rmap->mappings); n != list_end(&page->rmap->mappings); n = list_next(n)) {
+        count++;
+    }
+    return count;
+}
+
+bool
+rmap_is_shared(struct page *page)
+{
+    kassert(page);
+    if (page->rmap == NULL) {
+        return False;
+    }
+    for (Node *n = list_begin(&page->rmap->mappings); n != list_end(&page->rmap->mappings); n = list_next(n)) {
+        struct rmap_entry *entry = list_entry(n, struct rmap_entry, node);
+        if (vpmap_is_shared(entry->vpmap, entry->vaddr)) {
+            return True;
+        }
+    }
+    return False;
+}
+
+err_t
+rmap_migrate(struct page *old, struct page *new)
+{
+    struct rmap_entry *entry;
+    paddr_t paddr;
+    Node *n, *m;
+    err_t err;
+
+    kassert(old && new && old->rmap);
+    kassert(new->rmap == NULL);
+
+    // No processor may write the page while it is copied
+    for (n = list_begin(&old->rmap->mappings); n != list_end(&old->rmap->mappings); n = list_next(n)) {
+        entry = list_entry(n, struct rmap_entry, node);
+        if ((err = vpmap_write_protect(entry->vpmap, entry->vaddr, &entry->writable)) != ERR_OK) {
+            // Restore the mappings protected so far
+            for (m = list_begin(&old->rmap->mappings); m != n; m = list_next(m)) {
+                entry = list_entry(m, struct rmap_entry, node);
+                vpmap_remap(entry->vpmap, entry->vaddr, page_to_paddr(old), entry->writable);
+            }
+            return err;
+        }
+    }
+
+    paddr = page_to_paddr(new);
+    memcpy((void*)kmap_p2v(paddr), (void*)kmap_p2v(page_to_paddr(old)), pg_size);
+    for (n = list_begin(&old->rmap->mappings); n != list_end(&old->rmap->mappings); n = list_next(n)) {
+        entry = list_entry(n, struct rmap_entry, node);
+        vpmap_remap(entry->vpmap, entry->vaddr, paddr, entry->writable);
+    }
+    new->rmap = old->rmap;
+    old->rmap = NULL;
+    return ERR_OK;
+}
+
+void
+rmap_lock(void)
+{
+    spinlock_acquire(&rmap_spinlock);
+}
+
+void
+rmap_unlock(void)
+{
+    spinlock_release(&rmap_spinlock);
+}
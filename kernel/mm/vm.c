@@ -6,6 +6,8 @@
 #include <kernel/thread.h>
 #include <kernel/proc.h>
 #include <kernel/memstore.h>
+#include <kernel/pgcache.h>
+#include <kernel/rmap.h>
 #include <kernel/list.h>
 #include <lib/errcode.h>
 #include <arch/mmu.h>
@@ -27,8 +29,31 @@ struct vpmap *kvpmap = &_kvpmap;
 /* Initialize the kernel address space, only called once */
 static void kas_init(void);
 
-/* memregion comparator used to keep memregion in order by their addresses */
-static int memregion_comparator(const Node *a, const Node *b, void *aux);
+/*
+ * Memregion tree operations. Insert and remove return the new root of the
+ * subtree. The tree is kept balanced as an AVL tree.
+ */
+static struct memregion *mrtree_insert(struct memregion *root, struct memregion *r);
+static struct memregion *mrtree_remove(struct memregion *root, struct memregion *r);
+
+/* Recompute the tracked attributes of nodes on the path to r after r changed */
+static void mrtree_touch(struct memregion *root, struct memregion *r);
+
+/* Return the memregion with the highest start address below addr, or NULL */
+static struct memregion *mrtree_prev(struct memregion *root, vaddr_t addr);
+
+/*
+ * Find the lowest gap between two memregions of the subtree that is larger
+ * than size, counting only the part of each gap at or above low. Return True
+ * and the start of the gap in *addr if found.
+ */
+static bool mrtree_find_gap(struct memregion *root, size_t size, vaddr_t low, vaddr_t *addr);
+
+/* Helpers to keep the tree balanced and its nodes' attributes up to date */
+static void mrtree_update(struct memregion *r);
+static struct memregion *mrtree_rotate_left(struct memregion *r);
+static struct memregion *mrtree_rotate_right(struct memregion *r);
+static struct memregion *mrtree_balance(struct memregion *r);
 
 static void memregion_unmap_internal(struct memregion *region);
 
@@ -40,7 +65,12 @@ static struct memregion* memregion_copy_internal(struct addrspace *as,
 
 static struct memregion* memregion_find_internal(struct addrspace *as, vaddr_t addr, size_t size);
 
-/* find free memory addresses of size ``size`` starting at *ret_addr */
+static err_t memregion_sync_internal(struct memregion *region, vaddr_t addr, size_t size);
+
+/*
+ * Find free memory addresses of size ``size`` at or above UMMAP_BASE, so that
+ * regions mapped anywhere stay clear of the heap. Return start in *ret_addr.
+ */
 static err_t find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr);
 
 static char *perm_strings[] = {
@@ -55,6 +85,8 @@ kas_init(void)
 {
     sleeplock_init(&kas->as_lock);
     list_init(&kas->regions);
+    kas->tree = NULL;
+    kas->last_hit = NULL;
     kas->vpmap = kvpmap;
 }
 
@@ -65,6 +97,8 @@ vm_init(void)
     vpmap_init();
     pmem_init(); 
     kmalloc_init();
+    rmap_init();
+    pgcache_init();
 
     if ((memregion_allocator = kmem_cache_create(sizeof(struct memregion))) == NULL) {
         panic("vm init: failed to create memregion allocator");
@@ -80,10 +114,16 @@ as_init(struct addrspace* as)
     kassert(as);
     sleeplock_init(&as->as_lock);
     list_init(&as->regions);
+    as->tree = NULL;
+    as->last_hit = NULL;
     if ((as->vpmap = vpmap_create()) == NULL) {
         return ERR_VM_RESOURCE_UNAVAIL;
     }
     as->heap = NULL;
+    memset(&as->rss, 0, sizeof(as->rss));
+    as->nfaults = 0;
+    as->ncow = 0;
+    vpmap_track_rss(as->vpmap, &as->rss);
     // maybe we should copy in kvm here, every as starts implictly with kas
     // NOTE: temp hack, go through kas and copy all region
     return vpmap_copy_kernel_mapping(as->vpmap);
@@ -95,6 +135,12 @@ as_destroy(struct addrspace *as)
     kassert(as);
     kassert(as != kas); // Cannot destroy kernel address space
     sleeplock_acquire(&as->as_lock);
+    // Write shared mappings back while the page tables still tell which pages
+    // are dirty. Nowhere to report a failed writeback, the data is lost.
+    for (Node *n = list_begin(&as->regions); n != list_end(&as->regions); n = list_next(n)) {
+        struct memregion *region = (struct memregion*) list_entry(n, struct memregion, as_node);
+        memregion_sync_internal(region, region->start, region->end - region->start);
+    }
     vpmap_destroy(as->vpmap);
     as->vpmap = NULL; // make sure memregion_unmap won't walk page tables
 
@@ -121,19 +167,28 @@ as_copy_as(struct addrspace *src_as, struct addrspace *dst_as)
         sleeplock_acquire(&src_as->as_lock);
     }
 
-    // go through all src regions and copy them
+    // go through all src regions and copy them. Pages are not copied here,
+    // the page tables are shared copy-on-write below.
     for (Node *n = list_begin(&src_as->regions); n != list_end(&src_as->regions); n = list_next(n)) {
         struct memregion *r = list_entry(n, struct memregion, as_node);
-        struct memregion *dst_r = memregion_copy_internal((struct addrspace*) dst_as, r, r->start);
+        struct memregion *dst_r = memregion_map_internal(dst_as, r->start, r->end - r->start,
+            r->perm, r->store, r->ofs, r->shared);
         if (dst_r == NULL) {
             err = ERR_NOMEM;
             break;
         }
+        dst_r->filesz = r->filesz;
+        dst_r->advice = r->advice;
         // if copying heap region, set the dst_as's heap
         if (r == src_as->heap) {
             dst_as->heap = dst_r;
         }
     }
+    if (err == ERR_OK) {
+        err = vpmap_fork(src_as->vpmap, dst_as->vpmap);
+        // the source lost write access to its page tables
+        vpmap_flush_tlb(src_as->vpmap);
+    }
     sleeplock_release(&src_as->as_lock);
     sleeplock_release(&dst_as->as_lock);
     return err;
@@ -216,12 +271,8 @@ as_dump(struct addrspace *as, vaddr_t vaddr)
     struct memregion *region;
 
     sleeplock_acquire(&as->as_lock);
-    List *list = &as->regions;
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        region = (struct memregion*) list_entry(n, struct memregion, as_node);
-        if (vaddr >= region->start && vaddr + sizeof(size_t) < pg_round_up(region->end)) {
-            goto found;
-        }
+    if ((region = memregion_find_internal(as, vaddr, sizeof(size_t))) != NULL) {
+        goto found;
     }
     sleeplock_release(&as->as_lock);
     kprintf("memregion containing addr %p is not found\n", vaddr);
@@ -255,30 +306,39 @@ found:
 err_t
 memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_bound)
 {
-    int old_mem_bound = region->end;
-    int new_bound = region->end + size; 
+    err_t err = ERR_OK;
+
+    sleeplock_acquire(&region->as->as_lock);
+    vaddr_t new_bound = region->end + size;
     if (new_bound < region->start) {
-        return ERR_VM_INVALID;
+        err = ERR_VM_INVALID;
+        goto done;
     }
 
     *old_bound = region->end;
     // A negative increment greater than current heap size has no effect and current bound is returned.
     if (size < 0 && (-1*size) > (region->as->heap->end - region->as->heap->start)) {
-        return ERR_OK;
+        goto done;
     }
 
-    // overlapping regions:
-    for (Node *n = list_begin(&region->as->regions); n != list_end(&region->as->regions); n = list_next(n)) {
-        struct memregion *cur_region = (struct memregion*) list_entry(n, struct memregion, as_node);
-        if (cur_region->start > old_mem_bound) {
-            if (region->end > cur_region->start && region->start < cur_region->end) {
-                return ERR_VM_BOUND;
-            }
-        }
+    // overlapping regions: only the next region can get in the way
+    Node *next = list_next(&region->as_node);
+    if (size > 0 && next != list_end(&region->as->regions) &&
+        pg_round_up(new_bound) > list_entry(next, struct memregion, as_node)->start) {
+        err = ERR_VM_BOUND;
+        goto done;
     }
 
+    // Pages no longer in the region are freed, along with their page tables
+    if (pg_round_up(new_bound) < pg_round_up(region->end)) {
+        vpmap_unmap(region->as->vpmap, pg_round_up(new_bound),
+            (pg_round_up(region->end) - pg_round_up(new_bound)) / pg_size, 1);
+    }
     region->end = new_bound;
-    return ERR_OK;
+    mrtree_touch(region->as->tree, region);
+done:
+    sleeplock_release(&region->as->as_lock);
+    return err;
 }
 
 err_t
@@ -294,11 +354,67 @@ memregion_set_perm(struct memregion *region, memperm_t perm)
     // Update memory mappings
     vpmap_set_perm(region->as->vpmap, region->start, pg_round_up(region->end - region->start)/pg_size, perm);
     region->perm = perm;
-    vpmap_flush_tlb();
+    vpmap_flush_range(region->as->vpmap, region->start, pg_round_up(region->end - region->start)/pg_size);
     sleeplock_release(&region->as->as_lock);
     return ERR_OK;
 }
 
+err_t
+memregion_sync(struct memregion *region, vaddr_t addr, size_t size)
+{
+    struct addrspace *as = region->as;
+    err_t err;
+
+    sleeplock_acquire(&as->as_lock);
+    err = memregion_sync_internal(region, addr, size);
+    sleeplock_release(&as->as_lock);
+    return err;
+}
+
+err_t
+memregion_advise(struct memregion *region, vaddr_t addr, size_t size, int advice)
+{
+    struct addrspace *as = region->as;
+    struct memstore *store = region->store;
+    vaddr_t a, end;
+    err_t err = ERR_OK;
+
+    sleeplock_acquire(&as->as_lock);
+    end = pg_round_up(addr + size);
+    addr = pg_round_down(addr);
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_SEQUENTIAL:
+        case MADV_RANDOM:
+            region->advice = advice;
+            region->fault_streak = 0;
+            break;
+        case MADV_WILLNEED:
+            if (store == NULL) {
+                break;
+            }
+            // Read ahead into the page cache, the pages get mapped on fault
+            sleeplock_acquire(&store->pgcache_lock);
+            for (a = addr; a < end && a - region->start < region->filesz; a += pg_size) {
+                if (pgcache_get_page(store, region->ofs + (a - region->start)) == NULL) {
+                    break;
+                }
+            }
+            sleeplock_release(&store->pgcache_lock);
+            break;
+        case MADV_DONTNEED:
+            // Keep the pages mapped if they can't be written back
+            if ((err = memregion_sync_internal(region, addr, end - addr)) == ERR_OK) {
+                vpmap_unmap(as->vpmap, addr, (end - addr) / pg_size, 1);
+            }
+            break;
+        default:
+            err = ERR_VM_INVALID;
+    }
+    sleeplock_release(&as->as_lock);
+    return err;
+}
+
 void
 memregion_unmap(struct memregion *region)
 {
@@ -309,12 +425,177 @@ memregion_unmap(struct memregion *region)
 }
 
 static int
-memregion_comparator(const Node *a, const Node *b, void *aux)
+mrtree_height(struct memregion *r)
+{
+    return r ? r->tree_height : 0;
+}
+
+static void
+mrtree_update(struct memregion *r)
+{
+    size_t gap = 0;
+    int hl = mrtree_height(r->tree_left), hr = mrtree_height(r->tree_right);
+
+    r->tree_height = 1 + (hl > hr ? hl : hr);
+    r->subtree_start = r->tree_left ? r->tree_left->subtree_start : r->start;
+    r->subtree_end = r->tree_right ? r->tree_right->subtree_end : pg_round_up(r->end);
+    if (r->tree_left) {
+        gap = r->tree_left->subtree_gap;
+        if (r->start - r->tree_left->subtree_end > gap) {
+            gap = r->start - r->tree_left->subtree_end;
+        }
+    }
+    if (r->tree_right) {
+        if (r->tree_right->subtree_gap > gap) {
+            gap = r->tree_right->subtree_gap;
+        }
+        if (r->tree_right->subtree_start - pg_round_up(r->end) > gap) {
+            gap = r->tree_right->subtree_start - pg_round_up(r->end);
+        }
+    }
+    r->subtree_gap = gap;
+}
+
+static struct memregion*
+mrtree_rotate_left(struct memregion *r)
+{
+    struct memregion *right = r->tree_right;
+    r->tree_right = right->tree_left;
+    right->tree_left = r;
+    mrtree_update(r);
+    mrtree_update(right);
+    return right;
+}
+
+static struct memregion*
+mrtree_rotate_right(struct memregion *r)
+{
+    struct memregion *left = r->tree_left;
+    r->tree_left = left->tree_right;
+    left->tree_right = r;
+    mrtree_update(r);
+    mrtree_update(left);
+    return left;
+}
+
+static struct memregion*
+mrtree_balance(struct memregion *r)
+{
+    int balance;
+
+    mrtree_update(r);
+    balance = mrtree_height(r->tree_left) - mrtree_height(r->tree_right);
+    if (balance > 1) {
+        if (mrtree_height(r->tree_left->tree_left) < mrtree_height(r->tree_left->tree_right)) {
+            r->tree_left = mrtree_rotate_left(r->tree_left);
+        }
+        return mrtree_rotate_right(r);
+    }
+    if (balance < -1) {
+        if (mrtree_height(r->tree_right->tree_right) < mrtree_height(r->tree_right->tree_left)) {
+            r->tree_right = mrtree_rotate_right(r->tree_right);
+        }
+        return mrtree_rotate_left(r);
+    }
+    return r;
+}
+
+static struct memregion*
+mrtree_insert(struct memregion *root, struct memregion *r)
+{
+    if (root == NULL) {
+        r->tree_left = r->tree_right = NULL;
+        mrtree_update(r);
+        return r;
+    }
+    if (r->start < root->start) {
+        root->tree_left = mrtree_insert(root->tree_left, r);
+    } else {
+        root->tree_right = mrtree_insert(root->tree_right, r);
+    }
+    return mrtree_balance(root);
+}
+
+static struct memregion*
+mrtree_remove(struct memregion *root, struct memregion *r)
 {
-    struct memregion *mr_a = list_entry(a, struct memregion, as_node);
-    struct memregion *mr_b = list_entry(b, struct memregion, as_node);
-    // if a and b's memregion is consecutive, we want a after b in the list, +1 bumps 0 to postivie
-    return mr_a->start >= mr_b->end;
+    struct memregion *min;
+
+    kassert(root);
+    if (r->start < root->start) {
+        root->tree_left = mrtree_remove(root->tree_left, r);
+    } else if (r->start > root->start) {
+        root->tree_right = mrtree_remove(root->tree_right, r);
+    } else {
+        kassert(root == r);
+        if (r->tree_left == NULL || r->tree_right == NULL) {
+            return r->tree_left ? r->tree_left : r->tree_right;
+        }
+        // replace r with the lowest region of its right subtree
+        for (min = r->tree_right; min->tree_left; min = min->tree_left);
+        min->tree_right = mrtree_remove(r->tree_right, min);
+        min->tree_left = r->tree_left;
+        root = min;
+    }
+    return mrtree_balance(root);
+}
+
+static void
+mrtree_touch(struct memregion *root, struct memregion *r)
+{
+    if (root == NULL) {
+        return;
+    }
+    if (r->start < root->start) {
+        mrtree_touch(root->tree_left, r);
+    } else if (r->start > root->start) {
+        mrtree_touch(root->tree_right, r);
+    }
+    mrtree_update(root);
+}
+
+static struct memregion*
+mrtree_prev(struct memregion *root, vaddr_t addr)
+{
+    struct memregion *prev = NULL;
+
+    while (root) {
+        if (root->start < addr) {
+            prev = root;
+            root = root->tree_right;
+        } else {
+            root = root->tree_left;
+        }
+    }
+    return prev;
+}
+
+static bool
+mrtree_find_gap(struct memregion *root, size_t size, vaddr_t low, vaddr_t *addr)
+{
+    vaddr_t start;
+
+    if (root == NULL || root->subtree_gap <= size || root->subtree_end <= low) {
+        return False;
+    }
+    if (mrtree_find_gap(root->tree_left, size, low, addr)) {
+        return True;
+    }
+    if (root->tree_left) {
+        start = root->tree_left->subtree_end > low ? root->tree_left->subtree_end : low;
+        if (root->start > start && root->start - start > size) {
+            *addr = start;
+            return True;
+        }
+    }
+    if (root->tree_right) {
+        start = pg_round_up(root->end) > low ? pg_round_up(root->end) : low;
+        if (root->tree_right->subtree_start > start && root->tree_right->subtree_start - start > size) {
+            *addr = start;
+            return True;
+        }
+    }
+    return mrtree_find_gap(root->tree_right, size, low, addr);
 }
 
 static err_t
@@ -324,21 +605,14 @@ find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr)
     kassert(ret_addr);
     kassert(as->as_lock.holder == thread_current());
 
-    List *list = &as->regions;
-    // start looking at first memregion address if exists
-    vaddr_t addr = 0;
-    if (!list_empty(list)) {
-        addr = ((struct memregion*)list_entry(list_begin(list), struct memregion, as_node))->end;
+    // look for the lowest gap between memregions that fits
+    vaddr_t addr = UMMAP_BASE;
+    if (mrtree_find_gap(as->tree, pg_round_up(size), addr, &addr)) {
+        *ret_addr = addr;
+        return ERR_OK;
     }
-
-    // memregion address goes up, only need to check if end is smaller than the start
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = list_entry(n, struct memregion, as_node);
-        if (pg_round_up(addr + size) < r->start) {
-            *ret_addr = addr;
-            return ERR_OK;
-        }
-        addr = pg_round_up(r->end);
+    if (as->tree && as->tree->subtree_end > addr) {
+        addr = as->tree->subtree_end;
     }
     // check address space after the last memregion allocated
     if (pg_round_up(addr + size) < USTACK_LOWERBOUND - size) {
@@ -349,18 +623,69 @@ find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr)
     return !ERR_OK;
 }
 
+static err_t
+memregion_sync_internal(struct memregion *region, vaddr_t addr, size_t size)
+{
+    struct vpmap *vpmap;
+    struct memstore *store;
+    paddr_t paddr;
+    vaddr_t end;
+    int dirty;
+    err_t err;
+
+    kassert(region);
+    kassert(region->as->as_lock.holder == thread_current());
+    store = region->store;
+    if (!region->shared || store == NULL || store->write == NULL) {
+        return ERR_OK;
+    }
+
+    // The page tables are gone once the address space is being destroyed,
+    // as_destroy synced the region before
+    if ((vpmap = region->as->vpmap) == NULL) {
+        return ERR_OK;
+    }
+    end = pg_round_up(addr + size);
+    for (addr = pg_round_down(addr); addr < end; addr += pg_size) {
+        if (vpmap_lookup_vaddr(vpmap, addr, &paddr, NULL) != ERR_OK ||
+            vpmap_get_dirty(vpmap, addr, &dirty) != ERR_OK || !dirty) {
+            continue;
+        }
+        // Clean the page before writing it, a write racing with the writeback
+        // dirties it again
+        vpmap_clear_dirty(vpmap, addr);
+        vpmap_flush_range(vpmap, addr, 1);
+        if ((err = store->write(store, paddr, region->ofs + (addr - region->start))) != ERR_OK) {
+            vpmap_set_dirty(vpmap, addr);
+            return err;
+        }
+    }
+    return ERR_OK;
+}
+
 static void
 memregion_unmap_internal(struct memregion *region)
 {
     kassert(region);
     kassert(region->as->as_lock.holder == thread_current());
 
+    // Nowhere to report a failed writeback, the data is lost
+    memregion_sync_internal(region, region->start, region->end - region->start);
     // Remove all memory mappings
     vpmap_unmap(region->as->vpmap, region->start,
             pg_round_up(region->end - region->start) / pg_size, 1);
     // Detach from address space
     list_remove(&region->as_node);
-    vpmap_flush_tlb();
+    region->as->tree = mrtree_remove(region->as->tree, region);
+    if (region->as->last_hit == region) {
+        region->as->last_hit = NULL;
+    }
+    if (region->store) {
+        rmap_remove_region(&region->store_node);
+        if (region->store->put) {
+            region->store->put(region->store);
+        }
+    }
     kmem_cache_free(memregion_allocator, region);
 }
 
@@ -382,8 +707,10 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
     if (as != kas && (is_kern_memperm(perm) || !is_user_addr(pg_round_up(addr+size)&(~0xFFF)))) {
         return NULL;
     }
-    // Fail if any address in the range overlaps with an existing region
-    if (memregion_find_internal(as, addr, addr+size)) {
+    // Fail if any address in the range overlaps with an existing region. Only
+    // the last region starting below the end of the range can overlap it.
+    struct memregion *prev = mrtree_prev(as->tree, addr + (size ? size : 1));
+    if (prev && pg_round_up(prev->end) > addr) {
         return NULL;
     }
 
@@ -391,16 +718,34 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
         return NULL;
     }
 
-    // Link into address space's region list and memstore's reverse mapping
-    list_append_ordered(&as->regions, &r->as_node, memregion_comparator, NULL);
-    
     r->as = as;
     r->start = addr;
     r->end = addr + size;
+
+    // Link into address space's region list and tree, and memstore's reverse
+    // mapping
+    if ((prev = mrtree_prev(as->tree, addr)) != NULL) {
+        list_insert_after(&prev->as_node, &r->as_node);
+    } else {
+        list_insert_after(&as->regions.header, &r->as_node);
+    }
+    as->tree = mrtree_insert(as->tree, r);
+
     r->perm = perm;
     r->shared = shared;
     r->store = store;
     r->ofs = ofs;
+    r->filesz = store ? size : 0;
+    r->fault_next = r->fault_prev = 0;
+    r->fault_streak = 0;
+    r->fault_down = 0;
+    r->advice = MADV_NORMAL;
+    if (store) {
+        if (store->get) {
+            store->get(store);
+        }
+        rmap_add_region(&store->rmap, &r->store_node);
+    }
     return r;
 }
 
@@ -412,27 +757,34 @@ memregion_copy_internal(struct addrspace *as, struct memregion *src, vaddr_t add
     // Try mapping a region with the same attributes as the source
     if ((dst = memregion_map_internal(as, addr, src->end - src->start, 
             src->perm, src->store, src->ofs, src->shared)) != NULL) {
+        dst->filesz = src->filesz;
+        dst->advice = src->advice;
         // hard copy over everything
         if (vpmap_cow_copy(src->as->vpmap, as->vpmap, src->start, addr,
              pg_round_up(src->end - src->start)/pg_size) != ERR_OK) {
             memregion_unmap_internal(dst);
-            vpmap_flush_tlb();
-            return NULL;
+            dst = NULL;
         }
+        // the source lost write access to the copied pages
+        vpmap_flush_range(src->as->vpmap, src->start, pg_round_up(src->end - src->start)/pg_size);
     }
-    vpmap_flush_tlb();
     return dst;
 }
 
 static struct memregion*
 memregion_find_internal(struct addrspace *as, vaddr_t addr, size_t size)
 {
-    List *list = &as->regions;
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = (struct memregion*) list_entry(n, struct memregion, as_node);
-        if (addr >= r->start && addr+size <= pg_round_up(r->end)) {
-            return r;
+    struct memregion *r;
+
+    // Lookups tend to hit the same region over and over
+    if ((r = as->last_hit) == NULL || addr < r->start || addr >= pg_round_up(r->end)) {
+        if ((r = mrtree_prev(as->tree, addr + 1)) == NULL) {
+            return NULL;
         }
+        as->last_hit = r;
+    }
+    if (addr >= r->start && addr+size <= pg_round_up(r->end)) {
+        return r;
     }
     return NULL;
 }
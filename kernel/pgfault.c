@@ -3,72 +3,258 @@
 #include <kernel/trap.h>
 #include <kernel/vpmap.h>
 #include <kernel/vm.h>
+#include <kernel/pmem.h>
+#include <kernel/memstore.h>
+#include <kernel/pgcache.h>
+#include <kernel/pgfault.h>
+#include <kernel/synch.h>
 #include <arch/mmu.h>
 #include <lib/string.h>
 #include <lib/errcode.h>
 
 size_t user_pgfault = 0;
 
+/*
+ * Copy-on-write faults on the same page are serialized, so that once a sharer
+ * has made its copy, the last one can reuse the page instead of copying it as
+ * well. Locks are hashed by physical page; they can't live in struct page as
+ * the page may be freed while the lock is held.
+ */
+#define N_COW_LOCKS 64
+static struct sleeplock cow_locks[N_COW_LOCKS];
 
-void
-handle_page_fault(vaddr_t fault_addr, int present, int write, int user) {
-    if (user) {
-        __sync_add_and_fetch(&user_pgfault, 1);
+/*
+ * Resolve a write fault on a present page of a writable region. A page of a
+ * shared region is made writable. A private page that is not referenced
+ * anywhere else is made writable in place, otherwise it is copied.
+ */
+static err_t handle_cow_fault(struct memregion *region, vaddr_t addr);
+
+/*
+ * Map a zero-filled anonymous page at addr in region.
+ */
+static err_t map_zero_page(struct memregion *region, vaddr_t addr);
+
+/*
+ * Map the page at addr of a region backed by a memstore. Pages come from the
+ * store's page cache. A private region maps the cached page read-only, so the
+ * first write copies it. A page that is only partially backed by the store is
+ * copied right away, with the rest of the page zero-filled.
+ */
+static err_t map_store_page(struct memregion *region, vaddr_t addr, int write);
+
+/*
+ * Handle a fault on a page that is not present: map the faulting page, and the
+ * rest of the fault-around window as far as memory allows. Pages around the
+ * faulting one are mapped as for a read fault.
+ */
+static err_t fault_around(struct memregion *region, vaddr_t addr, int write);
+
+static err_t
+fault_around(struct memregion *region, vaddr_t addr, int write)
+{
+    vaddr_t start, end, a, region_end;
+    size_t window;
+    err_t err;
+
+    addr = pg_round_down(addr);
+    region_end = pg_round_up(region->end);
+    if (addr == region->fault_next) {
+        region->fault_streak++;
+        region->fault_down = 0;
+    } else if (addr == region->fault_prev) {
+        region->fault_streak++;
+        region->fault_down = 1;
     } else {
-        panic("Kernel error in page fault handler\n");
+        region->fault_streak = 0;
     }
 
-    // turn on interrupt now that we have the fault address 
-    intr_set_level(INTR_ON);
-    struct proc *p = proc_current();
-    struct memregion *cur_memregion = as_find_memregion(&p->as, fault_addr, 1);
-
-    if (present && write && cur_memregion && 
-    (cur_memregion->perm == MEMPERM_RW || cur_memregion->perm == MEMPERM_URW)) {
-        // allocate a new physical page
-        paddr_t paddr;
-        paddr_t pfault_addr;
-        if (pmem_alloc(&paddr) != ERR_OK) {
-            proc_exit(-1);
+    window = 1;
+    if (region->advice == MADV_SEQUENTIAL) {
+        window = FAULT_AROUND_SEQ_PAGES;
+    } else if (region->advice != MADV_RANDOM) {
+        for (int i = FAULT_AROUND_MIN_STREAK; i <= region->fault_streak && window < FAULT_AROUND_MAX_PAGES; i++) {
+            window *= 2;
         }
-        // copy the data from the copy-on-write page to the newly allocated page
-        memcpy((void*) kmap_p2v(paddr), (void*) pg_round_down(fault_addr), pg_size);
-        // set permission of new page to be the permission of the current memory region
-        vpmap_set_perm(cur_memregion->as->vpmap, kmap_p2v(paddr), pg_size, cur_memregion->perm);
-        // get the physical address of the fault address
-        vpmap_lookup_vaddr(cur_memregion->as->vpmap, pg_round_down(fault_addr), &pfault_addr, NULL);
-        vpmap_map(cur_memregion->as->vpmap, fault_addr, paddr, 1, cur_memregion->perm);
-        // decrement the count of the physical fault address's page
-        pmem_dec_refcnt(pfault_addr);
-        return;
-    }
-
-    if (present) {
-        // is page protection issue, just exit
-        proc_exit(-1);
+    }
+    if (region->fault_down) {
+        start = addr - region->start > (window - 1) * pg_size ? addr - (window - 1) * pg_size : region->start;
+        end = addr + pg_size;
+    } else {
+        start = addr;
+        end = region_end - addr > window * pg_size ? addr + window * pg_size : region_end;
     }
 
-    if (!cur_memregion) {
-        // invalid region, exit
-        proc_exit(-1);
+    // The faulting page must be mapped, the others are a bonus
+    if (region->store) {
+        err = map_store_page(region, addr, write);
+    } else {
+        err = map_zero_page(region, addr);
+    }
+    if (err != ERR_OK) {
+        return err;
+    }
+    for (a = start; a != end; a += pg_size) {
+        if (a == addr || vpmap_lookup_vaddr(region->as->vpmap, a, NULL, NULL) == ERR_OK) {
+            continue;
+        }
+        if ((region->store ? map_store_page(region, a, 0) : map_zero_page(region, a)) != ERR_OK) {
+            break;
+        }
     }
 
-    if (write && (cur_memregion->perm == MEMPERM_R || cur_memregion->perm == MEMPERM_UR)) {
-        // invalid permission
-        proc_exit(-1);
+    region->fault_next = end;
+    region->fault_prev = start - pg_size;
+    return ERR_OK;
+}
+
+void
+pgfault_init(void)
+{
+    for (int i = 0; i < N_COW_LOCKS; i++) {
+        sleeplock_init(&cow_locks[i]);
+    }
+}
+
+static err_t
+handle_cow_fault(struct memregion *region, vaddr_t addr)
+{
+    struct vpmap *vpmap;
+    struct sleeplock *lock;
+    paddr_t old, new;
+    err_t err;
+
+    vpmap = region->as->vpmap;
+    addr = pg_round_down(addr);
+    // The faulting entry may live in a page table shared since fork. Take a
+    // private copy first, which also accounts the page's references.
+    if ((err = vpmap_unshare(vpmap, addr)) != ERR_OK) {
+        return err;
+    }
+    if (region->shared) {
+        vpmap_set_perm(vpmap, addr, 1, region->perm);
+        return ERR_OK;
+    }
+    if ((err = vpmap_lookup_vaddr(vpmap, addr, &old, NULL)) != ERR_OK) {
+        return err;
+    }
+
+    region->as->ncow++;
+    lock = &cow_locks[(old / pg_size) % N_COW_LOCKS];
+    sleeplock_acquire(lock);
+    if (pmem_get_refcnt(old) == 1) {
+        // Other sharers are gone, take over the page
+        vpmap_set_perm(vpmap, addr, 1, region->perm);
+    } else if ((err = pmem_alloc_class(&new, PMEM_CLASS_ANON)) == ERR_OK) {
+        memcpy((void*) kmap_p2v(new), (void*) kmap_p2v(old), pg_size);
+        if ((err = vpmap_map(vpmap, addr, new, 1, region->perm)) != ERR_OK) {
+            pmem_free(new);
+        } else {
+            pmem_dec_refcnt(old);
+        }
     }
-    
+    sleeplock_release(lock);
+    return err;
+}
+
+static err_t
+map_zero_page(struct memregion *region, vaddr_t addr)
+{
     paddr_t paddr;
-    if (pmem_alloc(&paddr) != ERR_OK) {
-        proc_exit(-1);
+    err_t err;
+
+    if ((err = pmem_alloc_class(&paddr, PMEM_CLASS_ANON)) != ERR_OK) {
+        return err;
     }
     memset((void*) kmap_p2v(paddr), 0, pg_size);
+    if ((err = vpmap_map(region->as->vpmap, addr, paddr, 1, region->perm)) != ERR_OK) {
+        pmem_free(paddr);
+    }
+    return err;
+}
 
-    err_t alloc_status = vpmap_map(cur_memregion->as->vpmap, fault_addr, paddr, 1, cur_memregion->perm);
+static err_t
+map_store_page(struct memregion *region, vaddr_t addr, int write)
+{
+    struct memstore *store;
+    struct page *page;
+    paddr_t paddr;
+    offset_t rofs;
+    size_t nbytes;
+    err_t err;
 
-    if (alloc_status != ERR_OK) {
-        proc_exit(-1);
+    store = region->store;
+    addr = pg_round_down(addr);
+    rofs = addr - region->start;
+    if (rofs >= region->filesz) {
+        // Past the part of the region backed by the store (e.g. bss)
+        return map_zero_page(region, addr);
+    }
+    nbytes = region->filesz - rofs < pg_size ? region->filesz - rofs : pg_size;
+
+    sleeplock_acquire(&store->pgcache_lock);
+    if ((page = pgcache_get_page(store, region->ofs + rofs)) == NULL) {
+        sleeplock_release(&store->pgcache_lock);
+        return ERR_NOMEM;
+    }
+    if (region->shared || (nbytes == pg_size && !(write && is_write_memperm(region->perm)))) {
+        // Map the cached page itself
+        paddr = page_to_paddr(page);
+        pmem_inc_refcnt(paddr, 1);
+        if ((err = vpmap_map(region->as->vpmap, addr, paddr, 1,
+                region->shared ? region->perm : MEMPERM_UR)) != ERR_OK) {
+            pmem_dec_refcnt(paddr);
+        }
+    } else if ((err = pmem_alloc_class(&paddr, PMEM_CLASS_ANON)) == ERR_OK) {
+        // Private copy of the cached page
+        memcpy((void*) kmap_p2v(paddr), (void*) kmap_p2v(page_to_paddr(page)), nbytes);
+        memset((void*) (kmap_p2v(paddr) + nbytes), 0, pg_size - nbytes);
+        if ((err = vpmap_map(region->as->vpmap, addr, paddr, 1, region->perm)) != ERR_OK) {
+            pmem_free(paddr);
+        }
     }
+    sleeplock_release(&store->pgcache_lock);
+    return err;
+}
+
 
-    return;
+err_t
+handle_page_fault(vaddr_t fault_addr, int present, int write, int user) {
+    struct proc *p;
+    struct memregion *cur_memregion;
+    err_t err;
+
+    if (user) {
+        __sync_add_and_fetch(&user_pgfault, 1);
+    } else if (fault_addr >= USTACK_UPPERBOUND || proc_current() == NULL) {
+        // The kernel only faults on user addresses, touching user memory on
+        // behalf of a syscall, e.g. a page of a lazily mapped segment. Those
+        // are resolved below as if the process had touched the page itself,
+        // and fail the access instead of the process if that is not possible.
+        panic("Kernel error in page fault handler\n");
+    }
+
+    // turn on interrupt now that we have the fault address 
+    intr_set_level(INTR_ON);
+    p = proc_current();
+    p->as.nfaults++;
+    cur_memregion = as_find_memregion(&p->as, fault_addr, 1);
+
+    if (present && write && cur_memregion && is_write_memperm(cur_memregion->perm)) {
+        // copy-on-write page
+        err = handle_cow_fault(cur_memregion, fault_addr);
+    } else if (present || !cur_memregion) {
+        // page protection issue, or invalid region
+        err = ERR_FAULT;
+    } else if (write && !is_write_memperm(cur_memregion->perm)) {
+        // invalid permission
+        err = ERR_FAULT;
+    } else {
+        err = fault_around(cur_memregion, fault_addr, write);
+    }
+
+    if (err != ERR_OK && user) {
+        proc_exit(-1);
+    }
+    return err;
 }
@@ -24,6 +24,14 @@ static void ptable_dump(void);
 static err_t proc_load(struct proc *p, char *path, vaddr_t *entry_point);
 /* helper function to set up the stack */
 static err_t stack_setup(struct proc *p, char **argv, vaddr_t* ret_stackptr);
+/* create a process and start it, files of ``from`` are inherited if not NULL */
+static err_t proc_spawn_internal(char *name, char **argv, struct proc *from,
+    struct spawn_action *actions, int nactions, struct proc **p);
+/* copy the open files of ``from`` into p, then apply file actions in order */
+static err_t proc_setup_files(struct proc *p, struct proc *from,
+    struct spawn_action *actions, int nactions);
+/* close all open files of a process */
+static void proc_close_files(struct proc *p);
 /* tranlsates a kernel vaddr to a user stack address, assumes stack is a single page */
 #define USTACK_ADDR(addr) (pg_ofs(addr) + USTACK_UPPERBOUND - pg_size);
 
@@ -85,6 +93,35 @@ get_proc_by_pid(pid_t pid)
     return NULL;
 }
 
+void
+proc_get_info(struct proc *p, struct proc_info *info)
+{
+    kassert(p && info);
+    info->pid = p->pid;
+    info->ppid = p->parent_pid;
+    memcpy(info->name, p->name, PROC_NAME_LEN);
+    info->name[PROC_NAME_LEN - 1] = '\0';
+    info->alive = p->proc_status == STATUS_ALIVE;
+    info->rss = p->as.rss.resident;
+    info->rss_shared = p->as.rss.shared;
+    info->rss_peak = p->as.rss.peak;
+    info->pgfault = p->as.nfaults;
+    info->cow = p->as.ncow;
+}
+
+int
+proc_list_info(struct proc_info *info, int n)
+{
+    int i = 0;
+
+    spinlock_acquire(&ptable_lock);
+    for (Node *node = list_begin(&ptable); node != list_end(&ptable) && i < n; node = list_next(node)) {
+        proc_get_info(list_entry(node, struct proc, proc_node), &info[i++]);
+    }
+    spinlock_release(&ptable_lock);
+    return i;
+}
+
 /*
  * Allocate and initialize basic proc structure
 */
@@ -137,6 +174,78 @@ proc_init(char* name)
 
 err_t
 proc_spawn(char* name, char** argv, struct proc **p)
+{
+    return proc_spawn_internal(name, argv, NULL, NULL, 0, p);
+}
+
+err_t
+proc_spawn_fa(char *name, char **argv, struct spawn_action *actions, int nactions, struct proc **p)
+{
+    kassert(proc_current());
+    return proc_spawn_internal(name, argv, proc_current(), actions, nactions, p);
+}
+
+static err_t
+proc_setup_files(struct proc *p, struct proc *from, struct spawn_action *actions, int nactions)
+{
+    struct file *f;
+    int i;
+
+    spinlock_acquire(&ptable_lock);
+    for (i = 0; i < PROC_MAX_FILE; i++) {
+        if ((p->open_files[i] = from->open_files[i]) != NULL) {
+            fs_reopen_file(p->open_files[i]);
+        }
+    }
+    spinlock_release(&ptable_lock);
+
+    for (i = 0; i < nactions; i++) {
+        if (actions[i].fd < 0 || actions[i].fd >= PROC_MAX_FILE) {
+            return ERR_INVAL;
+        }
+        switch (actions[i].type) {
+            case SPAWN_DUP2:
+                if (actions[i].srcfd < 0 || actions[i].srcfd >= PROC_MAX_FILE ||
+                    (f = p->open_files[actions[i].srcfd]) == NULL) {
+                    return ERR_INVAL;
+                }
+                if (actions[i].fd == actions[i].srcfd) {
+                    break;
+                }
+                fs_reopen_file(f);
+                if (p->open_files[actions[i].fd]) {
+                    fs_close_file(p->open_files[actions[i].fd]);
+                }
+                p->open_files[actions[i].fd] = f;
+                break;
+            case SPAWN_CLOSE:
+                if (p->open_files[actions[i].fd] == NULL) {
+                    return ERR_INVAL;
+                }
+                fs_close_file(p->open_files[actions[i].fd]);
+                p->open_files[actions[i].fd] = NULL;
+                break;
+            default:
+                return ERR_INVAL;
+        }
+    }
+    return ERR_OK;
+}
+
+static void
+proc_close_files(struct proc *p)
+{
+    for (int i = 0; i < PROC_MAX_FILE; i++) {
+        if (p->open_files[i]) {
+            fs_close_file(p->open_files[i]);
+            p->open_files[i] = NULL;
+        }
+    }
+}
+
+static err_t
+proc_spawn_internal(char *name, char **argv, struct proc *from,
+    struct spawn_action *actions, int nactions, struct proc **p)
 {
     err_t err;
     struct proc *proc;
@@ -147,6 +256,9 @@ proc_spawn(char* name, char** argv, struct proc **p)
     if ((proc = proc_init(name)) == NULL) {
         return ERR_NOMEM;
     }
+    if (from && (err = proc_setup_files(proc, from, actions, nactions)) != ERR_OK) {
+        goto error;
+    }
     // load binary of the process
     if ((err = proc_load(proc, name, &entry_point)) != ERR_OK) {
         goto error;
@@ -181,7 +293,11 @@ proc_spawn(char* name, char** argv, struct proc **p)
     }
     return ERR_OK;
 error:
+    if (from) {
+        proc_close_files(proc);
+    }
     as_destroy(&proc->as);
+    fs_release_inode(proc->cwd);
     proc_free(proc);
     return err;
 }
@@ -386,8 +502,6 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
     struct elfhdr elf;
     struct proghdr ph;
     struct file *f;
-    paddr_t paddr;
-    vaddr_t vaddr;
     vaddr_t end = 0;
 
     if ((err = fs_open_file(path, FS_RDONLY, 0, &f)) != ERR_OK) {
@@ -396,19 +510,25 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
 
     // check if the file is actually an executable file
     if (fs_read_file(f, (void*) &elf, sizeof(elf), &ofs) != sizeof(elf) || elf.magic != ELF_MAGIC) {
-        return ERR_INVAL;
+        err = ERR_INVAL;
+        goto done;
     }
 
     // read elf and load binary
     for (i = 0, ofs = elf.phoff; i < elf.phnum; i++) {
         if (fs_read_file(f, (void*) &ph, sizeof(ph), &ofs) != sizeof(ph)) {
-            return ERR_INVAL;
+            err = ERR_INVAL;
+            goto done;
         }
         if(ph.type != PT_LOAD)
             continue;
 
-        if(ph.memsz < ph.filesz || ph.vaddr + ph.memsz < ph.vaddr) {
-            return ERR_INVAL;
+        // segments are mapped page by page from the file, so the file offset
+        // and the virtual address must agree within a page
+        if(ph.memsz < ph.filesz || ph.vaddr + ph.memsz < ph.vaddr ||
+           pg_ofs(ph.vaddr) != pg_ofs(ph.off)) {
+            err = ERR_INVAL;
+            goto done;
         }
 
         memperm_t perm = MEMPERM_UR;
@@ -416,50 +536,37 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
             perm = MEMPERM_URW;
         }
 
-        // found loadable section, add as a memregion
-        struct memregion *r = as_map_memregion(&p->as, pg_round_down(ph.vaddr), 
-            pg_round_up(ph.memsz + pg_ofs(ph.vaddr)), perm, NULL, ph.off, False);
+        // found loadable section, map it from the file. Pages are read in by
+        // the page fault handler on first access, and writable segments get
+        // private copies.
+        struct memregion *r = as_map_memregion(&p->as, pg_round_down(ph.vaddr),
+            pg_round_up(ph.memsz + pg_ofs(ph.vaddr)), perm, f->f_inode->store,
+            pg_round_down(ph.off), False);
         if (r == NULL) {
-            return ERR_NOMEM;
+            err = ERR_NOMEM;
+            goto done;
         }
-        end = r->end;
-
-        // pre-page in code and data, may span over multiple pages
-        int count = 0;
-        size_t avail_bytes;
-        size_t read_bytes = ph.filesz;
-        size_t pages = pg_round_up(ph.memsz + pg_ofs(ph.vaddr)) / pg_size;
-        // vaddr may start at a nonaligned address
-        vaddr = pg_ofs(ph.vaddr);
-        while (count < pages) {
-            // allocate a physical page and zero it first
-            if ((err = pmem_alloc(&paddr)) != ERR_OK) {
-                return err;
-            }
-            vaddr += kmap_p2v(paddr);
-            memset((void*)pg_round_down(vaddr), 0, pg_size);
-            // calculate how many bytes to read from file
-            avail_bytes = read_bytes < (pg_size - pg_ofs(vaddr)) ? read_bytes : (pg_size - pg_ofs(vaddr));
-            if (avail_bytes && fs_read_file(f, (void*)vaddr, avail_bytes, &ph.off) != avail_bytes) {
-                return ERR_INVAL;
-            }
-            // map physical page with code/data content to expected virtual address in the page table
-            if ((err = vpmap_map(p->as.vpmap, ph.vaddr+count*pg_size, paddr, 1, perm)) != ERR_OK) {
-                return err;
-            }
-            read_bytes -= avail_bytes;
-            count++;
-            vaddr = 0;
+        // memory past the file content (bss) is zero-filled. A segment
+        // without bss is backed by the file up to its last page, so even
+        // that page can be shared through the page cache.
+        if (ph.filesz < ph.memsz) {
+            r->filesz = pg_ofs(ph.vaddr) + ph.filesz;
         }
+        end = r->end;
     }
     *entry_point = elf.entry;
 
     // create memregion for heap after data segment
     if ((p->as.heap = as_map_memregion(&p->as, end, 0, MEMPERM_URW, NULL, 0, 0)) == NULL) {
-        return ERR_NOMEM;
+        err = ERR_NOMEM;
+        goto done;
     }
+    err = ERR_OK;
 
-    return ERR_OK;
+done:
+    // memregions hold their own reference to the file
+    fs_close_file(f);
+    return err;
 }
 
 err_t
@@ -471,7 +578,7 @@ stack_setup(struct proc *p, char **argv, vaddr_t* ret_stackptr)
     vaddr_t stacktop = USTACK_UPPERBOUND-pg_size; // lowest address
 
     // allocate a page of physical memory for stack
-    if ((err = pmem_alloc(&paddr)) != ERR_OK) {
+    if ((err = pmem_alloc_class(&paddr, PMEM_CLASS_ANON)) != ERR_OK) {
         return err;
     }
     memset((void*) kmap_p2v(paddr), 0, pg_size);
@@ -3,6 +3,7 @@
 #include <kernel/console.h>
 #include <kernel/thread.h>
 #include <kernel/sched.h>
+#include <kernel/vpmap.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 
@@ -51,7 +52,10 @@ spinlock_acquire(struct spinlock* lock)
 
     kassert(lock->holder == NULL || lock->holder != curr);
 
-    while (lock->lock_status || __sync_lock_test_and_set(&lock->lock_status, 1) != 0);
+    while (lock->lock_status || __sync_lock_test_and_set(&lock->lock_status, 1) != 0) {
+        // The holder may be waiting for us to flush our TLB
+        vpmap_flush_pending();
+    }
 
     // Tell the C compiler and the processor to not move loads or stores
     // past this point, to ensure that the critical section's memory
@@ -2,13 +2,16 @@
 #include <kernel/thread.h>
 #include <kernel/console.h>
 #include <kernel/kmalloc.h>
+#include <kernel/pmem.h>
 #include <kernel/fs.h>
+#include <kernel/pgfault.h>
 #include <lib/syscall-num.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 #include <lib/string.h>
 #include <arch/asm.h>
 #include <kernel/pipe.h>
+#include <kernel/shmms.h>
 
 // syscall handlers
 static sysret_t sys_fork(void* arg);
@@ -34,10 +37,20 @@ static sysret_t sys_dup(void* arg);
 static sysret_t sys_pipe(void* arg);
 static sysret_t sys_info(void* arg);
 static sysret_t sys_halt(void* arg);
+static sysret_t sys_memstat(void* arg);
+static sysret_t sys_spawnfa(void* arg);
+static sysret_t sys_mmap(void* arg);
+static sysret_t sys_munmap(void* arg);
+static sysret_t sys_msync(void* arg);
+static sysret_t sys_shm_open(void* arg);
+static sysret_t sys_shm_unlink(void* arg);
+static sysret_t sys_madvise(void* arg);
+static sysret_t sys_procinfo(void* arg);
 
 extern size_t user_pgfault;
 struct sys_info {
     size_t num_pgfault;
+    struct proc_info proc;
 };
 
 /*
@@ -53,6 +66,11 @@ static bool validate_str(char *s);
  * Validate buffer passed by user.
  */
 static bool validate_ptr(void* ptr, size_t size);
+/*
+ * Validate buffer passed by user for the kernel to write to: the memory must
+ * also be writable by the user.
+ */
+static bool validate_out_ptr(void* ptr, size_t size);
 /*
  * Validate file fd.
  */
@@ -61,6 +79,12 @@ static bool validate_fd(int fd);
  * Look through process’s open file table to find an available fd, and store the pointer.
  */
 static int alloc_fd(struct file *f);
+/*
+ * Split a space separated argument string into a kernel argv array. ``buf``
+ * holds the argument strings. Caller frees both ``buf`` and ``argv``.
+ * Return ERR_INVAL if there is no argument.
+ */
+static err_t parse_args(char *args, char **buf, char ***argv);
 
 static sysret_t (*syscalls[])(void*) = {
     [SYS_fork] = sys_fork,
@@ -86,6 +110,15 @@ static sysret_t (*syscalls[])(void*) = {
     [SYS_pipe] = sys_pipe,
     [SYS_info] = sys_info,
     [SYS_halt] = sys_halt,
+    [SYS_memstat] = sys_memstat,
+    [SYS_spawnfa] = sys_spawnfa,
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,
+    [SYS_msync] = sys_msync,
+    [SYS_shm_open] = sys_shm_open,
+    [SYS_shm_unlink] = sys_shm_unlink,
+    [SYS_madvise] = sys_madvise,
+    [SYS_procinfo] = sys_procinfo,
 };
 
 static bool
@@ -116,6 +149,19 @@ validate_ptr(void* ptr, size_t size)
     return as_find_memregion(&proc_current()->as, ptraddr, size) != NULL;
 }
 
+static bool
+validate_out_ptr(void* ptr, size_t size)
+{
+    struct memregion *mr;
+    vaddr_t ptraddr = (vaddr_t) ptr;
+    if (ptraddr + size < ptraddr) {
+        return False;
+    }
+    // A kernel write to read-only user memory would fault
+    mr = as_find_memregion(&proc_current()->as, ptraddr, size);
+    return mr != NULL && is_write_memperm(mr->perm);
+}
+
 static int alloc_fd(struct file *f) {
     struct proc *p;
     p = proc_current();
@@ -146,43 +192,100 @@ sys_fork(void *arg)
     return p->pid;
 }
 
-// int spawn(const char *args);
-static sysret_t
-sys_spawn(void *arg)
+static err_t
+parse_args(char *args, char **ret_buf, char ***ret_argv)
 {
     int argc = 0;
-    sysarg_t args;
     size_t len;
-    char *token, *buf, **argv;
-    struct proc *p;
-    err_t err;
-
-    // argument fetching and validating
-    kassert(fetch_arg(arg, 1, &args));
-    if (!validate_str((char*)args)) {
-        return ERR_FAULT;
-    }
+    char *token, *buf, *save, **argv;
 
-    len = strlen((char*)args) + 1;
+    len = strlen(args) + 1;
     if ((buf = kmalloc(len)) == NULL) {
         return ERR_NOMEM;
     }
     // make a copy of the string to not modify user data
-    memcpy(buf, (void*)args, len);
+    memcpy(buf, args, len);
     // figure out max number of arguments possible
     len = len / 2 < PROC_MAX_ARG ? len/2 : PROC_MAX_ARG;
     if ((argv = kmalloc((len+1)*sizeof(char*))) == NULL) {
         kfree(buf);
         return ERR_NOMEM;
     }
-    // parse arguments  
-    while ((token = strtok_r(NULL, " ", &buf)) != NULL) {
+    // parse arguments
+    save = buf;
+    while (argc < len && (token = strtok_r(NULL, " ", &save)) != NULL) {
         argv[argc] = token;
         argc++;
     }
     argv[argc] = NULL;
+    if (argc == 0) {
+        kfree(argv);
+        kfree(buf);
+        return ERR_INVAL;
+    }
+    *ret_buf = buf;
+    *ret_argv = argv;
+    return ERR_OK;
+}
 
-    if ((err = proc_spawn(argv[0], argv, &p)) != ERR_OK) {
+// int spawn(const char *args);
+static sysret_t
+sys_spawn(void *arg)
+{
+    sysarg_t args;
+    char *buf, **argv;
+    struct proc *p;
+    err_t err;
+
+    // argument fetching and validating
+    kassert(fetch_arg(arg, 1, &args));
+    if (!validate_str((char*)args)) {
+        return ERR_FAULT;
+    }
+
+    if ((err = parse_args((char*)args, &buf, &argv)) != ERR_OK) {
+        return err;
+    }
+    err = proc_spawn(argv[0], argv, &p);
+    kfree(argv);
+    kfree(buf);
+    if (err != ERR_OK) {
+        return err;
+    }
+    return p->pid;
+}
+
+// int spawnfa(const char *args, const struct spawn_action *actions, int nactions);
+static sysret_t
+sys_spawnfa(void *arg)
+{
+    sysarg_t args, actions, nactions;
+    struct spawn_action kactions[SPAWN_MAX_ACTIONS];
+    char *buf, **argv;
+    struct proc *p;
+    err_t err;
+
+    kassert(fetch_arg(arg, 1, &args));
+    kassert(fetch_arg(arg, 2, &actions));
+    kassert(fetch_arg(arg, 3, &nactions));
+
+    if ((int)nactions < 0 || (int)nactions > SPAWN_MAX_ACTIONS) {
+        return ERR_INVAL;
+    }
+    if (!validate_str((char*)args) || (nactions > 0 &&
+        !validate_ptr((void*)actions, (int)nactions * sizeof(struct spawn_action)))) {
+        return ERR_FAULT;
+    }
+    // copy the actions so the user can't change them under us
+    memcpy(kactions, (void*)actions, (int)nactions * sizeof(struct spawn_action));
+
+    if ((err = parse_args((char*)args, &buf, &argv)) != ERR_OK) {
+        return err;
+    }
+    err = proc_spawn_fa(argv[0], argv, kactions, (int)nactions, &p);
+    kfree(argv);
+    kfree(buf);
+    if (err != ERR_OK) {
         return err;
     }
     return p->pid;
@@ -198,7 +301,7 @@ sys_wait(void* arg)
     kassert(fetch_arg(arg, 1, &pid));
     kassert(fetch_arg(arg, 2, &wstatus));
 
-    if (wstatus && !validate_ptr((void *) wstatus, sizeof(wstatus))) {
+    if (wstatus && !validate_out_ptr((void *) wstatus, sizeof(wstatus))) {
         return ERR_FAULT;
     }
 
@@ -322,7 +425,7 @@ sys_read(void* arg)
     kassert(fetch_arg(arg, 3, &count));
     kassert(fetch_arg(arg, 2, &buf));
 
-    if (!validate_ptr((void*)buf, (size_t)count)) {
+    if (!validate_out_ptr((void*)buf, (size_t)count)) {
         return ERR_FAULT;
     }
 
@@ -460,7 +563,7 @@ sys_readdir(void *arg)
         return ERR_INVAL;
     }
 
-     if (!validate_ptr((void*)dirent, sizeof(struct dirent))) {
+     if (!validate_out_ptr((void*)dirent, sizeof(struct dirent))) {
         return ERR_FAULT;
     }
 
@@ -497,7 +600,7 @@ sys_fstat(void *arg)
     kassert(fetch_arg(arg, 1, &fd));
     kassert(fetch_arg(arg, 2, &stat));
 
-    if (!validate_ptr((void*)stat, sizeof(struct stat))) {
+    if (!validate_out_ptr((void*)stat, sizeof(struct stat))) {
         return ERR_FAULT;
     }
 
@@ -546,6 +649,7 @@ static sysret_t
 sys_meminfo(void *arg)
 {
     as_meminfo(&proc_current()->as);
+    pmem_frag_info();
     return ERR_OK;
 }
 
@@ -584,7 +688,7 @@ sys_pipe(void* arg)
 
     kassert(fetch_arg(arg, 1, &fds));
 
-    if (!validate_ptr((void *) fds, sizeof(fds))) {
+    if (!validate_out_ptr((void *) fds, sizeof(fds))) {
         return ERR_FAULT;
     }
 
@@ -623,11 +727,12 @@ sys_info(void* arg)
 
     kassert(fetch_arg(arg, 1, &info));
 
-    if (!validate_ptr((void*)info, sizeof(struct sys_info))) {
+    if (!validate_out_ptr((void*)info, sizeof(struct sys_info))) {
         return ERR_FAULT;
     }
     // fill in using user_pgfault 
     ((struct sys_info*)info)->num_pgfault = user_pgfault;
+    proc_get_info(proc_current(), &((struct sys_info*)info)->proc);
     return ERR_OK;
 }
 
@@ -639,6 +744,213 @@ sys_halt(void* arg)
     panic("shutdown failed");
 }
 
+// int memstat(struct memstat *stat);
+static sysret_t
+sys_memstat(void* arg)
+{
+    sysarg_t stat;
+    struct memstat buf;
+
+    kassert(fetch_arg(arg, 1, &stat));
+
+    if (!validate_out_ptr((void*)stat, sizeof(struct memstat))) {
+        return ERR_FAULT;
+    }
+    // pmem_lock can't be held while touching user memory
+    pmem_get_stat(&buf);
+    return copy_user((void*)stat, &buf, sizeof(struct memstat));
+}
+
+// void *mmap(void *addr, size_t length, int prot, int flags, int fd, offset_t offset);
+static sysret_t
+sys_mmap(void* arg)
+{
+    sysarg_t addr, length, prot, flags, fd, offset;
+    struct proc *p = proc_current();
+    struct memregion *r;
+    struct memstore *store;
+    struct file *f;
+    int shared;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+    kassert(fetch_arg(arg, 3, &prot));
+    kassert(fetch_arg(arg, 4, &flags));
+    kassert(fetch_arg(arg, 5, &fd));
+    kassert(fetch_arg(arg, 6, &offset));
+
+    if (length == 0 || !pg_aligned(addr) || !pg_aligned(offset) || addr + length < addr) {
+        return ERR_INVAL;
+    }
+    if (!(prot & PROT_READ) || (prot & ~(PROT_READ | PROT_WRITE))) {
+        return ERR_INVAL;
+    }
+    if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+        return ERR_INVAL;
+    }
+    shared = flags == MAP_SHARED;
+
+    if (!validate_fd(fd) || (f = p->open_files[fd]) == NULL) {
+        return ERR_INVAL;
+    }
+    if (f->shm) {
+        // Shared memory segments do not grow
+        store = f->shm;
+        if (offset + length < offset || offset + length > shmms_size(store)) {
+            return ERR_INVAL;
+        }
+    } else if (f->f_inode && f->f_inode->i_ftype == FTYPE_FILE) {
+        store = f->f_inode->store;
+    } else {
+        return ERR_INVAL;
+    }
+    // The file must be readable, and writable for a shared writable mapping
+    if ((f->oflag & FS_WRONLY) || (shared && (prot & PROT_WRITE) && !(f->oflag & FS_RDWR))) {
+        return ERR_INVAL;
+    }
+
+    if ((r = as_map_memregion(&p->as, addr ? addr : ADDR_ANYWHERE, length,
+            (prot & PROT_WRITE) ? MEMPERM_URW : MEMPERM_UR,
+            store, offset, shared)) == NULL) {
+        return ERR_NOMEM;
+    }
+    return r->start;
+}
+
+// int munmap(void *addr, size_t length);
+static sysret_t
+sys_munmap(void* arg)
+{
+    sysarg_t addr, length;
+    struct proc *p = proc_current();
+    struct memregion *r;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+
+    // Only whole mappings can be removed, and never the heap
+    if ((r = as_find_memregion(&p->as, addr, length)) == NULL || r->start != addr ||
+        pg_round_up(addr + length) != pg_round_up(r->end) || r == p->as.heap) {
+        return ERR_INVAL;
+    }
+    memregion_unmap(r);
+    return ERR_OK;
+}
+
+// int msync(void *addr, size_t length);
+static sysret_t
+sys_msync(void* arg)
+{
+    sysarg_t addr, length;
+    struct memregion *r;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+
+    if ((r = as_find_memregion(&proc_current()->as, addr, length)) == NULL) {
+        return ERR_INVAL;
+    }
+    if (memregion_sync(r, addr, length) != ERR_OK) {
+        return ERR_NORES;
+    }
+    return ERR_OK;
+}
+
+// int shm_open(const char *name, size_t size, int flags);
+static sysret_t
+sys_shm_open(void* arg)
+{
+    sysarg_t name, size, flags;
+    struct file *file;
+    err_t err;
+    int fd;
+
+    kassert(fetch_arg(arg, 1, &name));
+    kassert(fetch_arg(arg, 2, &size));
+    kassert(fetch_arg(arg, 3, &flags));
+
+    if (!validate_str((char*)name)) {
+        return ERR_FAULT;
+    }
+    if (strlen((char*)name) >= SHM_NAME_LEN) {
+        return ERR_INVAL;
+    }
+    if ((err = shmms_open((char*)name, size, flags & SHM_CREAT, &file)) != ERR_OK) {
+        return err;
+    }
+    if ((fd = alloc_fd(file)) < 0) {
+        fs_close_file(file);
+    }
+    return fd;
+}
+
+// int shm_unlink(const char *name);
+static sysret_t
+sys_shm_unlink(void* arg)
+{
+    sysarg_t name;
+
+    kassert(fetch_arg(arg, 1, &name));
+
+    if (!validate_str((char*)name)) {
+        return ERR_FAULT;
+    }
+    return shmms_unlink((char*)name);
+}
+
+// int madvise(void *addr, size_t length, int advice);
+static sysret_t
+sys_madvise(void* arg)
+{
+    sysarg_t addr, length, advice;
+    struct memregion *r;
+    err_t err;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+    kassert(fetch_arg(arg, 3, &advice));
+
+    if (!pg_aligned(addr) || (r = as_find_memregion(&proc_current()->as, addr, length)) == NULL) {
+        return ERR_INVAL;
+    }
+    if ((err = memregion_advise(r, addr, length, (int)advice)) == ERR_VM_INVALID) {
+        return ERR_INVAL;
+    } else if (err != ERR_OK) {
+        return ERR_NORES;
+    }
+    return ERR_OK;
+}
+
+// int procinfo(struct proc_info *info, int n);
+static sysret_t
+sys_procinfo(void* arg)
+{
+    sysarg_t info, n;
+    struct proc_info *buf;
+    int count;
+
+    kassert(fetch_arg(arg, 1, &info));
+    kassert(fetch_arg(arg, 2, &n));
+
+    if ((int)n <= 0 || (int)n > PROC_INFO_MAX) {
+        return ERR_INVAL;
+    }
+    if (!validate_out_ptr((void*)info, (int)n * sizeof(struct proc_info))) {
+        return ERR_FAULT;
+    }
+    // Fill a kernel buffer first, the process table lock can't be held
+    // while touching user memory
+    if ((buf = kmalloc((int)n * sizeof(struct proc_info))) == NULL) {
+        return ERR_NOMEM;
+    }
+    count = proc_list_info(buf, (int)n);
+    if (copy_user((void*)info, buf, count * sizeof(struct proc_info)) != ERR_OK) {
+        count = ERR_FAULT;
+    }
+    kfree(buf);
+    return count;
+}
+
 
 sysret_t
 syscall(int num, void *arg)
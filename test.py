@@ -17,6 +17,7 @@ TIMEOUT = {
     3: 60,
     4: 60,
     5: 60,
+    6: 60,
 }
 
 test_weights = {
@@ -55,7 +56,24 @@ test_weights = {
     "5-cow-large": 14,
     "5-cow-multiple": 20,
     "5-cow-low-mem": 25,
-    "5-REDO-4": 21
+    "5-REDO-4": 21,
+    "6-memstat-test": 10,
+    "6-spawnfa-test": 10,
+    "6-cow-reuse": 10,
+    "6-fault-around": 10,
+    "6-mmap-test": 10,
+    "6-shm-test": 10,
+    "6-pgtable-reclaim": 10,
+    "6-madvise-test": 10,
+    "6-rss-test": 10,
+    "6-readahead-test": 10,
+    "6-writeback-test": 10,
+    "6-pgcache-concurrent": 10,
+    "6-bio-merge-test": 10,
+    "6-pmem-extent-test": 10,
+    "6-fork-pgtable-share": 10,
+    "6-memregion-lookup": 10,
+    "6-tlb-shootdown": 10,
 }
 
 autograder_root = "/autograder"
@@ -0,0 +1,77 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+#define BLK_SIZE 512
+#define LARGEFILE_SIZE (40 * BLK_SIZE)
+#define FILE_SIZE (128 * 1024) // about the largest file sfs holds
+#define FILE_NAME "/bio-merge-test.txt"
+// not a multiple of the block size, so reads straddle blocks and pages
+#define CHUNK 3000
+
+static char buf[FILE_SIZE];
+static char chunk[CHUNK];
+
+// every block holds its own number, so swapped or misplaced sectors show
+static char
+pattern(int i)
+{
+    return 'a' + (i / BLK_SIZE * 7 + i % 13) % 26;
+}
+
+int
+main()
+{
+    int fd, i, n, ofs;
+
+    // a file from the disk image is read from the device in one call, many
+    // adjacent blocks at a time
+    if ((fd = open("/largefile", FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("bio-merge-test: unable to open largefile, return value was %d", fd);
+    }
+    if ((n = read(fd, buf, FILE_SIZE)) != LARGEFILE_SIZE) {
+        error("bio-merge-test: read %d bytes of largefile, expected %d", n, LARGEFILE_SIZE);
+    }
+    for (i = 0; i < LARGEFILE_SIZE; i++) {
+        if (buf[i] != 'a') {
+            error("bio-merge-test: byte %d of largefile is %c, expected a", i, buf[i]);
+        }
+    }
+    close(fd);
+
+    // a large sequential write, committed and written back in merged runs
+    for (i = 0; i < FILE_SIZE; i++) {
+        buf[i] = pattern(i);
+    }
+    if ((fd = open(FILE_NAME, FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("bio-merge-test: unable to create file, return value was %d", fd);
+    }
+    if ((n = write(fd, buf, FILE_SIZE)) != FILE_SIZE) {
+        error("bio-merge-test: wrote %d bytes, expected %d", n, FILE_SIZE);
+    }
+    close(fd);
+
+    // read it back in chunks that do not line up with blocks
+    memset(buf, 0, FILE_SIZE);
+    if ((fd = open(FILE_NAME, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("bio-merge-test: unable to open file, return value was %d", fd);
+    }
+    for (ofs = 0; ofs < FILE_SIZE; ofs += n) {
+        if ((n = read(fd, chunk, CHUNK)) <= 0) {
+            error("bio-merge-test: read failed at offset %d, return value was %d", ofs, n);
+        }
+        for (i = 0; i < n; i++) {
+            if (chunk[i] != pattern(ofs + i)) {
+                error("bio-merge-test: byte %d is %c, expected %c", ofs + i, chunk[i], pattern(ofs + i));
+            }
+        }
+    }
+    assert(ofs == FILE_SIZE);
+    assert(read(fd, chunk, CHUNK) == 0);
+    close(fd);
+
+    assert(unlink(FILE_NAME) == ERR_OK);
+    pass("bio-merge-test");
+    exit(0);
+    return 0;
+}
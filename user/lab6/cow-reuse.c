@@ -0,0 +1,42 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+int
+main()
+{
+    int pid, i;
+    struct memstat st1, st2;
+    size_t PAGES = 16;
+    volatile char *a = sbrk(PAGES * 4096);
+
+    for (i = 0; i < PAGES; i++) {
+        a[i * 4096] = i;
+    }
+
+    // the child exits right away, leaving the parent the only owner of the
+    // copy-on-write pages
+    if ((pid = fork()) == 0) {
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(wait(pid, NULL) == pid);
+
+    assert(memstat(&st1) == ERR_OK);
+    for (i = 0; i < PAGES; i++) {
+        if (a[i * 4096] != i) {
+            error("cow-reuse: page %d lost its content after fork", i);
+        }
+        a[i * 4096] = 'p';
+    }
+    assert(memstat(&st2) == ERR_OK);
+
+    // pages without other owners are reused instead of copied
+    if (st2.n_alloc - st1.n_alloc >= PAGES / 2) {
+        error("cow-reuse: writes allocated %d pages, expected the pages to be reused",
+              st2.n_alloc - st1.n_alloc);
+    }
+
+    pass("cow-reuse");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+int
+main()
+{
+    int i;
+    struct sys_info info1, info2;
+    size_t PAGES = 256;
+    volatile char *a = sbrk(PAGES * 4096);
+
+    // touching the heap linearly should map pages ahead of the faults
+    info(&info1);
+    for (i = 0; i < PAGES; i++) {
+        a[i * 4096] = i;
+    }
+    info(&info2);
+    if (info2.num_pgfault - info1.num_pgfault >= PAGES / 4) {
+        error("fault-around: touching %d pages in order caused %d faults", PAGES,
+              info2.num_pgfault - info1.num_pgfault);
+    }
+    for (i = 0; i < PAGES; i++) {
+        if (a[i * 4096] != (char) i) {
+            error("fault-around: page %d has the wrong content", i);
+        }
+    }
+
+    pass("fault-around");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+// each 2MB of heap needs its own page table
+#define TABLE_PAGES 512
+#define TABLES 32
+#define PAGES (TABLE_PAGES * TABLES)
+
+static char
+original(int i)
+{
+    return i % 251;
+}
+
+int
+main()
+{
+    int pid, i, status, fds[2];
+    char c = 0;
+    struct memstat st1, st2;
+    volatile char *a = sbrk(PAGES * 4096);
+    size_t tables;
+
+    for (i = 0; i < PAGES; i++) {
+        a[i * 4096] = original(i);
+    }
+    assert(pipe(fds) == ERR_OK);
+
+    assert(memstat(&st1) == ERR_OK);
+    if ((pid = fork()) == 0) {
+        close(fds[1]);
+        // wait until the parent has written to the heap after the fork
+        assert(read(fds[0], &c, 1) == 1);
+        for (i = 0; i < PAGES; i++) {
+            if (i % TABLE_PAGES == 2) {
+                a[i * 4096] = 'c';
+            } else if (a[i * 4096] != original(i)) {
+                error("fork-pgtable-share: child sees %d on page %d, expected %d", a[i * 4096], i, original(i));
+            }
+        }
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(memstat(&st2) == ERR_OK);
+
+    // the heap's page tables are shared with the child, not copied
+    tables = st2.class_pages[PMEM_CLASS_PGTABLE] - st1.class_pages[PMEM_CLASS_PGTABLE];
+    if (tables >= TABLES / 2) {
+        error("fork-pgtable-share: fork allocated %d page tables for %d shared ones", tables, TABLES);
+    }
+
+    // a write through a shared table must not reach the other process
+    for (i = 0; i < PAGES; i++) {
+        if (i % TABLE_PAGES == 1) {
+            a[i * 4096] = 'p';
+        }
+    }
+    assert(write(fds[1], &c, 1) == 1);
+    assert(wait(pid, &status) == pid);
+    assert(status == 0);
+
+    for (i = 0; i < PAGES; i++) {
+        if (i % TABLE_PAGES == 1) {
+            assert(a[i * 4096] == 'p');
+        } else if (a[i * 4096] != original(i)) {
+            error("fork-pgtable-share: parent sees %d on page %d, expected %d", a[i * 4096], i, original(i));
+        }
+    }
+
+    pass("fork-pgtable-share");
+    exit(0);
+    return 0;
+}
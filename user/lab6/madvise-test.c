@@ -0,0 +1,87 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+#define PAGES 64
+#define FILE_PAGES 8
+#define FILE_NAME "/madvise-test.txt"
+
+int
+main()
+{
+    struct sys_info info1, info2;
+    struct memstat st1, st2;
+    char buf[512];
+    volatile char *a, *f;
+    int fd, i;
+
+    // page aligned part of a new heap area
+    a = sbrk((PAGES + 1) * 4096);
+    a = (char*)(((size_t)a + 4095) & ~(size_t)4095);
+
+    // bad arguments
+    assert(madvise((void*)(a + 1), 4096, MADV_NORMAL) == ERR_INVAL);
+    assert(madvise((void*)a, 4096, 100) == ERR_INVAL);
+    assert(madvise((void*)a, 1 << 30, MADV_NORMAL) == ERR_INVAL);
+
+    // a sequential region maps a wide window on each fault
+    assert(madvise((void*)a, PAGES * 4096, MADV_SEQUENTIAL) == ERR_OK);
+    info(&info1);
+    for (i = 0; i < PAGES; i++) {
+        a[i * 4096] = i + 1;
+    }
+    info(&info2);
+    if (info2.num_pgfault - info1.num_pgfault > PAGES / 16) {
+        error("madvise-test: touching %d sequential pages caused %d faults", PAGES,
+              info2.num_pgfault - info1.num_pgfault);
+    }
+
+    // dropped anonymous pages go back to the allocator, and come back zeroed
+    assert(memstat(&st1) == ERR_OK);
+    assert(madvise((void*)a, PAGES * 4096, MADV_DONTNEED) == ERR_OK);
+    assert(memstat(&st2) == ERR_OK);
+    if (st1.class_pages[PMEM_CLASS_ANON] - st2.class_pages[PMEM_CLASS_ANON] < PAGES) {
+        error("madvise-test: expected at least %d anonymous pages freed, got %d", PAGES,
+              st1.class_pages[PMEM_CLASS_ANON] - st2.class_pages[PMEM_CLASS_ANON]);
+    }
+
+    // a random region faults on every page
+    assert(madvise((void*)a, PAGES * 4096, MADV_RANDOM) == ERR_OK);
+    info(&info1);
+    for (i = 0; i < PAGES; i++) {
+        if (a[i * 4096] != 0) {
+            error("madvise-test: page %d is %d after MADV_DONTNEED, expected 0", i, a[i * 4096]);
+        }
+    }
+    info(&info2);
+    if (info2.num_pgfault - info1.num_pgfault < PAGES) {
+        error("madvise-test: touching %d random pages caused only %d faults", PAGES,
+              info2.num_pgfault - info1.num_pgfault);
+    }
+
+    // file pages can be read ahead, and dropping private pages reverts them to the file
+    if ((fd = open(FILE_NAME, FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("madvise-test: unable to create file, return value was %d", fd);
+    }
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = 'f';
+    }
+    for (i = 0; i < FILE_PAGES * 4096; i += sizeof(buf)) {
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            error("madvise-test: failed to write file");
+        }
+    }
+    if ((f = mmap(NULL, FILE_PAGES * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == NULL || (ssize_t)f < 0) {
+        error("madvise-test: mmap failed, return value was %p", f);
+    }
+    assert(madvise((void*)f, FILE_PAGES * 4096, MADV_WILLNEED) == ERR_OK);
+    assert(f[0] == 'f' && f[FILE_PAGES * 4096 - 1] == 'f');
+    f[4096] = 'x';
+    assert(madvise((void*)(f + 4096), 4096, MADV_DONTNEED) == ERR_OK);
+    assert(f[4096] == 'f');
+    assert(munmap((void*)f, FILE_PAGES * 4096) == ERR_OK);
+    close(fd);
+
+    pass("madvise-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+#define REGIONS 64
+
+static volatile char *addrs[REGIONS];
+
+int
+main()
+{
+    int fd, i, n;
+    volatile char *a;
+    char buf[16];
+
+    if ((fd = open("/largefile", FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("memregion-lookup: unable to open largefile, return value was %d", fd);
+    }
+    for (i = 0; i < REGIONS; i++) {
+        if ((long)(addrs[i] = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) < 0) {
+            error("memregion-lookup: mmap %d failed, return value was %d", i, addrs[i]);
+        }
+        addrs[i][0] = i;
+    }
+
+    // punch a hole after every mapping, reading into the region just before
+    // each hole so the last region found is always the one going away
+    for (i = 0; i < REGIONS; i += 2) {
+        if ((n = read(fd, (char*)addrs[i], sizeof(buf))) < 0) {
+            error("memregion-lookup: read into region %d returned %d", i, n);
+        }
+        assert(munmap((void*)addrs[i], 4096) == ERR_OK);
+        if ((n = read(fd, (char*)addrs[i], sizeof(buf))) != ERR_FAULT) {
+            error("memregion-lookup: read into unmapped region %d returned %d, expected ERR_FAULT", i, n);
+        }
+    }
+    for (i = 1; i < REGIONS; i += 2) {
+        if (addrs[i][0] != i) {
+            error("memregion-lookup: region %d holds %d", i, addrs[i][0]);
+        }
+    }
+
+    // a new mapping goes into the lowest hole that fits
+    if ((a = mmap(NULL, 4096, PROT_READ, MAP_PRIVATE, fd, 0)) != addrs[0]) {
+        error("memregion-lookup: mmap returned %p, expected the hole at %p", a, addrs[0]);
+    }
+    assert(a[0] == 'a');
+
+    close(fd);
+    pass("memregion-lookup");
+    exit(0);
+    return 0;
+}
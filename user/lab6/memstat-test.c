@@ -0,0 +1,53 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+int
+main()
+{
+    struct memstat st1, st2;
+    size_t i, free_pages, total_lat;
+    size_t PAGES = 10;
+    volatile char *a;
+
+    if (memstat(NULL) != ERR_FAULT) {
+        error("memstat-test: memstat accepted a NULL pointer");
+    }
+    if (memstat((struct memstat*)KMAP_BASE) != ERR_FAULT) {
+        error("memstat-test: memstat accepted a kernel pointer");
+    }
+
+    assert(memstat(&st1) == ERR_OK);
+    if (st1.total_pages == 0 || st1.free_pages > st1.total_pages) {
+        error("memstat-test: bad page counts, total %d, free %d", st1.total_pages, st1.free_pages);
+    }
+    for (i = 0, free_pages = 0; i <= PMEM_MAX_ORDER; i++) {
+        free_pages += st1.free_blocks[i] << i;
+    }
+    if (free_pages != st1.free_pages) {
+        error("memstat-test: free blocks add up to %d pages, expected %d", free_pages, st1.free_pages);
+    }
+
+    // touching new heap pages allocates anonymous memory
+    a = sbrk(PAGES * 4096);
+    for (i = 0; i < PAGES; i++) {
+        a[i * 4096] = i;
+    }
+    assert(memstat(&st2) == ERR_OK);
+    if (st2.class_pages[PMEM_CLASS_ANON] - st1.class_pages[PMEM_CLASS_ANON] < PAGES) {
+        error("memstat-test: expected at least %d anonymous pages allocated, got %d",
+              PAGES, st2.class_pages[PMEM_CLASS_ANON] - st1.class_pages[PMEM_CLASS_ANON]);
+    }
+    if (st2.n_alloc - st1.n_alloc < PAGES) {
+        error("memstat-test: expected at least %d allocations, got %d", PAGES, st2.n_alloc - st1.n_alloc);
+    }
+    for (i = 0, total_lat = 0; i < PMEM_N_LAT_BUCKETS; i++) {
+        total_lat += st2.latency[i];
+    }
+    if (total_lat < st2.n_alloc) {
+        error("memstat-test: latency histogram has %d entries, expected at least %d", total_lat, st2.n_alloc);
+    }
+
+    pass("memstat-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+#define PAGES 3
+#define FILE_SIZE (PAGES * 4096)
+#define FILE_NAME "/mmap-test.txt"
+
+static char
+pattern(int i)
+{
+    return 'a' + (i % 26);
+}
+
+// read the byte at offset ofs of the file through read()
+static char
+read_byte(int ofs)
+{
+    char buf[512];
+    int fd, i, n;
+
+    if ((fd = open(FILE_NAME, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("mmap-test: unable to reopen file, return value was %d", fd);
+    }
+    for (i = 0; i <= ofs; i += n) {
+        if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+            error("mmap-test: read returned %d at offset %d", n, i);
+        }
+    }
+    close(fd);
+    return buf[ofs - (i - n)];
+}
+
+int
+main()
+{
+    char buf[512];
+    volatile char *priv, *shared;
+    int fd, fd2, i, j, pid;
+
+    if ((fd = open(FILE_NAME, FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("mmap-test: unable to create file, return value was %d", fd);
+    }
+    for (i = 0; i < FILE_SIZE; i += sizeof(buf)) {
+        for (j = 0; j < sizeof(buf); j++) {
+            buf[j] = pattern(i + j);
+        }
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            error("mmap-test: failed to write file");
+        }
+    }
+
+    // bad arguments
+    assert(mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED | MAP_PRIVATE, fd, 0) == (void*)ERR_INVAL);
+    assert(mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 1) == (void*)ERR_INVAL);
+    assert(mmap(NULL, 0, PROT_READ, MAP_SHARED, fd, 0) == (void*)ERR_INVAL);
+    assert(mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, 100, 0) == (void*)ERR_INVAL);
+
+    // private mappings see the file content, and keep their writes to themselves
+    if ((priv = mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == NULL || (ssize_t)priv < 0) {
+        error("mmap-test: private mmap failed, return value was %p", priv);
+    }
+    for (i = 0; i < FILE_SIZE; i++) {
+        if (priv[i] != pattern(i)) {
+            error("mmap-test: private mapping byte %d is %c, expected %c", i, priv[i], pattern(i));
+        }
+    }
+    priv[4096] = '!';
+    assert(priv[4096] == '!');
+    assert(msync((void*)priv, FILE_SIZE) == ERR_OK);
+    assert(read_byte(4096) == pattern(4096));
+
+    // writes to a shared mapping reach the file
+    if ((shared = mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == NULL || (ssize_t)shared < 0) {
+        error("mmap-test: shared mmap failed, return value was %p", shared);
+    }
+    assert(shared != priv);
+    assert(shared[FILE_SIZE - 1] == pattern(FILE_SIZE - 1));
+    shared[10] = '1';
+    shared[2 * 4096 + 10] = '2';
+    assert(msync((void*)shared, FILE_SIZE) == ERR_OK);
+    assert(read_byte(10) == '1');
+    assert(read_byte(2 * 4096 + 10) == '2');
+
+    // and writes to the file reach the shared mapping
+    if ((fd2 = open(FILE_NAME, FS_RDWR, EMPTY_MODE)) < 0) {
+        error("mmap-test: unable to reopen file, return value was %d", fd2);
+    }
+    buf[0] = '3';
+    if (write(fd2, buf, 1) != 1) {
+        error("mmap-test: failed to write file");
+    }
+    close(fd2);
+    assert(shared[0] == '3');
+
+    // a child's writes are seen by the parent
+    if ((pid = fork()) == 0) {
+        shared[20] = 'c';
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(wait(pid, NULL) == pid);
+    assert(shared[20] == 'c');
+    assert(read_byte(20) == 'c');
+
+    // munmap only removes whole mappings, and writes back dirty pages
+    assert(munmap((void*)(shared + 4096), 4096) == ERR_INVAL);
+    shared[30] = '4';
+    assert(munmap((void*)shared, FILE_SIZE) == ERR_OK);
+    assert(read_byte(30) == '4');
+    assert(munmap((void*)shared, FILE_SIZE) == ERR_INVAL);
+    assert(munmap((void*)priv, FILE_SIZE) == ERR_OK);
+
+    // a shared writable mapping needs a file opened for writing
+    close(fd);
+    if ((fd = open(FILE_NAME, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("mmap-test: unable to reopen file, return value was %d", fd);
+    }
+    assert(mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == (void*)ERR_INVAL);
+    assert((ssize_t)mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0) > 0);
+    close(fd);
+
+    pass("mmap-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+#define N_FILES 3
+#define N_CHILDREN 4
+#define FILE_SIZE (16 * 1024)
+
+static char buf[512];
+static char *names[N_FILES] = {"/pgcache-a.txt", "/pgcache-b.txt", "/pgcache-c.txt"};
+
+static char
+pattern(int file, int i)
+{
+    return 'a' + (file * 7 + i / 512) % 26;
+}
+
+// read a file through and check its content
+static void
+check_file(int file)
+{
+    int fd, i, j;
+
+    if ((fd = open(names[file], FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("pgcache-concurrent: unable to open %s, return value was %d", names[file], fd);
+    }
+    for (i = 0; i < FILE_SIZE; i += sizeof(buf)) {
+        if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            error("pgcache-concurrent: short read of %s at offset %d", names[file], i);
+        }
+        for (j = 0; j < sizeof(buf); j++) {
+            if (buf[j] != pattern(file, i + j)) {
+                error("pgcache-concurrent: byte %d of %s is %c, expected %c",
+                      i + j, names[file], buf[j], pattern(file, i + j));
+            }
+        }
+    }
+    close(fd);
+}
+
+int
+main()
+{
+    int fd, file, i, status, pid[N_CHILDREN];
+
+    for (file = 0; file < N_FILES; file++) {
+        if ((fd = open(names[file], FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+            error("pgcache-concurrent: unable to create %s, return value was %d", names[file], fd);
+        }
+        for (i = 0; i < FILE_SIZE; i += sizeof(buf)) {
+            memset(buf, pattern(file, i), sizeof(buf));
+            if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+                error("pgcache-concurrent: failed to write %s", names[file]);
+            }
+        }
+        close(fd);
+    }
+
+    // children read the files at the same time, some the same file
+    for (i = 0; i < N_CHILDREN; i++) {
+        if ((pid[i] = fork()) == 0) {
+            for (file = 0; file < N_FILES; file++) {
+                check_file((file + i) % N_FILES);
+            }
+            exit(0);
+        }
+        assert(pid[i] > 0);
+    }
+    for (i = 0; i < N_CHILDREN; i++) {
+        assert(wait(pid[i], &status) == pid[i]);
+        assert(status == 0);
+    }
+
+    for (file = 0; file < N_FILES; file++) {
+        assert(unlink(names[file]) == ERR_OK);
+    }
+    pass("pgcache-concurrent");
+    exit(0);
+    return 0;
+}
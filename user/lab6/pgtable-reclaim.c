@@ -0,0 +1,53 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+// each 2MB of heap needs its own page table
+#define CHUNK (512 * 4096)
+#define CHUNKS 8
+#define ROUNDS 8
+
+int
+main()
+{
+    struct memstat before, grown, after;
+    volatile char *a;
+    int i, r;
+    size_t allocated, freed;
+
+    assert(memstat(&before) == ERR_OK);
+    for (r = 0; r < ROUNDS; r++) {
+        a = sbrk(CHUNK * CHUNKS);
+        for (i = 0; i < CHUNKS; i++) {
+            // memory handed back by sbrk starts out zeroed
+            if (a[i * CHUNK] != 0) {
+                error("pgtable-reclaim: round %d, byte %d is %d, expected 0", r, i * CHUNK, a[i * CHUNK]);
+            }
+            a[i * CHUNK] = 1;
+        }
+        if (r == 0) {
+            assert(memstat(&grown) == ERR_OK);
+            // the first chunk may share a page table with the data segment
+            if (grown.class_pages[PMEM_CLASS_PGTABLE] < before.class_pages[PMEM_CLASS_PGTABLE] + CHUNKS - 1) {
+                error("pgtable-reclaim: expected at least %d new page tables, got %d", CHUNKS - 1,
+                      grown.class_pages[PMEM_CLASS_PGTABLE] - before.class_pages[PMEM_CLASS_PGTABLE]);
+            }
+        }
+        assert(sbrk(-(CHUNK * CHUNKS)) == a + CHUNK * CHUNKS);
+    }
+
+    // shrinking the heap gave the page tables back: every round allocated at
+    // least CHUNKS - 1 page tables, so keeping them would leak far more
+    assert(memstat(&after) == ERR_OK);
+    allocated = 0;
+    for (i = 0; i < PMEM_N_CLASSES; i++) {
+        allocated += after.class_pages[i] - before.class_pages[i];
+    }
+    freed = after.n_free - before.n_free;
+    if (allocated >= freed + CHUNKS) {
+        error("pgtable-reclaim: %d pages allocated but only %d freed", allocated, freed);
+    }
+
+    pass("pgtable-reclaim");
+    exit(0);
+    return 0;
+}
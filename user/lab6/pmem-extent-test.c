@@ -0,0 +1,50 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+// stay under the per-process limit of open files
+#define NPIPES 60
+
+static size_t
+class_total(struct memstat *st)
+{
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < PMEM_N_CLASSES; i++) {
+        total += st->class_pages[i];
+    }
+    return total;
+}
+
+int
+main()
+{
+    int i, fds[2];
+    struct memstat st1, st2;
+    size_t allocated, freed, used;
+
+    assert(memstat(&st1) == ERR_OK);
+
+    // pipes fill new slabs, whose page counts are not powers of two
+    for (i = 0; i < NPIPES; i++) {
+        if (pipe(fds) != ERR_OK) {
+            error("pmem-extent-test: pipe %d failed", i);
+        }
+    }
+
+    assert(memstat(&st2) == ERR_OK);
+
+    // free memory shrinks by exactly the pages handed out, no rounding up
+    allocated = class_total(&st2) - class_total(&st1);
+    freed = st2.n_free - st1.n_free;
+    used = st1.free_pages - st2.free_pages;
+    assert(allocated > 0);
+    if (used != allocated - freed) {
+        error("pmem-extent-test: free pages dropped by %d, but %d were allocated and %d freed",
+              used, allocated, freed);
+    }
+
+    pass("pmem-extent-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+// spans the direct and the indirect blocks of the file
+#define FILE_SIZE (96 * 1024)
+#define FILE_NAME "/readahead-test.txt"
+
+static char buf[4096];
+
+static char
+pattern(int i)
+{
+    return 'a' + (i / 512 + i) % 26;
+}
+
+// read the whole file in chunks of size bytes, and check its content
+static void
+check_file(int size)
+{
+    int fd, i, j, n;
+
+    if ((fd = open(FILE_NAME, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("readahead-test: unable to open file, return value was %d", fd);
+    }
+    for (i = 0; i < FILE_SIZE; i += n) {
+        if ((n = read(fd, buf, size)) != min(size, FILE_SIZE - i)) {
+            error("readahead-test: read returned %d at offset %d", n, i);
+        }
+        for (j = 0; j < n; j++) {
+            if (buf[j] != pattern(i + j)) {
+                error("readahead-test: byte %d is %c, expected %c", i + j, buf[j], pattern(i + j));
+            }
+        }
+    }
+    assert(read(fd, buf, size) == 0);
+    close(fd);
+}
+
+int
+main()
+{
+    int fd, fd2, i, j;
+
+    if ((fd = open(FILE_NAME, FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("readahead-test: unable to create file, return value was %d", fd);
+    }
+    for (i = 0; i < FILE_SIZE; i += sizeof(buf)) {
+        for (j = 0; j < sizeof(buf); j++) {
+            buf[j] = pattern(i + j);
+        }
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            error("readahead-test: failed to write file");
+        }
+    }
+    close(fd);
+
+    // sequential reads of different sizes
+    check_file(512);
+    check_file(4096);
+    check_file(100);
+
+    // two files read the same data at different offsets
+    if ((fd = open(FILE_NAME, FS_RDONLY, EMPTY_MODE)) < 0 ||
+        (fd2 = open(FILE_NAME, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("readahead-test: unable to reopen file");
+    }
+    for (i = 0; i < FILE_SIZE / 2; i += 512) {
+        assert(read(fd2, buf, 512) == 512);
+    }
+    for (i = 0; i < FILE_SIZE / 2; i += 512) {
+        assert(read(fd, buf, 512) == 512 && buf[0] == pattern(i));
+        assert(read(fd2, buf, 512) == 512 && buf[0] == pattern(FILE_SIZE / 2 + i));
+    }
+    close(fd);
+    close(fd2);
+
+    // data written after a read ahead is read back
+    if ((fd = open(FILE_NAME, FS_RDWR, EMPTY_MODE)) < 0) {
+        error("readahead-test: unable to reopen file");
+    }
+    assert(read(fd, buf, 512) == 512);
+    buf[0] = '!';
+    assert(write(fd, buf, 1) == 1);
+    close(fd);
+    if ((fd = open(FILE_NAME, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("readahead-test: unable to reopen file");
+    }
+    assert(read(fd, buf, 512) == 512 && read(fd, buf, 512) == 512);
+    assert(buf[0] == '!');
+    close(fd);
+
+    assert(unlink(FILE_NAME) == ERR_OK);
+    pass("readahead-test");
+    exit(0);
+    return 0;
+}
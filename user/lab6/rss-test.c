@@ -0,0 +1,72 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+#define PAGES 32
+
+static struct proc_info procs[PROC_INFO_MAX];
+
+int
+main()
+{
+    struct sys_info info1, info2, info3;
+    volatile char *a;
+    int i, n, pid, found;
+
+    // touching heap pages makes them resident, and counts this process's faults
+    info(&info1);
+    a = sbrk(PAGES * 4096);
+    for (i = 0; i < PAGES; i++) {
+        a[i * 4096] = i;
+    }
+    info(&info2);
+    // the first page may have been resident already
+    if (info2.proc.rss - info1.proc.rss < PAGES - 1) {
+        error("rss-test: touching %d pages grew rss by %d", PAGES, info2.proc.rss - info1.proc.rss);
+    }
+    assert(info2.proc.pgfault > info1.proc.pgfault);
+    assert(info2.proc.rss_peak >= info2.proc.rss);
+    assert(info2.proc.rss_shared <= info2.proc.rss);
+    assert(info2.proc.pid == getpid());
+
+    // freed pages leave the resident set, the peak stays
+    sbrk(-(PAGES * 4096));
+    info(&info3);
+    if (info2.proc.rss - info3.proc.rss < PAGES - 1) {
+        error("rss-test: shrinking the heap by %d pages shrank rss by %d", PAGES, info2.proc.rss - info3.proc.rss);
+    }
+    assert(info3.proc.rss_peak >= info2.proc.rss);
+
+    // writing to a page shared with the parent breaks copy-on-write
+    a = sbrk(4096);
+    a[0] = 1;
+    if ((pid = fork()) == 0) {
+        info(&info1);
+        assert(info1.proc.rss > 0);
+        a[0] = 2;
+        info(&info2);
+        assert(info2.proc.cow > info1.proc.cow);
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(wait(pid, NULL) == pid);
+
+    // this process shows up in the process list
+    memset(procs, 0, sizeof(procs));
+    assert(procinfo(procs, 0) == ERR_INVAL);
+    assert(procinfo(procs, PROC_INFO_MAX + 1) == ERR_INVAL);
+    if ((n = procinfo(procs, PROC_INFO_MAX)) < 1) {
+        error("rss-test: procinfo returned %d", n);
+    }
+    for (i = 0, found = 0; i < n; i++) {
+        if (procs[i].pid == getpid()) {
+            found = 1;
+            assert(procs[i].alive && procs[i].rss > 0);
+        }
+    }
+    assert(found);
+
+    pass("rss-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+#define SIZE (3 * 4096)
+
+int
+main()
+{
+    volatile char *a, *b;
+    char buf[8];
+    int fd, fd2, pid, i;
+
+    assert(shm_open("shm-test", 0, 0) == ERR_NOTEXIST);
+    assert(shm_open("shm-test", 0, SHM_CREAT) == ERR_INVAL);
+    assert(shm_open("shm-test-name-that-is-far-too-long", SIZE, SHM_CREAT) == ERR_INVAL);
+    if ((fd = shm_open("shm-test", SIZE, SHM_CREAT)) < 0) {
+        error("shm-test: unable to create segment, return value was %d", fd);
+    }
+    // segments can only be mapped
+    assert(read(fd, buf, sizeof(buf)) == ERR_FTYPE);
+    assert(mmap(NULL, SIZE + 4096, PROT_READ, MAP_SHARED, fd, 0) == (void*)ERR_INVAL);
+    assert(mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, SIZE) == (void*)ERR_INVAL);
+
+    if ((a = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == NULL || (ssize_t)a < 0) {
+        error("shm-test: mmap failed, return value was %p", a);
+    }
+    for (i = 0; i < SIZE; i += 512) {
+        if (a[i] != 0) {
+            error("shm-test: new segment byte %d is %d, expected 0", i, a[i]);
+        }
+    }
+    a[0] = 'p';
+    a[SIZE - 1] = 'q';
+
+    if ((pid = fork()) == 0) {
+        // a second mapping of the segment, opened by name, sees the same pages
+        if ((fd2 = shm_open("shm-test", 0, 0)) < 0) {
+            error("shm-test: unable to open segment in child, return value was %d", fd2);
+        }
+        if ((b = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd2, 0)) == NULL || (ssize_t)b < 0) {
+            error("shm-test: child mmap failed, return value was %p", b);
+        }
+        assert(b != a);
+        assert(b[0] == 'p' && b[SIZE - 1] == 'q');
+        b[4096] = 'c';
+        // the mapping inherited through fork is shared too
+        a[1] = 'd';
+        assert(b[1] == 'd');
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(wait(pid, NULL) == pid);
+    assert(a[4096] == 'c');
+    assert(a[1] == 'd');
+
+    // an unlinked segment lives on while it is mapped
+    assert(shm_unlink("shm-test") == ERR_OK);
+    assert(shm_unlink("shm-test") == ERR_NOTEXIST);
+    assert(shm_open("shm-test", 0, 0) == ERR_NOTEXIST);
+    a[2] = 'e';
+    assert(a[2] == 'e' && a[0] == 'p');
+    assert(close(fd) == ERR_OK);
+    assert(munmap((void*)a, SIZE) == ERR_OK);
+
+    // a new segment with the same name starts out zeroed
+    if ((fd = shm_open("shm-test", 4096, SHM_CREAT)) < 0) {
+        error("shm-test: unable to recreate segment, return value was %d", fd);
+    }
+    if ((a = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0)) == NULL || (ssize_t)a < 0) {
+        error("shm-test: mmap failed, return value was %p", a);
+    }
+    assert(a[0] == 0);
+    assert(munmap((void*)a, 4096) == ERR_OK);
+    assert(close(fd) == ERR_OK);
+    assert(shm_unlink("shm-test") == ERR_OK);
+
+    pass("shm-test");
+    exit(0);
+    return 0;
+}
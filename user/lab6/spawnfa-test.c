@@ -0,0 +1,67 @@
+#include <lib/test.h>
+#include <lib/string.h>
+#include <lib/stddef.h>
+
+int
+main()
+{
+    char buf[16];
+    int in[2], out[2];
+    int pid, ret, n;
+    struct spawn_action actions[5];
+
+    // bad arguments
+    if ((ret = spawnfa(NULL, NULL, 0)) != ERR_FAULT) {
+        error("spawnfa-test: spawnfa accepted a NULL path, return value was %d", ret);
+    }
+    if ((ret = spawnfa("cat", NULL, 1)) != ERR_FAULT) {
+        error("spawnfa-test: spawnfa accepted a NULL action list, return value was %d", ret);
+    }
+    if ((ret = spawnfa("cat", actions, -1)) != ERR_INVAL) {
+        error("spawnfa-test: spawnfa accepted a negative action count, return value was %d", ret);
+    }
+    actions[0] = (struct spawn_action) { SPAWN_DUP2, 0, 100 };
+    if ((ret = spawnfa("cat", actions, 1)) != ERR_INVAL) {
+        error("spawnfa-test: spawnfa accepted dup2 of a closed fd, return value was %d", ret);
+    }
+    actions[0] = (struct spawn_action) { 42, 0, 1 };
+    if ((ret = spawnfa("cat", actions, 1)) != ERR_INVAL) {
+        error("spawnfa-test: spawnfa accepted an unknown action, return value was %d", ret);
+    }
+
+    // run cat with its standard input and output redirected to pipes
+    assert(pipe(in) == ERR_OK);
+    assert(pipe(out) == ERR_OK);
+    actions[0] = (struct spawn_action) { SPAWN_DUP2, 0, in[0] };
+    actions[1] = (struct spawn_action) { SPAWN_DUP2, 1, out[1] };
+    actions[2] = (struct spawn_action) { SPAWN_CLOSE, in[1], 0 };
+    actions[3] = (struct spawn_action) { SPAWN_CLOSE, out[0], 0 };
+    actions[4] = (struct spawn_action) { SPAWN_CLOSE, in[0], 0 };
+    if ((pid = spawnfa("cat", actions, 5)) < 0) {
+        error("spawnfa-test: spawnfa failed, return value was %d", pid);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    if (write(in[1], "hello", 5) != 5) {
+        error("spawnfa-test: failed to write to cat");
+    }
+    close(in[1]);
+
+    // cat exits at end of input, which closes the pipe to us
+    memset(buf, 0, sizeof(buf));
+    for (n = 0; n < 5 && (ret = read(out[0], buf + n, sizeof(buf) - 1 - n)) > 0; n += ret);
+    if (strcmp(buf, "hello") != 0) {
+        error("spawnfa-test: expected to read hello from cat, read %s", buf);
+    }
+    if ((ret = wait(pid, NULL)) != pid) {
+        error("spawnfa-test: wait for cat returned %d", ret);
+    }
+    if ((ret = read(out[0], buf, sizeof(buf))) != 0) {
+        error("spawnfa-test: expected end of file after cat exited, read returned %d", ret);
+    }
+
+    pass("spawnfa-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+#define NPROC 4
+#define ROUNDS 100
+#define PAGES 4
+
+// grow the heap, write it, and shrink it again, over and over. The pages
+// come back unmapped and zeroed every round, so an entry a processor kept
+// from an earlier round shows up as an old value.
+static void
+churn(int id, int fds[2])
+{
+    volatile char *a;
+    char c = 0;
+    int r, i, pid, status;
+
+    // start the heap on a page boundary, so shrinking it unmaps every page
+    sbrk((4096 - (size_t)sbrk(0) % 4096) % 4096);
+    for (r = 0; r < ROUNDS; r++) {
+        a = sbrk(PAGES * 4096);
+        for (i = 0; i < PAGES; i++) {
+            if (a[i * 4096] != 0) {
+                error("tlb-shootdown: process %d round %d page %d holds %d, expected 0",
+                      id, r, i, a[i * 4096]);
+            }
+            a[i * 4096] = r + 1;
+        }
+        assert(sbrk(-(PAGES * 4096)) == a + PAGES * 4096);
+
+        // block on the other processes so they switch and move between
+        // processors while the heap changes
+        assert(write(fds[1], &c, 1) == 1);
+        assert(read(fds[0], &c, 1) == 1);
+    }
+
+    // unmapped memory faults, however recently it was used
+    if ((pid = fork()) == 0) {
+        c = a[0];
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(wait(pid, &status) == pid);
+    if (status == 0) {
+        error("tlb-shootdown: process %d read its unmapped heap", id);
+    }
+}
+
+int
+main()
+{
+    int i, pid[NPROC], status, fds[2];
+
+    assert(pipe(fds) == ERR_OK);
+    for (i = 0; i < NPROC; i++) {
+        if ((pid[i] = fork()) == 0) {
+            churn(i, fds);
+            exit(0);
+        }
+        assert(pid[i] > 0);
+    }
+    for (i = 0; i < NPROC; i++) {
+        assert(wait(pid[i], &status) == pid[i]);
+        assert(status == 0);
+    }
+
+    pass("tlb-shootdown");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+#define FILE_SIZE (32 * 1024)
+#define FILE_NAME "/writeback-test.txt"
+#define FILE_NAME2 "/writeback-test2.txt"
+
+static char buf[512];
+
+static char
+pattern(int i, int round)
+{
+    return 'a' + (i / 512 + round) % 26;
+}
+
+// check that the file holds the pattern of round
+static void
+check_file(const char *name, int round)
+{
+    int fd, i, j;
+
+    if ((fd = open(name, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("writeback-test: unable to open file, return value was %d", fd);
+    }
+    for (i = 0; i < FILE_SIZE; i += sizeof(buf)) {
+        if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            error("writeback-test: short read at offset %d", i);
+        }
+        for (j = 0; j < sizeof(buf); j++) {
+            if (buf[j] != pattern(i + j, round)) {
+                error("writeback-test: byte %d is %c, expected %c", i + j, buf[j], pattern(i + j, round));
+            }
+        }
+    }
+    close(fd);
+}
+
+// write the pattern of round to the file, one block per transaction
+static void
+write_file(const char *name, int round)
+{
+    int fd, i;
+
+    if ((fd = open(name, FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("writeback-test: unable to open file, return value was %d", fd);
+    }
+    for (i = 0; i < FILE_SIZE; i += sizeof(buf)) {
+        memset(buf, pattern(i, round), sizeof(buf));
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            error("writeback-test: failed to write file at offset %d", i);
+        }
+    }
+    close(fd);
+}
+
+int
+main()
+{
+    int round;
+
+    // the same inode and data blocks change in many consecutive transactions
+    write_file(FILE_NAME, 0);
+    check_file(FILE_NAME, 0);
+    for (round = 1; round < 4; round++) {
+        write_file(FILE_NAME, round);
+        check_file(FILE_NAME, round);
+    }
+
+    // blocks freed with a file are reused by the next one
+    assert(unlink(FILE_NAME) == ERR_OK);
+    write_file(FILE_NAME2, 5);
+    check_file(FILE_NAME2, 5);
+    assert(unlink(FILE_NAME2) == ERR_OK);
+
+    pass("writeback-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <lib/stdio.h>
+#include <lib/usyscall.h>
+
+static char *class_names[PMEM_N_CLASSES] = {
+    [PMEM_CLASS_OTHER] = "other",
+    [PMEM_CLASS_SLAB] = "slab",
+    [PMEM_CLASS_PGCACHE] = "page cache",
+    [PMEM_CLASS_ANON] = "anonymous",
+    [PMEM_CLASS_PGTABLE] = "page table",
+};
+
+int
+main(int argc, char *argv[])
+{
+    struct memstat st;
+    int i;
+    size_t bound;
+
+    if (memstat(&st) != ERR_OK) {
+        printf("memstat: failed to read memory statistics\n");
+        exit(-1);
+    }
+
+    printf("pages: %d total, %d free\n", st.total_pages, st.free_pages);
+    printf("free blocks per order:\n");
+    for (i = 0; i <= PMEM_MAX_ORDER; i++) {
+        printf("    order %d: %d\n", i, st.free_blocks[i]);
+    }
+    printf("allocations: %d succeeded, %d failed, %d pages freed\n", st.n_alloc, st.n_fail, st.n_free);
+    printf("pages allocated by caller:\n");
+    for (i = 0; i < PMEM_N_CLASSES; i++) {
+        printf("    %s: %d\n", class_names[i], st.class_pages[i]);
+    }
+    printf("allocation latency (cycles):\n");
+    for (i = 0, bound = 1 << PMEM_LAT_BASE_SHIFT; i < PMEM_N_LAT_BUCKETS; i++, bound <<= 2) {
+        if (i < PMEM_N_LAT_BUCKETS - 1) {
+            printf("    < %d: %d\n", bound, st.latency[i]);
+        } else {
+            printf("    >= %d: %d\n", bound >> 2, st.latency[i]);
+        }
+    }
+    printf("compaction: %d attempts, %d succeeded, %d failed, %d pages migrated\n",
+           st.compact_attempts, st.compact_success, st.compact_fail, st.compact_migrated);
+    exit(0);
+    return 0;
+}
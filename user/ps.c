@@ -0,0 +1,39 @@
+#include <lib/stdio.h>
+#include <lib/string.h>
+#include <lib/usyscall.h>
+
+static struct proc_info procs[PROC_INFO_MAX];
+
+/*
+ * List processes with their memory usage, largest resident set first. Sizes
+ * are in pages.
+ */
+int
+main(int argc, char *argv[])
+{
+    struct proc_info tmp;
+    int n, i, j;
+
+    // The kernel copies into the buffer, make sure it is mapped
+    memset(procs, 0, sizeof(procs));
+    if ((n = procinfo(procs, PROC_INFO_MAX)) < 0) {
+        printf("ps: failed to read the process table\n");
+        exit(-1);
+    }
+    for (i = 1; i < n; i++) {
+        tmp = procs[i];
+        for (j = i; j > 0 && procs[j - 1].rss < tmp.rss; j--) {
+            procs[j] = procs[j - 1];
+        }
+        procs[j] = tmp;
+    }
+
+    printf("PID\tPPID\tRSS\tSHR\tPEAK\tFAULTS\tCOW\tNAME\n");
+    for (i = 0; i < n; i++) {
+        printf("%d\t%d\t%d\t%d\t%d\t%d\t%d\t%s%s\n", procs[i].pid, procs[i].ppid, procs[i].rss,
+               procs[i].rss_shared, procs[i].rss_peak, procs[i].pgfault, procs[i].cow, procs[i].name,
+               procs[i].alive ? "" : " <exited>");
+    }
+    exit(0);
+    return 0;
+}
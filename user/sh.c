@@ -7,10 +7,12 @@
 
 #define MAXLINE 256
 #define MAXARGS 64
+#define MAXCMDS 8
 
 static char prompt[] = "$ ";
 
 void eval(char *cmdline);
+void eval_pipeline(char *cmdline);
 int builtin_cmd(char **argv);
 void parseline(const char *cmdline, char **argv);
 void malloc_test(void);
@@ -49,6 +51,10 @@ eval(char *cmdline)
         if (c != NULL) {
             *c = '\0';
         }
+        if (strchr(cmdline, '|') != NULL) {
+            eval_pipeline(cmdline);
+            return;
+        }
         // shell waits for the foreground job to terminate
         if ((pid = spawn(cmdline)) > 0) {
             wait(pid, &status);
@@ -58,6 +64,78 @@ eval(char *cmdline)
     return;
 }
 
+/*
+ * eval_pipeline - Run the commands of a pipeline, each reading the output of
+ *    the previous one. Commands are spawned with their standard input and
+ *    output redirected to pipes, without forking the shell.
+ */
+void
+eval_pipeline(char *cmdline)
+{
+    char *cmds[MAXCMDS];
+    int pids[MAXCMDS];
+    struct spawn_action actions[5];
+    int ncmds, nactions, i, status;
+    int fds[2], prev_rd = -1;
+    char *c;
+
+    // split the pipeline into commands
+    for (ncmds = 0, c = cmdline; c != NULL && ncmds < MAXCMDS; ncmds++) {
+        cmds[ncmds] = c;
+        if ((c = strchr(c, '|')) != NULL) {
+            *c++ = '\0';
+        }
+    }
+
+    for (i = 0; i < ncmds; i++) {
+        nactions = 0;
+        fds[0] = fds[1] = -1;
+        if (i + 1 < ncmds && pipe(fds) != ERR_OK) {
+            printf("pipe failed\n");
+            ncmds = i;
+            break;
+        }
+        // read from the previous command
+        if (prev_rd >= 0) {
+            actions[nactions++] = (struct spawn_action) { SPAWN_DUP2, 0, prev_rd };
+            actions[nactions++] = (struct spawn_action) { SPAWN_CLOSE, prev_rd, 0 };
+        }
+        // write to the next command
+        if (fds[1] >= 0) {
+            actions[nactions++] = (struct spawn_action) { SPAWN_DUP2, 1, fds[1] };
+            actions[nactions++] = (struct spawn_action) { SPAWN_CLOSE, fds[1], 0 };
+            actions[nactions++] = (struct spawn_action) { SPAWN_CLOSE, fds[0], 0 };
+        }
+        if ((pids[i] = spawnfa(cmds[i], actions, nactions)) < 0) {
+            printf("failed to spawn %s: %d\n", cmds[i], pids[i]);
+        }
+        // only the children keep the pipe ends they use
+        if (prev_rd >= 0) {
+            close(prev_rd);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        prev_rd = fds[0];
+    }
+    if (prev_rd >= 0) {
+        close(prev_rd);
+    }
+
+    status = -1;
+    for (i = 0; i < ncmds; i++) {
+        if (pids[i] > 0) {
+            wait(pids[i], &status);
+        }
+    }
+    // the status of a pipeline is the one of its last command
+    if (ncmds == 0 || pids[ncmds-1] <= 0) {
+        printf("foregroud job %s failed to run\n", cmdline);
+        return;
+    }
+    printf("foregroud job %s exited with status %d\n", cmds[ncmds-1], status);
+}
+
 /*
  * builtin_cmd - If the user has typed a built-in command then execute
  *    it immediately.